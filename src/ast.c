@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "libnez.h"
+#include "nezvm.h"
+#include "ast.h"
+
+#define NEZVM_AST_ALIGN(N) (((N) + 7) & ~(uint64_t)7)
+#define NEZVM_AST_INIT_SIZE 4096
+
+/* columns of the nodes seen so far and the path to the open one */
+typedef struct AstBuilder {
+  int64_t *start;
+  int64_t *end;
+  int64_t *first_child;
+  int64_t *next_sibling;
+  int32_t *tag;
+  long size;
+  long capacity;
+  long *open;        /* open nodes, outermost first */
+  long *last_child;  /* of each open node, or -1 */
+  long depth;
+  long open_capacity;
+  int error;
+} AstBuilder;
+
+static int nez_GrowAst(AstBuilder *b) {
+  long capacity = b->capacity == 0 ? NEZVM_AST_INIT_SIZE : b->capacity * 2;
+  void *p;
+#define GROW(COLUMN) \
+  if ((p = realloc(b->COLUMN, sizeof(*b->COLUMN) * capacity)) == NULL) \
+    return NEZ_MEMORY_ERROR; \
+  b->COLUMN = p
+  GROW(start);
+  GROW(end);
+  GROW(first_child);
+  GROW(next_sibling);
+  GROW(tag);
+#undef GROW
+  b->capacity = capacity;
+  return NEZ_OK;
+}
+
+static int nez_GrowAstPath(AstBuilder *b) {
+  long capacity = b->open_capacity == 0 ? 64 : b->open_capacity * 2;
+  long *open = (long *)realloc(b->open, sizeof(long) * capacity);
+  long *last_child;
+  if (open == NULL) {
+    return NEZ_MEMORY_ERROR;
+  }
+  b->open = open;
+  if ((last_child = (long *)realloc(b->last_child, sizeof(long) * capacity))
+      == NULL) {
+    return NEZ_MEMORY_ERROR;
+  }
+  b->last_child = last_child;
+  b->open_capacity = capacity;
+  return NEZ_OK;
+}
+
+static void nez_AstBegin(void *arg, int tag, long pos) {
+  AstBuilder *b = (AstBuilder *)arg;
+  long n = b->size;
+  if (b->error != NEZ_OK
+      || (n == b->capacity && (b->error = nez_GrowAst(b)) != NEZ_OK)
+      || (b->depth == b->open_capacity
+          && (b->error = nez_GrowAstPath(b)) != NEZ_OK)) {
+    return;
+  }
+  b->size++;
+  b->tag[n] = tag;
+  b->start[n] = pos;
+  b->end[n] = pos;
+  b->first_child[n] = -1;
+  b->next_sibling[n] = -1;
+  if (b->depth > 0) {
+    long *last = &b->last_child[b->depth - 1];
+    if (*last < 0) {
+      b->first_child[b->open[b->depth - 1]] = n;
+    }
+    else {
+      b->next_sibling[*last] = n;
+    }
+    *last = n;
+  }
+  b->open[b->depth] = n;
+  b->last_child[b->depth] = -1;
+  b->depth++;
+}
+
+static void nez_AstEnd(void *arg, int tag, long start, long end) {
+  AstBuilder *b = (AstBuilder *)arg;
+  (void)tag;
+  (void)start;
+  if (b->error == NEZ_OK) {
+    b->end[b->open[--b->depth]] = end;
+  }
+}
+
+static int nez_WriteAst(AstBuilder *b, const NezVMInstruction *inst,
+                        size_t input_length, int fd) {
+  static const char padding[8];
+  nezvm_rules_ptr_t rules = inst[0].arg0.rules;
+  uint32_t tag_size = rules != NULL ? rules->rule_size : 0;
+  uint32_t *name = (uint32_t *)malloc(sizeof(uint32_t) * (tag_size + 1));
+  const char *text = rules != NULL ? NEZVM_RULE_NAME(rules, 0) : "";
+  struct nezvm_ast header;
+  struct iovec iov[16];
+  int iov_size = 0;
+  uint64_t offset;
+  int status;
+  if (name == NULL) {
+    return NEZ_MEMORY_ERROR;
+  }
+  /* names are laid out one after the other in the rule table */
+  name[0] = 0;
+  for (uint32_t i = 0; i < tag_size; i++) {
+    name[i + 1] = name[i] + strlen(NEZVM_RULE_NAME(rules, i)) + 1;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, NEZVM_AST_MAGIC, sizeof(header.magic));
+  header.version = NEZVM_AST_VERSION;
+  header.tag_size = tag_size;
+  header.node_size = b->size;
+  header.input_length = input_length;
+  iov[iov_size].iov_base = &header;
+  iov[iov_size++].iov_len = sizeof(header);
+  offset = sizeof(header);
+#define SECTION(FIELD, DATA, LEN) \
+  header.FIELD = offset; \
+  iov[iov_size].iov_base = (void *)(DATA); \
+  iov[iov_size++].iov_len = (LEN); \
+  offset += (LEN); \
+  if (offset != NEZVM_AST_ALIGN(offset)) { \
+    iov[iov_size].iov_base = (void *)padding; \
+    iov[iov_size++].iov_len = NEZVM_AST_ALIGN(offset) - offset; \
+    offset = NEZVM_AST_ALIGN(offset); \
+  }
+  SECTION(start, b->start, sizeof(int64_t) * b->size);
+  SECTION(end, b->end, sizeof(int64_t) * b->size);
+  SECTION(first_child, b->first_child, sizeof(int64_t) * b->size);
+  SECTION(next_sibling, b->next_sibling, sizeof(int64_t) * b->size);
+  SECTION(tag, b->tag, sizeof(int32_t) * b->size);
+  SECTION(name, name, sizeof(uint32_t) * (tag_size + 1));
+  SECTION(text, text, name[tag_size]);
+#undef SECTION
+  header.size = offset;
+  status = nez_WriteAll(fd, iov, iov_size) == 0 ? NEZ_OK : NEZ_IO_ERROR;
+  free(name);
+  return status;
+}
+
+int nez_ParseAst(ParsingContext context, NezVMInstruction *inst,
+                 const char *path) {
+  AstBuilder b;
+  ParsingSink sink = {nez_AstBegin, nez_AstEnd, &b};
+  int status;
+  memset(&b, 0, sizeof(b));
+  status = nez_ParseSink(context, inst, &sink);
+  if (status == NEZ_OK) {
+    status = b.error;
+  }
+  if (status == NEZ_OK) {
+    int fd = path != NULL ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                          : STDOUT_FILENO;
+    status = fd < 0 ? NEZ_IO_ERROR
+                    : nez_WriteAst(&b, inst, context->input_size, fd);
+    if (fd >= 0 && fd != STDOUT_FILENO && close(fd) != 0) {
+      status = NEZ_IO_ERROR;
+    }
+  }
+  free(b.start);
+  free(b.end);
+  free(b.first_child);
+  free(b.next_sibling);
+  free(b.tag);
+  free(b.open);
+  free(b.last_child);
+  return status;
+}
@@ -0,0 +1,74 @@
+#include <stdint.h>
+
+#ifndef NEZVM_AST_H
+#define NEZVM_AST_H
+
+/*
+** Flat columnar AST written by nezvm -t ast. Each node is a successful
+** rule call; nodes are numbered in preorder, so node 0 is the start rule
+** and a node's descendants follow it. The file is meant to be mapped and
+** used in place:
+**   header | start[] | end[] | first_child[] | next_sibling[] | tag[]
+**          | name[tag_size + 1] | text
+** Every section is 8-byte aligned and located by its offset from the
+** header. start and end are byte offsets in the input, and first_child
+** and next_sibling are node numbers or -1. A tag is the index of the
+** rule in the grammar's rule table (-1 for grammars without one); its
+** name is the NUL terminated string at text + name[tag]. Integers are in
+** host byte order.
+*/
+#define NEZVM_AST_MAGIC "NEZVMAST"
+#define NEZVM_AST_VERSION 1
+
+struct nezvm_ast {
+  char magic[8];
+  uint32_t version;
+  uint32_t tag_size;
+  uint64_t node_size;
+  uint64_t input_length;
+  uint64_t size;          /* of the whole file */
+  uint64_t start;         /* int64_t[node_size] */
+  uint64_t end;           /* int64_t[node_size] */
+  uint64_t first_child;   /* int64_t[node_size] */
+  uint64_t next_sibling;  /* int64_t[node_size] */
+  uint64_t tag;           /* int32_t[node_size] */
+  uint64_t name;          /* uint32_t[tag_size + 1] */
+  uint64_t text;
+};
+
+#define NEZVM_AST_COLUMN(A, TYPE, FIELD) \
+  ((const TYPE *)((const char *)(A) + (A)->FIELD))
+#define NEZVM_AST_TAG_NAME(A, T) \
+  ((const char *)(A) + (A)->text + NEZVM_AST_COLUMN(A, uint32_t, name)[T])
+
+/*
+** Parses with a capturing sink that builds the columns and writes them
+** to the file at path (stdout when NULL) once the parse succeeds. The
+** file is only created or truncated then, so nothing is written for a
+** rejected input. The columns stay in memory until then; the nodes cost
+** 36 bytes each.
+*/
+int nez_ParseAst(ParsingContext context, NezVMInstruction *inst,
+                 const char *path);
+
+/*
+** Text renderings of the same tree, written to fd while the input is
+** parsed (nezvm -t pego, json or xml): pego is the indented {Tag 'text'}
+** form of dump_pego, json nests objects with tag, pos, end and either
+** text or children, and xml nests elements named after the rules. Only
+** leaves carry text. Output goes through a NEZVM_TEXT_BUFFER byte
+** buffer; stretches of input of NEZVM_TEXT_DIRECT bytes or more that need
+** no escaping are written from the input directly. With NEZVM_TEXT_THREAD
+** a thread writes one buffer while the parse fills another. As with any
+** sink, a rejected input leaves part of its tree written.
+*/
+#define NEZVM_TEXT_PEGO 0
+#define NEZVM_TEXT_JSON 1
+#define NEZVM_TEXT_XML 2
+#define NEZVM_TEXT_THREAD 1
+#define NEZVM_TEXT_BUFFER (1 << 20)
+#define NEZVM_TEXT_DIRECT (64 << 10)
+int nez_ParseText(ParsingContext context, NezVMInstruction *inst, int format,
+                  int flags, int fd);
+
+#endif
@@ -0,0 +1,291 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libnez.h"
+#include "nezvm.h"
+
+/*
+** Layout of a cached image, a file named nezvm-<key>.img:
+**   header | code[length] | padding to a page | operand blocks
+** Jumps in code are instruction indices and operand pointers are offsets
+** from the header; every other operand is kept as is. A checksum guards
+** against images that were truncated or damaged on disk. Operand blocks are
+** all position independent already (see nezvm.h), so they are used in
+** place. The image is mapped privately and only the code pages are
+** written while relocating, which leaves the operand pages shared between
+** all the processes that map the same image.
+*/
+#define NEZVM_IMAGE_MAGIC "NEZVMIMG"
+/* bump whenever the layout of an operand block or the loader changes */
+#define NEZVM_IMAGE_VERSION 1
+
+struct nezvm_image {
+  char magic[8];
+  uint32_t version;
+  int32_t lookahead;
+  uint64_t key;
+  uint64_t size;    /* of the whole file */
+  int64_t length;   /* number of instructions */
+  uint64_t blob;    /* offset of the first operand block */
+  uint64_t checksum; /* of everything after the header */
+};
+
+typedef struct nezvm_image_code {
+  int32_t opcode;
+  int32_t reserved;
+  uint64_t arg0;
+  uint64_t arg1;
+} nezvm_image_code_t;
+
+NezVMInstruction *nez_VM_Prepare(ParsingContext, NezVMInstruction *);
+
+#define NEZVM_IMAGE_ALIGN(N) (((N) + 7) & ~(uint64_t)7)
+
+static const char *code_cache_dir = NULL;
+
+void nez_SetCodeCache(const char *dir) {
+  code_cache_dir = dir;
+}
+
+/* images are only usable where an instruction has the layout of a record */
+static int nez_CodeCacheEnabled(void) {
+  return code_cache_dir != NULL
+      && sizeof(nezvm_image_code_t) == sizeof(NezVMInstruction);
+}
+
+uint64_t nez_CodeCacheKey(const char *buf, size_t len, int inline_budget) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+  }
+  h = (h ^ (uint64_t)inline_budget) * 0x100000001b3ULL;
+  h = (h ^ NEZVM_IMAGE_VERSION) * 0x100000001b3ULL;
+  return h;
+}
+
+/* sizes are multiples of 8, so the image is hashed a word at a time */
+static uint64_t nez_ImageChecksum(const struct nezvm_image *image) {
+  const uint64_t *p = (const uint64_t *)(image + 1);
+  const uint64_t *end = (const uint64_t *)((const char *)image + image->size);
+  uint64_t h = image->size;
+  for (; p < end; p++) {
+    h = (h ^ *p) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
+static char *nez_CodeCachePath(uint64_t key, const char *suffix) {
+  size_t size = strlen(code_cache_dir) + 64;
+  char *path = (char *)malloc(size);
+  snprintf(path, size, "%s/nezvm-%016llx.img%s", code_cache_dir,
+           (unsigned long long)key, suffix);
+  return path;
+}
+
+static int nez_HasOperandBlock(int opcode) {
+  switch (opcode) {
+    case NEZVM_OP_CHARMAP:
+    case NEZVM_OP_NOTCHARMAP:
+    case NEZVM_OP_OPTIONALCHARMAP:
+    case NEZVM_OP_ZEROMORECHARMAP:
+    case NEZVM_OP_STRING:
+    case NEZVM_OP_NOTSTRING:
+    case NEZVM_OP_OPTIONALSTRING:
+    case NEZVM_OP_STRINGTRIE:
+    case NEZVM_OP_SCANSTRING:
+    case NEZVM_OP_EXIT:
+      return 1;
+  }
+  return 0;
+}
+
+/* size of the block arg0 points to, or 0 if there is none */
+static size_t nez_OperandSize(int opcode, const void *operand) {
+  if (!nez_HasOperandBlock(opcode) || operand == NULL) {
+    return 0;
+  }
+  switch (opcode) {
+    case NEZVM_OP_CHARMAP:
+    case NEZVM_OP_NOTCHARMAP:
+    case NEZVM_OP_OPTIONALCHARMAP:
+    case NEZVM_OP_ZEROMORECHARMAP:
+      return sizeof(bitset_t);
+    case NEZVM_OP_STRING:
+    case NEZVM_OP_NOTSTRING:
+    case NEZVM_OP_OPTIONALSTRING:
+      return sizeof(struct nezvm_string) - 1
+          + ((nezvm_string_ptr_t)operand)->len;
+    case NEZVM_OP_STRINGTRIE:
+    case NEZVM_OP_SCANSTRING:
+    case NEZVM_OP_EXIT:
+      /* the trie, scanner and rule blocks all start with their size */
+      return *(const unsigned *)operand;
+  }
+  return 0;
+}
+
+/*
+** Writes the image of a decoded (not yet prepared) program. The file is
+** written under a temporary name and renamed, so that a concurrent
+** process sees either no image or a complete one. Failures are silent;
+** the program is simply loaded from bytecode the next time.
+*/
+void nez_StoreCachedCode(ParsingContext context, NezVMInstruction *inst,
+                         uint64_t key) {
+  long length = context->bytecode_length;
+  struct nezvm_image *image;
+  nezvm_image_code_t *code;
+  uint64_t size, blob;
+  long page = sysconf(_SC_PAGESIZE);
+  char *path, *tmp;
+  int fd;
+  if (!nez_CodeCacheEnabled() || length == 0
+      || inst[0].opcode != NEZVM_OP_EXIT) {
+    return;
+  }
+  blob = sizeof(*image) + sizeof(*code) * length;
+  blob = (blob + page - 1) / page * page;
+  size = blob;
+  for (long i = 0; i < length; i++) {
+    size = NEZVM_IMAGE_ALIGN(size
+                             + nez_OperandSize(inst[i].opcode, inst[i].arg0.str));
+  }
+  image = (struct nezvm_image *)calloc(1, size);
+  memcpy(image->magic, NEZVM_IMAGE_MAGIC, sizeof(image->magic));
+  image->version = NEZVM_IMAGE_VERSION;
+  image->lookahead = context->lookahead;
+  image->key = key;
+  image->size = size;
+  image->length = length;
+  image->blob = blob;
+  code = (nezvm_image_code_t *)(image + 1);
+  for (long i = 0; i < length; i++) {
+    NezVMInstruction ir = inst[i];
+    NezVMInstruction **jump = nez_JumpOperand(&ir);
+    size_t operand_size = nez_OperandSize(ir.opcode, ir.arg0.str);
+    if (jump != NULL) {
+      *jump = (NezVMInstruction *)(uintptr_t)(*jump - inst);
+    }
+    if (operand_size > 0) {
+      memcpy((char *)image + blob, ir.arg0.str, operand_size);
+      ir.arg0.str = (nezvm_string_ptr_t)(uintptr_t)blob;
+      blob = NEZVM_IMAGE_ALIGN(blob + operand_size);
+    }
+    memcpy(&code[i], &ir, sizeof(ir));
+    code[i].opcode = ir.opcode;
+    code[i].reserved = 0;
+  }
+  image->checksum = nez_ImageChecksum(image);
+
+  path = nez_CodeCachePath(key, "");
+  tmp = nez_CodeCachePath(key, ".XXXXXX");
+  fd = mkstemp(tmp);
+  if (fd >= 0) {
+    int ok = write(fd, image, size) == (ssize_t)size;
+    close(fd);
+    if (!ok || rename(tmp, path) != 0) {
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+  free(path);
+  free(image);
+}
+
+/*
+** Maps the image for key and returns the prepared program, or NULL when
+** there is no usable image. Images not owned by the user or writable by
+** others are ignored, since a shared directory like /dev/shm is writable
+** by anyone.
+*/
+NezVMInstruction *nez_MapCachedCode(ParsingContext context, uint64_t key) {
+  struct nezvm_image *image;
+  NezVMInstruction *inst;
+  nezvm_image_code_t *code;
+  struct stat st;
+  char *path;
+  int fd;
+  if (!nez_CodeCacheEnabled()) {
+    return NULL;
+  }
+  path = nez_CodeCachePath(key, "");
+  fd = open(path, O_RDONLY);
+  free(path);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid()
+      || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0
+      || (size_t)st.st_size < sizeof(*image)) {
+    close(fd);
+    return NULL;
+  }
+  image = (struct nezvm_image *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    return NULL;
+  }
+  if (memcmp(image->magic, NEZVM_IMAGE_MAGIC, sizeof(image->magic)) != 0
+      || image->version != NEZVM_IMAGE_VERSION || image->key != key
+      || image->size != (uint64_t)st.st_size || image->size % 8 != 0
+      || image->checksum != nez_ImageChecksum(image) || image->length <= 0
+      || image->blob < sizeof(*image) || image->blob > image->size
+      || (uint64_t)image->length
+             > (image->blob - sizeof(*image)) / sizeof(*code)) {
+    munmap(image, st.st_size);
+    return NULL;
+  }
+
+  /* relocate in place; records and instructions have the same size */
+  code = (nezvm_image_code_t *)(image + 1);
+  inst = (NezVMInstruction *)code;
+  for (long i = 0; i < image->length; i++) {
+    nezvm_image_code_t c = code[i];
+    NezVMInstruction ir;
+    NezVMInstruction **jump;
+    memcpy(&ir, &c, sizeof(ir));
+    ir.opcode = c.opcode;
+    if (c.opcode < 0 || c.opcode >= NEZVM_OP_SIZE) {
+      goto L_broken;
+    }
+    if ((jump = nez_JumpOperand(&ir)) != NULL) {
+      uint64_t dst = jump == &ir.arg0.jump ? c.arg0 : c.arg1;
+      if (dst >= (uint64_t)image->length) {
+        goto L_broken;
+      }
+      *jump = &inst[dst];
+    }
+    if (nez_HasOperandBlock(c.opcode) && c.arg0 != 0) {
+      /* the leading length or size field must fit before it is read */
+      if (c.arg0 < image->blob || c.arg0 > image->size - sizeof(unsigned)) {
+        goto L_broken;
+      }
+      ir.arg0.str = (nezvm_string_ptr_t)((char *)image + c.arg0);
+      if (nez_OperandSize(c.opcode, ir.arg0.str) > image->size - c.arg0) {
+        goto L_broken;
+      }
+    }
+    inst[i] = ir;
+  }
+  context->bytecode_length = image->length;
+  context->lookahead = image->lookahead;
+  inst = nez_VM_Prepare(context, inst);
+  inst[0].arg1.program->image = image;
+  mprotect(image, image->size, PROT_READ);
+  return inst;
+
+L_broken:
+  munmap(image, st.st_size);
+  return NULL;
+}
+
+void nez_UnmapCachedCode(struct nezvm_image *image) {
+  munmap(image, image->size);
+}
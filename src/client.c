@@ -0,0 +1,98 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "libnez.h"
+#include "serve.h"
+
+/* both return 0 once size bytes are transferred, -1 on error or EOF */
+int nez_ServeRead(int fd, void *buf, size_t size) {
+  char *p = (char *)buf;
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+int nez_ServeWrite(int fd, struct iovec *iov, int iov_size) {
+  return nez_WriteAll(fd, iov, iov_size);
+}
+
+int nez_ServeConnect(const char *socket_path) {
+  struct sockaddr_un addr;
+  int fd;
+  size_t length = strlen(socket_path);
+  if (length >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, socket_path, length + 1);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+** Sends one request and waits for its response. The error message, if
+** any, is truncated to message_size. Returns -1 when the connection
+** failed, in which case it should be closed.
+*/
+int nez_ServeParse(int fd, int type, int grammar, const char *rule,
+                   const char *data, size_t length, NezServeResponse *response,
+                   char *message, size_t message_size) {
+  NezServeRequest request;
+  struct iovec iov[3];
+  char discard[256];
+  request.magic = NEZVM_SERVE_MAGIC;
+  request.type = type;
+  request.grammar = grammar;
+  request.rule_length = rule != NULL ? strlen(rule) : 0;
+  request.length = length;
+  iov[0].iov_base = &request;
+  iov[0].iov_len = sizeof(request);
+  iov[1].iov_base = (void *)rule;
+  iov[1].iov_len = request.rule_length;
+  iov[2].iov_base = (void *)data;
+  iov[2].iov_len = length;
+  if (nez_ServeWrite(fd, iov, 3) != 0
+      || nez_ServeRead(fd, response, sizeof(*response)) != 0) {
+    return -1;
+  }
+  for (size_t left = response->message_length; left > 0;) {
+    size_t n = left < sizeof(discard) ? left : sizeof(discard);
+    if (nez_ServeRead(fd, discard, n) != 0) {
+      return -1;
+    }
+    size_t done = response->message_length - left;
+    if (message_size > 0 && done < message_size - 1) {
+      size_t m = message_size - 1 - done < n ? message_size - 1 - done : n;
+      memcpy(message + done, discard, m);
+    }
+    left -= n;
+  }
+  if (message_size > 0) {
+    size_t end = response->message_length;
+    message[end < message_size - 1 ? end : message_size - 1] = 0;
+  }
+  return 0;
+}
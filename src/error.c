@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "libnez.h"
+#include "nezvm.h"
+
+/*
+** Error reporting. The VM keeps the instructions that failed at the
+** farthest position (see EXPECT_AT in nezvm.c); everything here, including
+** line and column, is computed only after a parse has failed.
+*/
+void nez_GetParsingResult(ParsingContext context, long status,
+                          ParsingResult *result) {
+  result->status = status;
+  result->pos = context->pos;
+  result->error_pos = context->error_pos;
+  result->line = 0;
+  result->column = 0;
+  result->expected_size = 0;
+  if (result->status != NEZ_PARSE_ERROR) {
+    return;
+  }
+  const char *p = context->inputs;
+  const char *end = context->inputs + result->error_pos;
+  const char *line_head = p;
+  result->line = 1;
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    result->line++;
+    line_head = ++p;
+  }
+  result->column = end - line_head + 1;
+  result->expected_size = context->expected_size;
+  for (int i = 0; i < context->expected_size; i++) {
+    result->expected[i].opcode = nez_VM_Opcode(context->expected[i]);
+    result->expected[i].operand = context->expected[i]->arg0;
+  }
+}
+
+#define NEZVM_ERROR_MAX_ITEMS 64
+
+/* items are the comma separated alternatives after "expected" */
+typedef struct ErrorBuffer {
+  char *buf;
+  size_t size;
+  size_t len;
+  int item_size;
+  size_t item[NEZVM_ERROR_MAX_ITEMS + 1];
+} ErrorBuffer;
+
+static void nez_ErrorAppend(ErrorBuffer *b, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = vsnprintf(b->len < b->size ? b->buf + b->len : NULL,
+                b->len < b->size ? b->size - b->len : 0, fmt, ap);
+  va_end(ap);
+  b->len += n > 0 ? (size_t)n : 0;
+}
+
+static size_t nez_ErrorBeginItem(ErrorBuffer *b) {
+  size_t mark = b->len;
+  nez_ErrorAppend(b, b->item_size == 0 ? ": expected " : ", ");
+  b->item[b->item_size] = b->len;
+  return mark;
+}
+
+/* drops the item just written if an earlier one reads the same */
+static void nez_ErrorEndItem(ErrorBuffer *b, size_t mark) {
+  size_t start = b->item[b->item_size];
+  size_t len = b->len - start;
+  if (b->len >= b->size) {
+    return;
+  }
+  for (int i = 0; i < b->item_size; i++) {
+    size_t end = i + 1 < b->item_size ? b->item[i + 1] - 2 : mark;
+    if (end - b->item[i] == len
+        && memcmp(b->buf + b->item[i], b->buf + start, len) == 0) {
+      b->len = mark;
+      b->buf[mark] = 0;
+      return;
+    }
+  }
+  if (b->item_size < NEZVM_ERROR_MAX_ITEMS) {
+    b->item_size++;
+  }
+}
+
+/* ']' and '-' are only escaped inside charsets */
+static void nez_ErrorChar(ErrorBuffer *b, unsigned char c, int in_set) {
+  if (c == '\n') {
+    nez_ErrorAppend(b, "\\n");
+  }
+  else if (c == '\t') {
+    nez_ErrorAppend(b, "\\t");
+  }
+  else if (c == '\\' || c == '"' || c == '\''
+           || (in_set && (c == ']' || c == '-'))) {
+    nez_ErrorAppend(b, "\\%c", c);
+  }
+  else if (c < 0x20 || c >= 0x7f) {
+    nez_ErrorAppend(b, "\\x%02x", c);
+  }
+  else {
+    nez_ErrorAppend(b, "%c", c);
+  }
+}
+
+static void nez_ErrorLiteral(ErrorBuffer *b, const char *text, int len) {
+  nez_ErrorAppend(b, "\"");
+  for (int i = 0; i < len; i++) {
+    nez_ErrorChar(b, text[i], 0);
+  }
+  nez_ErrorAppend(b, "\"");
+}
+
+static void nez_ErrorCharset(ErrorBuffer *b, bitset_ptr_t set) {
+  nez_ErrorAppend(b, "[");
+  for (int c = 0; c < 256; c++) {
+    if (bitset_get(set, c)) {
+      int last = c;
+      while (last < 255 && bitset_get(set, last + 1)) {
+        last++;
+      }
+      nez_ErrorChar(b, c, 1);
+      if (last > c + 1) {
+        nez_ErrorAppend(b, "-");
+      }
+      if (last > c) {
+        nez_ErrorChar(b, last, 1);
+      }
+      c = last;
+    }
+  }
+  nez_ErrorAppend(b, "]");
+}
+
+#define NEZVM_ERROR_MAX_LITERAL 256
+
+/* prints the literals of a trie in alternative order */
+static void nez_ErrorTrie(ErrorBuffer *b, nezvm_trie_ptr_t trie) {
+  const int *child = NEZVM_TRIE_CHILD(trie);
+  const unsigned char *label = NEZVM_TRIE_LABEL(trie);
+  char text[NEZVM_ERROR_MAX_LITERAL];
+  int stack[NEZVM_ERROR_MAX_LITERAL];
+  int edge[NEZVM_ERROR_MAX_LITERAL];
+  for (int alt = 0; alt < trie->alt_size; alt++) {
+    /* depth-first search for the node accepting alt */
+    int depth = 0;
+    stack[0] = 0;
+    edge[0] = trie->nodes[0].edge;
+    while (depth >= 0) {
+      const nezvm_trie_node_t *node = &trie->nodes[stack[depth]];
+      if (node->accept == alt) {
+        size_t mark = nez_ErrorBeginItem(b);
+        nez_ErrorLiteral(b, text, depth);
+        nez_ErrorEndItem(b, mark);
+        break;
+      }
+      if (edge[depth] < node->edge + node->edge_size
+          && depth + 1 < NEZVM_ERROR_MAX_LITERAL) {
+        int e = edge[depth]++;
+        text[depth] = label[e];
+        stack[depth + 1] = child[e];
+        edge[depth + 1] = trie->nodes[child[e]].edge;
+        depth++;
+      }
+      else {
+        depth--;
+      }
+    }
+  }
+}
+
+static void nez_ErrorExpected(ErrorBuffer *b, const ParsingExpected *e) {
+  switch (e->opcode) {
+    case NEZVM_OP_CHAR: {
+      size_t mark = nez_ErrorBeginItem(b);
+      nez_ErrorAppend(b, "'");
+      nez_ErrorChar(b, e->operand.c, 0);
+      nez_ErrorAppend(b, "'");
+      nez_ErrorEndItem(b, mark);
+      break;
+    }
+    case NEZVM_OP_CHARMAP: {
+      size_t mark = nez_ErrorBeginItem(b);
+      nez_ErrorCharset(b, e->operand.set);
+      nez_ErrorEndItem(b, mark);
+      break;
+    }
+    case NEZVM_OP_STRING: {
+      size_t mark = nez_ErrorBeginItem(b);
+      nez_ErrorLiteral(b, e->operand.str->text, e->operand.str->len);
+      nez_ErrorEndItem(b, mark);
+      break;
+    }
+    case NEZVM_OP_ANY: {
+      size_t mark = nez_ErrorBeginItem(b);
+      nez_ErrorAppend(b, "any character");
+      nez_ErrorEndItem(b, mark);
+      break;
+    }
+    case NEZVM_OP_STRINGTRIE: {
+      nez_ErrorTrie(b, e->operand.trie);
+      break;
+    }
+    case NEZVM_OP_SCANSTRING: {
+      for (int i = 0; i < e->operand.scan->literal_size; i++) {
+        const char *text;
+        int len = nez_ScanLiteral(e->operand.scan, i, &text);
+        size_t mark = nez_ErrorBeginItem(b);
+        nez_ErrorLiteral(b, text, len);
+        nez_ErrorEndItem(b, mark);
+      }
+      break;
+    }
+  }
+}
+
+/*
+** Writes "line L, column C: expected X, Y" (or the status message for
+** other errors) into buf like snprintf and returns the length the message
+** would have.
+*/
+size_t nez_FormatParsingError(const ParsingResult *result, char *buf,
+                              size_t size) {
+  ErrorBuffer b;
+  b.buf = buf;
+  b.size = size;
+  b.len = 0;
+  b.item_size = 0;
+  if (size > 0) {
+    buf[0] = 0;
+  }
+  if (result->status != NEZ_PARSE_ERROR) {
+    nez_ErrorAppend(&b, "%s", nez_StatusMessage(result->status));
+    return b.len;
+  }
+  nez_ErrorAppend(&b, "line %ld, column %ld", result->line, result->column);
+  for (int i = 0; i < result->expected_size; i++) {
+    nez_ErrorExpected(&b, &result->expected[i]);
+  }
+  return b.len;
+}
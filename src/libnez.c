@@ -1,26 +1,323 @@
 #include "libnez.h"
 #include "nezvm.h"
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 char *loadFile(const char *filename, size_t *length);
 
+const char *nez_StatusMessage(int status) {
+  switch (status) {
+    case NEZ_OK:
+      return "ok";
+    case NEZ_PARSE_ERROR:
+      return "parse error";
+    case NEZ_STACK_OVERFLOW:
+      return "stack overflow";
+    case NEZ_BYTECODE_ERROR:
+      return "broken bytecode";
+    case NEZ_IO_ERROR:
+      return "cannot read file";
+    case NEZ_MEMORY_ERROR:
+      return "out of memory";
+    case NEZ_RULE_ERROR:
+      return "unknown rule";
+    case NEZ_RANGE_ERROR:
+      return "edit outside the input";
+  }
+  return "unknown error";
+}
+
+int nez_WriteAll(int fd, struct iovec *iov, int iov_size) {
+  while (iov_size > 0) {
+    ssize_t n = writev(fd, iov, iov_size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    /* skip what was written, which may end inside a vector */
+    while (iov_size > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iov_size--;
+    }
+    if (iov_size > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
 ParsingContext nez_CreateParsingContext(const char *filename) {
   ParsingContext ctx = (ParsingContext)malloc(sizeof(struct ParsingContext));
+  if (ctx == NULL) {
+    return NULL;
+  }
   ctx->pos = ctx->input_size = 0;
-  ctx->inputs = loadFile(filename, &ctx->input_size);
+  if (filename != NULL) {
+    ctx->input_buffer = loadFile(filename, &ctx->input_size);
+  }
+  else {
+    ctx->input_buffer = (char *)calloc(1, PARSING_CONTEXT_INPUT_PADDING);
+  }
+  if (ctx->input_buffer == NULL) {
+    free(ctx);
+    return NULL;
+  }
+  ctx->input_capacity = ctx->input_size + PARSING_CONTEXT_INPUT_PADDING;
+  ctx->input_padding = PARSING_CONTEXT_INPUT_PADDING;
+  ctx->inputs = ctx->input_buffer;
   ctx->stack_pointer_base =
       (StackEntry)malloc(sizeof(union StackEntry) * PARSING_CONTEXT_MAX_STACK_LENGTH);
+  if (ctx->stack_pointer_base == NULL) {
+    free(ctx->input_buffer);
+    free(ctx);
+    return NULL;
+  }
   ctx->stack_pointer = &ctx->stack_pointer_base[0];
+  ctx->stack_pointer32 = (uint32_t *)ctx->stack_pointer_base;
   ctx->stack_size = PARSING_CONTEXT_MAX_STACK_LENGTH;
+  ctx->startPoint = 1;
+  ctx->farthest = 0;
+  ctx->lookahead = 1;
+  ctx->expected_at = NULL;
+  ctx->error_pos = 0;
+  ctx->expected_size = 0;
+  ctx->memo = NULL;
+  ctx->memo_frame = ctx->memo_frame_base = NULL;
+  ctx->capture = NULL;
+  ctx->profile = NULL;
+  ctx->trace = NULL;
   return ctx;
 }
 
 void nez_DisposeParsingContext(ParsingContext ctx) {
-  free(ctx->inputs);
+  if (ctx->memo != NULL) {
+    nez_DisposeMemo(ctx->memo);
+    free(ctx->memo_frame_base);
+  }
+  nez_DisableCapture(ctx);
+  if (ctx->profile != NULL) {
+    free(ctx->profile->hits);
+    free(ctx->profile->nodes);
+    free(ctx->profile);
+  }
+  if (ctx->trace != NULL) {
+    free(ctx->trace->entries);
+    free(ctx->trace);
+  }
+  free(ctx->input_buffer);
   free(ctx->stack_pointer_base);
   free(ctx);
 }
 
+/* makes room for size bytes of input and the padding after them */
+static int nez_ReserveInput(ParsingContext ctx, size_t size) {
+  if (size + PARSING_CONTEXT_INPUT_PADDING > ctx->input_capacity) {
+    size_t capacity = ctx->input_capacity * 2;
+    char *buffer;
+    if (capacity < size + PARSING_CONTEXT_INPUT_PADDING) {
+      capacity = size + PARSING_CONTEXT_INPUT_PADDING;
+    }
+    buffer = (char *)realloc(ctx->input_buffer, capacity);
+    if (buffer == NULL) {
+      return NEZ_MEMORY_ERROR;
+    }
+    if (ctx->inputs == ctx->input_buffer) {
+      ctx->inputs = buffer;
+    }
+    ctx->input_buffer = buffer;
+    ctx->input_capacity = capacity;
+  }
+  return NEZ_OK;
+}
+
+static void nez_ResetParsingState(ParsingContext ctx) {
+  ctx->pos = 0;
+  ctx->farthest = 0;
+  ctx->error_pos = 0;
+  ctx->expected_size = 0;
+  ctx->stack_pointer = ctx->stack_pointer_base;
+  ctx->stack_pointer32 = (uint32_t *)ctx->stack_pointer_base;
+  if (ctx->memo != NULL) {
+    nez_ClearMemo(ctx->memo);
+    ctx->memo_frame = ctx->memo_frame_base;
+  }
+}
+
+int nez_ResetParsingContext(ParsingContext ctx, const char *text, size_t len) {
+  if (nez_ReserveInput(ctx, len) != NEZ_OK) {
+    return NEZ_MEMORY_ERROR;
+  }
+  memcpy(ctx->input_buffer, text, len);
+  memset(ctx->input_buffer + len, 0, PARSING_CONTEXT_INPUT_PADDING);
+  ctx->inputs = ctx->input_buffer;
+  ctx->input_size = len;
+  ctx->input_padding = PARSING_CONTEXT_INPUT_PADDING;
+  nez_ResetParsingState(ctx);
+  return NEZ_OK;
+}
+
+int nez_SetPaddedInputBuffer(ParsingContext ctx, const char *buf, size_t len,
+                             size_t padding) {
+  ctx->inputs = buf;
+  ctx->input_size = len;
+  ctx->input_padding = padding;
+  nez_ResetParsingState(ctx);
+  return NEZ_OK;
+}
+
+int nez_SetInputBuffer(ParsingContext ctx, const char *buf, size_t len) {
+  return nez_SetPaddedInputBuffer(ctx, buf, len, 0);
+}
+
+void nez_SetMemoBudget(ParsingContext ctx, size_t budget, int flags) {
+  if (ctx->memo != NULL) {
+    nez_DisposeMemo(ctx->memo);
+  }
+  else {
+    /* a frame per call, as many as the compact layout has entries */
+    ctx->memo_frame_base = (struct MemoFrame *)malloc(
+        sizeof(struct MemoFrame) * NEZVM_STACK_LENGTH(ctx, uint32_t));
+    ctx->memo_frame = ctx->memo_frame_base;
+  }
+  ctx->memo = nez_CreateMemo(budget, flags);
+}
+
+void nez_EnableMemo(ParsingContext ctx) {
+  if (ctx->memo == NULL) {
+    nez_SetMemoBudget(ctx, PARSING_CONTEXT_MEMO_BUDGET, 0);
+  }
+}
+
+void nez_EnableCapture(ParsingContext ctx) {
+  if (ctx->capture == NULL) {
+    ctx->capture =
+        (struct ParsingCapture *)calloc(1, sizeof(struct ParsingCapture));
+  }
+}
+
+void nez_DisableCapture(ParsingContext ctx) {
+  if (ctx->capture != NULL) {
+    free(ctx->capture->events);
+    free(ctx->capture->marks);
+    free(ctx->capture->begins);
+    free(ctx->capture);
+    ctx->capture = NULL;
+  }
+}
+
+/* enables capture as well; NULL goes back to keeping every event */
+void nez_SetParsingSink(ParsingContext ctx, const ParsingSink *sink) {
+  nez_EnableCapture(ctx);
+  if (sink != NULL) {
+    ctx->capture->sink = *sink;
+  }
+  else {
+    memset(&ctx->capture->sink, 0, sizeof(ParsingSink));
+  }
+}
+
+void nez_EnableProfile(ParsingContext ctx) {
+  if (ctx->profile == NULL) {
+    ctx->profile =
+        (struct ParsingProfile *)malloc(sizeof(struct ParsingProfile));
+    ctx->profile->length = ctx->bytecode_length;
+    /* one allocation holds both counts */
+    ctx->profile->hits =
+        (uint64_t *)calloc(ctx->bytecode_length * 2, sizeof(uint64_t));
+    ctx->profile->calls = ctx->profile->hits + ctx->bytecode_length;
+    ctx->profile->steps = ctx->profile->mark = 0;
+    ctx->profile->nodes = (struct ProfileNode *)malloc(
+        sizeof(struct ProfileNode) * PARSING_PROFILE_INIT_NODES);
+    ctx->profile->node_size = 1;
+    ctx->profile->node_capacity = PARSING_PROFILE_INIT_NODES;
+    ctx->profile->current = 0;
+    memset(ctx->profile->nodes, 0, sizeof(struct ProfileNode));
+    ctx->profile->nodes[0].entry = -1;
+    ctx->profile->nodes[0].child = ctx->profile->nodes[0].sibling = -1;
+  }
+}
+
+int nez_EnableTrace(ParsingContext ctx, size_t size, int fd) {
+  struct ParsingTraceEntry *entries;
+  size_t n = 1;
+  while (n < size) {
+    n <<= 1;
+  }
+  entries =
+      (struct ParsingTraceEntry *)malloc(sizeof(struct ParsingTraceEntry) * n);
+  if (entries == NULL) {
+    return NEZ_MEMORY_ERROR;
+  }
+  if (ctx->trace == NULL) {
+    ctx->trace = (struct ParsingTrace *)calloc(1, sizeof(struct ParsingTrace));
+    if (ctx->trace == NULL) {
+      free(entries);
+      return NEZ_MEMORY_ERROR;
+    }
+  }
+  else {
+    free(ctx->trace->entries);
+  }
+  ctx->trace->entries = entries;
+  ctx->trace->mask = n - 1;
+  ctx->trace->count = 0;
+  ctx->trace->fd = fd;
+  return NEZ_OK;
+}
+
+void nez_SetTraceBudget(ParsingContext ctx, uint64_t msec) {
+  ctx->trace->budget = msec * 1000000;
+}
+
+void nez_RequestTraceDump(ParsingContext ctx) {
+  ctx->trace->requested = 1;
+}
+
+int nez_EditInput(ParsingContext ctx, size_t start, size_t removed,
+                  const char *text, size_t inserted) {
+  size_t size;
+  char *buffer;
+  if (start > ctx->input_size || removed > ctx->input_size - start) {
+    return NEZ_RANGE_ERROR;
+  }
+  size = ctx->input_size - removed;
+  if (inserted > SIZE_MAX - PARSING_CONTEXT_INPUT_PADDING - size) {
+    return NEZ_MEMORY_ERROR;
+  }
+  size += inserted;
+  if (nez_ReserveInput(ctx, size > ctx->input_size ? size : ctx->input_size)
+      != NEZ_OK) {
+    return NEZ_MEMORY_ERROR;
+  }
+  buffer = ctx->input_buffer;
+  if (ctx->inputs != buffer) {
+    /* a borrowed input is copied once; later edits happen in place */
+    memcpy(buffer, ctx->inputs, ctx->input_size);
+    ctx->inputs = buffer;
+    ctx->input_padding = PARSING_CONTEXT_INPUT_PADDING;
+  }
+  memmove(buffer + start + inserted, buffer + start + removed,
+          ctx->input_size - start - removed);
+  memcpy(buffer + start, text, inserted);
+  memset(buffer + size, 0, PARSING_CONTEXT_INPUT_PADDING);
+  ctx->input_size = size;
+  if (ctx->memo != NULL) {
+    nez_MemoEdit(ctx->memo, start, start + removed,
+                 (long)inserted - (long)removed, ctx->lookahead);
+  }
+  ctx->pos = 0;
+  ctx->stack_pointer = ctx->stack_pointer_base;
+  ctx->stack_pointer32 = (uint32_t *)ctx->stack_pointer_base;
+  return NEZ_OK;
+}
+
 #if 0
 void nez_DisposeObject(ParsingObject pego) {
   ParsingObject *child;
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <signal.h>
 
 #ifndef LIBNEZ_H
 #define LIBNEZ_H
@@ -47,9 +48,168 @@ union StackEntry {
   const struct NezVMInstruction *func;
 };
 
+struct MemoEntry {
+  long pos;
+  int rule;     /* offset of the rule entry, 0 for an empty slot */
+  int fail;
+  long len;     /* consumed length */
+  long reach;   /* farthest position examined, relative to pos */
+};
+
+struct MemoFrame {
+  const struct NezVMInstruction *rule;
+  const char *pos;
+  const char *far;
+};
+
+struct MemoRule {
+  uint32_t lookups;  /* in the current probation window */
+  uint32_t hits;
+  uint32_t skipped;  /* calls left before the rule is memoized again */
+};
+
+struct ParsingMemo {
+  size_t size;       /* number of sets */
+  size_t used;
+  size_t evicted;
+  int flags;
+  struct MemoEntry *entries;
+  struct MemoRule *rules;
+  size_t rule_size;
+};
+
+/*
+** Events of a capturing parse. Every successful rule call is a node: a
+** BEGIN event when the rule is entered and an END event when it returns,
+** both tagged with the index of the rule in the rule table (-1 for a
+** program without one). marks holds the number of events recorded before
+** each position or call on the VM stack, so backtracking truncates what
+** was recorded since; position_marks of them are positions, the first at
+** marks[lowest_position]. begins[i] is the BEGIN event of the call marked
+** by marks[i], which may have gone to the sink before the call returns.
+** Counts are absolute; events[0] is event number base.
+*/
+#define PARSING_EVENT_BEGIN 0
+#define PARSING_EVENT_END 1
+
+struct ParsingEvent {
+  int type;
+  int tag;
+  long pos;
+  long start;   /* END: where the node began */
+};
+
+/*
+** Streaming consumer of a capturing parse. Events are held back while a
+** backtracking point (a position pushed by PUSHpos) could still drop them,
+** and reach the sink in batches of up to PARSING_CAPTURE_BATCH once only
+** the failure of the whole parse could: a failed call only resumes the
+** parse where a position pushed before it is restored. A consumer
+** discards what it has seen when nez_Parse() does not return NEZ_OK.
+** Memory stays flat whatever the size of the input as long as the
+** grammar commits to its nodes as it goes, as a repetition of records or
+** statements does, even below rule calls that stay open to the end.
+*/
+typedef struct ParsingSink {
+  void (*begin_node)(void *arg, int tag, long pos);
+  void (*end_node)(void *arg, int tag, long start, long end);
+  void *arg;
+} ParsingSink;
+
+#define PARSING_CAPTURE_BATCH 4096
+
+struct ParsingCapture {
+  struct ParsingEvent *events;
+  size_t base;
+  size_t size;
+  size_t capacity;
+  size_t *marks;
+  size_t mark_size;
+  size_t mark_capacity;
+  size_t position_marks;
+  size_t lowest_position;
+  struct ParsingEvent *begins;
+  ParsingSink sink;
+};
+
+/*
+** A node of the calling context tree built by profiling parses: one per
+** distinct stack of rule calls, below a root that stands for the parse
+** itself. Instructions are charged to the node running them, so a rule's
+** inclusive count is the sum over its subtree.
+*/
+struct ProfileNode {
+  long entry;       /* of the rule, -1 for the root */
+  long parent;
+  long child;       /* most recently entered first */
+  long sibling;
+  uint64_t calls;
+  uint64_t fails;
+  uint64_t self;    /* instructions executed in the rule itself */
+};
+
+/* counts of a profiling parse, indexed by instruction */
+struct ParsingProfile {
+  long length;
+  uint64_t *hits;   /* executions of each instruction */
+  uint64_t *calls;  /* calls of the rule starting there */
+  uint64_t steps;   /* instructions executed */
+  uint64_t mark;    /* steps already charged to a node */
+  struct ProfileNode *nodes;
+  long node_size;
+  long node_capacity;
+  long current;     /* node of the running rule */
+};
+
+#define PARSING_PROFILE_INIT_NODES 256
+
+/*
+** Ring of the last instructions run by tracing parses, written before
+** each instruction runs. Every PARSING_TRACE_CHECK instructions the parse
+** dumps the ring if a dump was requested (from a signal handler, say) or
+** once per parse when it has run past its budget. See trace.h.
+*/
+struct ParsingTraceEntry {
+  int32_t pc;         /* offset of the instruction */
+  uint8_t opcode;
+  uint8_t failflag;
+  uint16_t unused;
+  int64_t pos;        /* position in the input */
+};
+
+struct ParsingTrace {
+  struct ParsingTraceEntry *entries;
+  uint64_t mask;      /* the size of the ring, a power of two, less one */
+  uint64_t count;     /* instructions traced since the parse started */
+  int fd;             /* where dumps are written */
+  uint64_t budget;    /* nanoseconds, 0 for none */
+  uint64_t start;
+  int overrun;        /* dumped for the budget in this parse */
+  long dumps;
+  volatile sig_atomic_t requested;
+  const void *rules;  /* rule table of the program being traced */
+};
+
+#define PARSING_TRACE_SIZE (1 << 16)
+#define PARSING_TRACE_CHECK 4096
+
+#define PARSING_CONTEXT_MAX_EXPECTED 16
+
+/*
+** The end of input is input_size, not a NUL byte, so inputs may contain
+** NULs. Buffers owned by a context are followed by this many zero bytes
+** that vector loops may read past the end.
+*/
+#define PARSING_CONTEXT_INPUT_PADDING 64
+
 struct ParsingContext {
-  char *inputs;
+  const char *inputs;
   size_t input_size;
+  /* bytes after inputs + input_size that may be read, but never matched */
+  size_t input_padding;
+  /* owned storage; inputs may point elsewhere when the caller lends it */
+  char *input_buffer;
+  size_t input_capacity;
   long pos;
   //struct ParsingObject *left;
   //struct ParsingObject *unusedObject;
@@ -62,11 +222,33 @@ struct ParsingContext {
   //struct MemoryPool *mpool;
 
   long bytecode_length;
+  /* index of the first instruction of the start rule */
   long startPoint;
 
   size_t stack_size;
   union StackEntry* stack_pointer;
   union StackEntry* stack_pointer_base;
+  /* top of the stack when it holds 32-bit entries (NEZVM_STACK_COMPACT) */
+  uint32_t *stack_pointer32;
+
+  /* farthest position examined by the last parse */
+  long farthest;
+  /* longest distance a single instruction looks ahead of cur */
+  int lookahead;
+
+  /* farthest failure of the last parse and the instructions failing there */
+  const char *expected_at;
+  long error_pos;
+  int expected_size;
+  const struct NezVMInstruction *expected[PARSING_CONTEXT_MAX_EXPECTED];
+
+  struct ParsingMemo *memo;
+  struct MemoFrame *memo_frame;
+  struct MemoFrame *memo_frame_base;
+
+  struct ParsingCapture *capture;
+  struct ParsingProfile *profile;
+  struct ParsingTrace *trace;
   // long *stack_pointer;
   // struct NezVMInstruction **call_stack_pointer;
   // long *stack_pointer_base;
@@ -82,6 +264,7 @@ typedef struct MemoryPool *MemoryPool;
 
 typedef struct ParsingContext *ParsingContext;
 typedef union StackEntry* StackEntry;
+typedef struct ParsingMemo *ParsingMemo;
 
 #if 0
 extern MemoryPool nez_CreateMemoryPool(MemoryPool mpool, size_t init_size);
@@ -99,10 +282,104 @@ static inline ParsingLog MemoryPool_AllocParsingLog(MemoryPool mpool) {
 }
 #endif
 
+/* status codes returned by the parsing API */
+enum nez_status {
+  NEZ_OK = 0,
+  NEZ_PARSE_ERROR = 1,
+  NEZ_STACK_OVERFLOW,
+  NEZ_BYTECODE_ERROR,
+  NEZ_IO_ERROR,
+  NEZ_MEMORY_ERROR,
+  NEZ_RULE_ERROR,
+  NEZ_RANGE_ERROR
+};
+
+const char *nez_StatusMessage(int status);
+
+/*
+** Writes all of the vectors to fd, going on after short writes and EINTR,
+** and returns 0, or -1 on error. The vectors are used up on the way.
+*/
+struct iovec;
+int nez_WriteAll(int fd, struct iovec *iov, int iov_size);
+
+/*
+** A context is created once and reused: nez_ResetParsingContext() puts a
+** new input in place, reusing the input buffer when it is large enough, so
+** a server only allocates while its inputs keep growing. A filename of
+** NULL creates a context without input. Loaded instructions are read only
+** and may be shared by contexts on different threads.
+*/
 #define PARSING_CONTEXT_MAX_STACK_LENGTH 1024
 ParsingContext nez_CreateParsingContext(const char *filename);
+int nez_ResetParsingContext(ParsingContext ctx, const char *text, size_t len);
+
+/*
+** Parses the caller's buffer in place: it is neither copied, written nor
+** freed, and must stay alive until the next reset. Callers that know
+** `padding` more bytes after buf + len are readable may say so, which lets
+** the vector loops run up to the end of the input.
+*/
+int nez_SetInputBuffer(ParsingContext ctx, const char *buf, size_t len);
+int nez_SetPaddedInputBuffer(ParsingContext ctx, const char *buf, size_t len,
+                             size_t padding);
 void nez_DisposeParsingContext(ParsingContext ctx);
 
+/*
+** Incremental parsing. Once memoization is enabled the results of rule
+** calls survive between parses, and nez_EditInput() replaces `removed`
+** bytes at `start` with `text`, keeping every result that did not look
+** at the edited bytes. The replaced bytes must lie within the input;
+** otherwise NEZ_RANGE_ERROR is returned and nothing is changed.
+**
+** The memo table never takes more than its budget of bytes: entries are
+** evicted, least recently used first, from sets of PARSING_MEMO_WAYS. With
+** PARSING_MEMO_ADAPTIVE only the rules whose results are reused often
+** enough are memoized (see memo.c); nez_EnableMemo() memoizes every rule,
+** as incremental parsing wants. nez_SetMemoBudget() replaces the table.
+*/
+#define PARSING_CONTEXT_MEMO_BUDGET ((size_t)1 << 20)
+#define PARSING_MEMO_WAYS 4
+#define PARSING_MEMO_ADAPTIVE 1
+#define PARSING_MEMO_PROBATION 256
+#define PARSING_MEMO_MIN_HIT_RATE 5
+#define PARSING_MEMO_RETRY 65536
+void nez_EnableMemo(ParsingContext ctx);
+void nez_SetMemoBudget(ParsingContext ctx, size_t budget, int flags);
+int nez_EditInput(ParsingContext ctx, size_t start, size_t removed,
+                  const char *text, size_t inserted);
+
+/*
+** Capture and profiling apply to every later parse of the context with
+** nez_Parse(). Profile counts add up over parses and are sized by the
+** program loaded into the context, so it must be enabled after loading.
+*/
+void nez_EnableCapture(ParsingContext ctx);
+void nez_DisableCapture(ParsingContext ctx);
+void nez_SetParsingSink(ParsingContext ctx, const ParsingSink *sink);
+void nez_EnableProfile(ParsingContext ctx);
+
+/*
+** Tracing keeps the last `size` instructions (rounded up to a power of
+** two) and writes dumps to fd. nez_RequestTraceDump() is async-signal-safe;
+** the dump is taken by the parse running on the context, or the next one.
+** nez_EnableTrace() returns NEZ_MEMORY_ERROR, leaving the context as it
+** was, when the ring cannot be allocated; the other two may only be
+** called once it has returned NEZ_OK.
+*/
+int nez_EnableTrace(ParsingContext ctx, size_t size, int fd);
+void nez_SetTraceBudget(ParsingContext ctx, uint64_t msec);
+void nez_RequestTraceDump(ParsingContext ctx);
+
+ParsingMemo nez_CreateMemo(size_t budget, int flags);
+void nez_DisposeMemo(ParsingMemo memo);
+void nez_ClearMemo(ParsingMemo memo);
+struct MemoEntry *nez_MemoLookup(ParsingMemo memo, int rule, long pos);
+void nez_MemoStore(ParsingMemo memo, int rule, long pos, long len, long reach,
+                   int fail);
+void nez_MemoEdit(ParsingMemo memo, size_t start, size_t old_end, long delta,
+                  int lookahead);
+
 #if 0
 void nez_DisposeObject(ParsingObject pego);
 
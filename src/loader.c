@@ -4,6 +4,8 @@
 #include "nezvm.h"
 
 #define NEZVM_COUNT_BYTECODE_MALLOCED_SIZE 1
+/* prints what the load-time rewrites of the bytecode did */
+#define NEZVM_REPORT_REWRITES 0
 #if defined(NEZVM_COUNT_BYTECODE_MALLOCED_SIZE)
 static size_t bytecode_malloced_size = 0;
 #endif
@@ -35,17 +37,18 @@ char *loadFile(const char *filename, size_t *length) {
   FILE *fp = fopen(filename, "rb");
   char *source;
   if (!fp) {
-    nez_PrintErrorInfo("fopen error: cannot open file");
     return NULL;
   }
   fseek(fp, 0, SEEK_END);
   len = (size_t)ftell(fp);
   fseek(fp, 0, SEEK_SET);
-  source = (char *)malloc(len + 1);
+  source = (char *)malloc(len + PARSING_CONTEXT_INPUT_PADDING);
   if (len != fread(source, 1, len, fp)) {
-    nez_PrintErrorInfo("fread error: cannot read file collectly");
+    free(source);
+    fclose(fp);
+    return NULL;
   }
-  source[len] = '\0';
+  memset(source + len, 0, PARSING_CONTEXT_INPUT_PADDING);
   fclose(fp);
   *length = len;
   return source;
@@ -168,15 +171,582 @@ void nez_EmitInstruction(NezVMInstruction* ir, ByteCodeLoader *loader) {
   }
 }
 
+static int inline_budget = NEZVM_INLINE_BUDGET;
+
+void nez_SetInlineBudget(int budget) {
+  inline_budget = budget;
+}
+
+NezVMInstruction **nez_JumpOperand(NezVMInstruction *ir) {
+  switch(ir->opcode) {
+    case NEZVM_OP_JUMP:
+    case NEZVM_OP_CALL:
+    case NEZVM_OP_IFFAIL:
+    case NEZVM_OP_IFSUCC:
+    case NEZVM_OP_ANY:
+      return &ir->arg0.jump;
+    case NEZVM_OP_CHAR:
+    case NEZVM_OP_NOTCHAR:
+    case NEZVM_OP_NOTCHARANY:
+    case NEZVM_OP_CHARMAP:
+    case NEZVM_OP_NOTCHARMAP:
+    case NEZVM_OP_STRING:
+    case NEZVM_OP_NOTSTRING:
+    case NEZVM_OP_STRINGTRIE:
+    case NEZVM_OP_SCANSTRING:
+      return &ir->arg1.jump;
+  }
+  return NULL;
+}
+
+static void nez_CopyOperand(NezVMInstruction *dst, const NezVMInstruction *src) {
+  switch(src->opcode) {
+    case NEZVM_OP_CHARMAP:
+    case NEZVM_OP_NOTCHARMAP:
+    case NEZVM_OP_OPTIONALCHARMAP:
+    case NEZVM_OP_ZEROMORECHARMAP: {
+      dst->arg0.set = (bitset_ptr_t)__malloc(sizeof(bitset_t));
+      memcpy(dst->arg0.set, src->arg0.set, sizeof(bitset_t));
+      break;
+    }
+    case NEZVM_OP_STRING:
+    case NEZVM_OP_NOTSTRING:
+    case NEZVM_OP_OPTIONALSTRING: {
+      size_t size = sizeof(*src->arg0.str) - 1 + src->arg0.str->len;
+      dst->arg0.str = (nezvm_string_ptr_t)__malloc(size);
+      memcpy(dst->arg0.str, src->arg0.str, size);
+      break;
+    }
+    case NEZVM_OP_STRINGTRIE: {
+      dst->arg0.trie = (nezvm_trie_ptr_t)__malloc(src->arg0.trie->size);
+      memcpy(dst->arg0.trie, src->arg0.trie, src->arg0.trie->size);
+      break;
+    }
+    case NEZVM_OP_SCANSTRING: {
+      dst->arg0.scan = (nezvm_scan_ptr_t)__malloc(src->arg0.scan->size);
+      memcpy(dst->arg0.scan, src->arg0.scan, src->arg0.scan->size);
+      break;
+    }
+  }
+}
+
+/*
+** Returns the number of instructions before the RET of the rule starting
+** at entry, or -1 if the rule cannot be inlined. A rule is inlinable when
+** it calls nothing (hence is not recursive), fits in the inline budget and
+** every jump in its body stays between entry and its RET.
+*/
+static long nez_InlineBodySize(NezVMInstruction *head, long length, long entry) {
+  long end = entry;
+  /* a budget of 0 disables inlining, even of empty rules */
+  if (inline_budget <= 0) {
+    return -1;
+  }
+  while (end < length && head[end].opcode != NEZVM_OP_RET) {
+    if (head[end].opcode == NEZVM_OP_CALL || head[end].opcode == NEZVM_OP_EXIT
+        || end - entry >= inline_budget) {
+      return -1;
+    }
+    end++;
+  }
+  if (end == length) {
+    return -1;
+  }
+  for (long i = entry; i < end; i++) {
+    NezVMInstruction **jump = nez_JumpOperand(&head[i]);
+    if (jump != NULL) {
+      long dst = *jump - head;
+      if (dst < entry || dst > end) {
+        return -1;
+      }
+    }
+  }
+  return end - entry;
+}
+
+/*
+** Copies the bodies of small rules into their call sites. A jump to the
+** RET of an inlined body becomes a jump to the instruction following the
+** call site; every other jump, and the rule entries, are relocated to the
+** new layout.
+*/
+static NezVMInstruction *nez_InlineRules(NezVMInstruction *head, long *length,
+                                         long *entries, int entry_size) {
+  long n = *length;
+  long m = 0;
+  long growth = 0;
+  long max_growth = n * NEZVM_INLINE_MAX_GROWTH / 100;
+  long *body = (long *)malloc(sizeof(long) * n);
+  long *newpos = (long *)malloc(sizeof(long) * (n + 1));
+  long *site = (long *)malloc(sizeof(long) * n);
+  int inlined = 0;
+  for (long i = 0; i < n; i++) {
+    body[i] = -2;
+  }
+  for (long i = 0; i < n; i++) {
+    newpos[i] = m;
+    site[i] = -1;
+    if (head[i].opcode == NEZVM_OP_CALL) {
+      long entry = head[i].arg0.jump - head;
+      if (body[entry] == -2) {
+        body[entry] = nez_InlineBodySize(head, n, entry);
+      }
+      if (body[entry] >= 0 && growth + body[entry] - 1 <= max_growth) {
+        growth += body[entry] - 1;
+        m += body[entry];
+        site[i] = entry;
+        inlined++;
+        continue;
+      }
+    }
+    m += 1;
+  }
+  newpos[n] = m;
+
+  if (inlined > 0) {
+    NezVMInstruction *code = __malloc(sizeof(*code) * m);
+    memset(code, 0, sizeof(*code) * m);
+    for (long i = 0; i < n; i++) {
+      long entry = site[i];
+      if (entry >= 0) {
+        for (long j = 0; j < body[entry]; j++) {
+          NezVMInstruction *dst = &code[newpos[i] + j];
+          NezVMInstruction **jump;
+          *dst = head[entry + j];
+          nez_CopyOperand(dst, &head[entry + j]);
+          if ((jump = nez_JumpOperand(dst)) != NULL) {
+            *jump = &code[newpos[i] + (*jump - &head[entry])];
+          }
+        }
+      }
+      else {
+        NezVMInstruction *dst = &code[newpos[i]];
+        NezVMInstruction **jump;
+        *dst = head[i];
+        if ((jump = nez_JumpOperand(dst)) != NULL) {
+          *jump = &code[newpos[*jump - head]];
+        }
+      }
+    }
+    for (int i = 0; i < entry_size; i++) {
+      entries[i] = newpos[entries[i]];
+    }
+    free(head);
+    head = code;
+  }
+#if NEZVM_REPORT_REWRITES
+  fprintf(stderr, "inlined_calls=%d, length=%ld->%ld\n", inlined, n, m);
+#endif
+  free(body);
+  free(newpos);
+  free(site);
+  *length = m;
+  return head;
+}
+
+/*
+** An ordered choice of literals is compiled into a chain of STRING (or
+** CHAR) instructions, each failing, through STOREflag and JUMP only, into
+** the next alternative:
+**
+**   STRING 'select' L1; JUMP Lend; L1: STOREflag 0; STRING 'set' L2; ...
+**
+** The head of such a chain is replaced by a STRINGTRIE that reads the
+** input once and jumps to the continuation of the first alternative that
+** matches. The rest of the chain is left in place, so jumps into it and
+** failures of a continuation behave exactly as before.
+*/
+typedef struct trieAlternative {
+  const char *text;
+  int len;
+  long cont;
+  int flag;
+} trieAlternative;
+
+typedef struct trieBuildNode {
+  int child;
+  int sibling;
+  int accept;
+  int min;
+  unsigned char label;
+} trieBuildNode;
+
+static int nez_LiteralOperand(NezVMInstruction *ir, const char **text, int *len) {
+  if (ir->opcode == NEZVM_OP_STRING) {
+    *text = ir->arg0.str->text;
+    *len = ir->arg0.str->len;
+    return 1;
+  }
+  if (ir->opcode == NEZVM_OP_CHAR) {
+    *text = &ir->arg0.c;
+    *len = 1;
+    return 1;
+  }
+  return 0;
+}
+
+static long nez_SkipJumps(NezVMInstruction *head, long length, long i) {
+  for (long step = 0; step < length && head[i].opcode == NEZVM_OP_JUMP; step++) {
+    i = head[i].arg0.jump - head;
+  }
+  return i;
+}
+
+static int nez_CollectChoice(NezVMInstruction *head, long length, long i,
+                             trieAlternative *alts, char *member, long *fail) {
+  int size = 0;
+  int flag = -1;
+  const char *text;
+  int len;
+  while (i + 1 < length && nez_LiteralOperand(&head[i], &text, &len)) {
+    long f;
+    alts[size].text = text;
+    alts[size].len = len;
+    alts[size].cont = nez_SkipJumps(head, length, i + 1);
+    alts[size].flag = flag;
+    size++;
+    member[i] = 1;
+    f = *fail = head[i].arg1.jump - head;
+    flag = 1;
+    for (long step = 0; step < length; step++) {
+      if (head[f].opcode == NEZVM_OP_STOREflag) {
+        flag = head[f].arg0.val;
+        f++;
+      }
+      else if (head[f].opcode == NEZVM_OP_JUMP) {
+        f = head[f].arg0.jump - head;
+      }
+      else {
+        break;
+      }
+    }
+    if (member[f]) {
+      break;
+    }
+    i = f;
+  }
+  return size;
+}
+
+static nezvm_trie_ptr_t nez_BuildTrie(trieAlternative *alts, int size, long base) {
+  int node_size = 1;
+  int cap = 1;
+  trieBuildNode *nodes;
+  nezvm_trie_ptr_t trie;
+  for (int k = 0; k < size; k++) {
+    cap += alts[k].len;
+  }
+  nodes = (trieBuildNode *)malloc(sizeof(*nodes) * cap);
+  nodes[0].child = nodes[0].sibling = nodes[0].accept = -1;
+  for (int k = 0; k < size; k++) {
+    int n = 0;
+    for (int i = 0; i < alts[k].len; i++) {
+      unsigned char c = alts[k].text[i];
+      int *link = &nodes[n].child;
+      while (*link != -1 && nodes[*link].label != c) {
+        link = &nodes[*link].sibling;
+      }
+      if (*link == -1) {
+        *link = node_size;
+        nodes[node_size].child = nodes[node_size].sibling = -1;
+        nodes[node_size].accept = -1;
+        nodes[node_size].label = c;
+        node_size++;
+      }
+      n = *link;
+    }
+    if (nodes[n].accept == -1) {
+      nodes[n].accept = k;
+    }
+  }
+  /* children are always created after their parent */
+  for (int n = node_size - 1; n >= 0; n--) {
+    nodes[n].min = nodes[n].accept != -1 ? nodes[n].accept : size;
+    for (int c = nodes[n].child; c != -1; c = nodes[c].sibling) {
+      if (nodes[c].min < nodes[n].min) {
+        nodes[n].min = nodes[c].min;
+      }
+    }
+  }
+
+  size_t bytes = sizeof(*trie) - sizeof(nezvm_trie_node_t)
+      + sizeof(nezvm_trie_node_t) * node_size + sizeof(int) * (node_size - 1)
+      + sizeof(nezvm_trie_alt_t) * size + (node_size - 1);
+  trie = (nezvm_trie_ptr_t)__malloc(bytes);
+  trie->size = bytes;
+  trie->node_size = node_size;
+  trie->edge_size = node_size - 1;
+  trie->alt_size = size;
+  int *child = NEZVM_TRIE_CHILD(trie);
+  unsigned char *label = NEZVM_TRIE_LABEL(trie);
+  int edge = 0;
+  for (int n = 0; n < node_size; n++) {
+    trie->nodes[n].edge = edge;
+    trie->nodes[n].accept = nodes[n].accept;
+    trie->nodes[n].min = nodes[n].min;
+    for (int c = nodes[n].child; c != -1; c = nodes[c].sibling) {
+      label[edge] = nodes[c].label;
+      child[edge] = c;
+      edge++;
+    }
+    trie->nodes[n].edge_size = edge - trie->nodes[n].edge;
+  }
+  for (int k = 0; k < size; k++) {
+    NEZVM_TRIE_ALT(trie)[k].jump = alts[k].cont - base;
+    NEZVM_TRIE_ALT(trie)[k].len = alts[k].len;
+    NEZVM_TRIE_ALT(trie)[k].flag = alts[k].flag;
+  }
+  free(nodes);
+  return trie;
+}
+
+static void nez_BuildStringTries(NezVMInstruction *head, long length) {
+  trieAlternative *alts = (trieAlternative *)malloc(sizeof(*alts) * length);
+  char *member = (char *)calloc(length, 1);
+  int tries = 0;
+  for (long i = 0; i < length; i++) {
+    long fail = 0;
+    int size;
+    if (member[i]) {
+      continue;
+    }
+    size = nez_CollectChoice(head, length, i, alts, member, &fail);
+    if (size >= NEZVM_TRIE_MIN_ALTERNATIVES) {
+      nezvm_trie_ptr_t trie = nez_BuildTrie(alts, size, i);
+      if (head[i].opcode == NEZVM_OP_STRING) {
+        free(head[i].arg0.str);
+      }
+      head[i].opcode = NEZVM_OP_STRINGTRIE;
+      head[i].arg0.trie = trie;
+      head[i].arg1.jump = &head[fail];
+      tries++;
+    }
+  }
+#if NEZVM_REPORT_REWRITES
+  fprintf(stderr, "string_tries=%d\n", tries);
+#endif
+  free(alts);
+  free(member);
+}
+
+/*
+** (!('-->' / ']]>') .)* compiles into a loop of negative literal tests
+** that all fail to the same exit, followed by ANY:
+**
+**   L: NOTSTRING '-->' X; NOTSTRING ']]>' X; ANY Y; JUMP L
+**
+** NOTCHAR and NOTCHARMAP count as one-byte literals. The head of the loop
+** becomes a SCANSTRING that moves to the earliest occurrence of any of the
+** literals and fails to X, or to Y at the end of the input.
+*/
+static int nez_ScanLiterals(NezVMInstruction *ir, const char **text, int *len,
+                            char *bytes, int size, int max) {
+  switch (ir->opcode) {
+    case NEZVM_OP_NOTSTRING: {
+      if (size >= max || ir->arg0.str->len == 0) {
+        return -1;
+      }
+      text[size] = ir->arg0.str->text;
+      len[size] = ir->arg0.str->len;
+      return size + 1;
+    }
+    case NEZVM_OP_NOTCHAR: {
+      if (size >= max) {
+        return -1;
+      }
+      bytes[size] = ir->arg0.c;
+      text[size] = &bytes[size];
+      len[size] = 1;
+      return size + 1;
+    }
+    case NEZVM_OP_NOTCHARMAP: {
+      for (unsigned c = 0; c < 256; c++) {
+        if (bitset_get(ir->arg0.set, c)) {
+          if (size >= max) {
+            return -1;
+          }
+          bytes[size] = c;
+          text[size] = &bytes[size];
+          len[size] = 1;
+          size++;
+        }
+      }
+      return size;
+    }
+  }
+  return -1;
+}
+
+static void nez_BuildScanners(NezVMInstruction *head, long length) {
+  const char *text[256];
+  int len[256];
+  char bytes[256];
+  int scanners = 0;
+  for (long i = 0; i < length; i++) {
+    NezVMInstruction *exit = NULL;
+    int size = 0;
+    long j = i;
+    while (j + 2 < length) {
+      int next = nez_ScanLiterals(&head[j], text, len, bytes, size, 256);
+      if (next < 0 || (exit != NULL && head[j].arg1.jump != exit)) {
+        break;
+      }
+      exit = head[j].arg1.jump;
+      size = next;
+      j++;
+    }
+    if (size == 0 || head[j].opcode != NEZVM_OP_ANY
+        || head[j + 1].opcode != NEZVM_OP_JUMP
+        || head[j + 1].arg0.jump != &head[i]) {
+      continue;
+    }
+    nezvm_scan_ptr_t scan = nez_CreateScanner(text, len, size);
+    scan->eof_jump = head[j].arg0.jump - &head[i];
+    if (head[i].opcode == NEZVM_OP_NOTSTRING) {
+      free(head[i].arg0.str);
+    }
+    else if (head[i].opcode == NEZVM_OP_NOTCHARMAP) {
+      free(head[i].arg0.set);
+    }
+    head[i].opcode = NEZVM_OP_SCANSTRING;
+    head[i].arg0.scan = scan;
+    head[i].arg1.jump = exit;
+    scanners++;
+    i = j + 1;
+  }
+#if NEZVM_REPORT_REWRITES
+  fprintf(stderr, "scanners=%d\n", scanners);
+#endif
+}
+
+/* the longest literal bounds how far past cur one instruction can look */
+static int nez_MaxLookahead(NezVMInstruction *head, long length) {
+  int lookahead = 1;
+  for (long i = 0; i < length; i++) {
+    switch (head[i].opcode) {
+      case NEZVM_OP_STRING:
+      case NEZVM_OP_NOTSTRING:
+      case NEZVM_OP_OPTIONALSTRING: {
+        if (lookahead < (int)head[i].arg0.str->len) {
+          lookahead = head[i].arg0.str->len;
+        }
+        break;
+      }
+    }
+  }
+  return lookahead;
+}
+
+/*
+** The rule table optionally follows the instructions:
+**   u32 rule_size, then for each rule u32 name_length, name, u32 entry
+** where entry is the index of the first instruction of the rule. Names and
+** entries are returned in arrays; names point into buf.
+*/
+static int nez_ReadRuleTable(char *buf, size_t len, byteCodeInfo *info,
+                             long length, char ***names, long **entries) {
+  int size;
+  if ((size_t)info->pos + 4 > len) {
+    return 0;
+  }
+  size = read32(buf, info);
+  if ((size_t)size > (len - info->pos) / 8) {
+    return 0;
+  }
+  *names = (char **)malloc(sizeof(char *) * size);
+  *entries = (long *)malloc(sizeof(long) * size);
+  for (int i = 0; i < size; i++) {
+    uint32_t name_length;
+    if ((size_t)info->pos + 4 > len
+        || (size_t)(name_length = read32(buf, info)) + 4 > len - info->pos) {
+      return i;
+    }
+    (*names)[i] = buf + info->pos;
+    info->pos += name_length;
+    (*entries)[i] = read32(buf, info);
+    /* names are terminated in place, overwriting the entry just read */
+    buf[info->pos - 4] = 0;
+    if ((*entries)[i] <= 0 || (*entries)[i] >= length) {
+      return i;
+    }
+  }
+  return size;
+}
+
+static nezvm_rules_ptr_t nez_CreateRules(char **names, long *entries,
+                                         int size) {
+  nezvm_rules_ptr_t rules;
+  size_t text_size = 0;
+  for (int i = 0; i < size; i++) {
+    text_size += strlen(names[i]) + 1;
+  }
+  size_t bytes = sizeof(*rules) + sizeof(nezvm_rule_t) * (size - 1) + text_size;
+  rules = (nezvm_rules_ptr_t)__malloc(bytes);
+  rules->size = bytes;
+  rules->rule_size = size;
+  text_size = 0;
+  for (int i = 0; i < size; i++) {
+    rules->rules[i].entry = entries[i];
+    rules->rules[i].name = text_size;
+    strcpy((char *)NEZVM_RULE_NAME(rules, i), names[i]);
+    text_size += strlen(names[i]) + 1;
+  }
+  return rules;
+}
+
+long nez_FindRule(const NezVMInstruction *inst, const char *name) {
+  nezvm_rules_ptr_t rules = inst[0].arg0.rules;
+  if (rules != NULL) {
+    for (int i = 0; i < rules->rule_size; i++) {
+      if (strcmp(NEZVM_RULE_NAME(rules, i), name) == 0) {
+        return rules->rules[i].entry;
+      }
+    }
+  }
+  return -1;
+}
+
+const char *nez_RuleName(const NezVMInstruction *inst, int index) {
+  nezvm_rules_ptr_t rules = inst[0].arg0.rules;
+  if (rules == NULL || index < 0 || index >= rules->rule_size) {
+    return NULL;
+  }
+  return NEZVM_RULE_NAME(rules, index);
+}
+
+/* the rule starting at entry, or -1 */
+int nez_RuleIndex(const NezVMInstruction *inst, long entry) {
+  nezvm_rules_ptr_t rules = inst[0].arg0.rules;
+  if (rules != NULL) {
+    for (int i = 0; i < rules->rule_size; i++) {
+      if (rules->rules[i].entry == entry) {
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+int nez_SetStartRule(ParsingContext context, const NezVMInstruction *inst,
+                     const char *name) {
+  long entry = name == NULL ? 1 : nez_FindRule(inst, name);
+  if (entry < 0) {
+    return NEZ_RULE_ERROR;
+  }
+  context->startPoint = entry;
+  return NEZ_OK;
+}
+
 NezVMInstruction *nez_VM_Prepare(ParsingContext, NezVMInstruction *);
 
-NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
-                                      const char *fileName,
-                                      const char *nonTerminalName) {
+/* decodes and optimizes buf; the result is not prepared yet */
+static NezVMInstruction *nez_DecodeMachineCode(ParsingContext context,
+                                               char *buf, size_t len) {
   NezVMInstruction *inst = NULL;
   NezVMInstruction *head = NULL;
-  size_t len;
-  char *buf = loadFile(fileName, &len);
+  char **rule_names = NULL;
+  long *rule_entries = NULL;
+  int rule_size;
   byteCodeInfo info;
   info.pos = 0;
 
@@ -219,31 +789,91 @@ NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
   dump_NezVMInstructions(inst, info.bytecode_length);
 #endif
 
+  rule_size = nez_ReadRuleTable(buf, len, &info, info.bytecode_length,
+                                &rule_names, &rule_entries);
+
   context->bytecode_length = info.bytecode_length;
+  context->lookahead = nez_MaxLookahead(head, context->bytecode_length);
+  head = nez_InlineRules(head, &context->bytecode_length, rule_entries,
+                         rule_size);
+  nez_BuildStringTries(head, context->bytecode_length);
+  nez_BuildScanners(head, context->bytecode_length);
 #if defined(NEZVM_COUNT_BYTECODE_MALLOCED_SIZE)
   fprintf(stderr, "instruction_size=%zd\n", sizeof(*inst));
   fprintf(stderr, "malloced_size=%zd[Byte], %zd[Byte]\n",
-          (sizeof(*inst) * info.bytecode_length),
+          (sizeof(*inst) * context->bytecode_length),
           bytecode_malloced_size);
 #endif
+  if (rule_size > 0 && head[0].opcode == NEZVM_OP_EXIT) {
+    head[0].arg0.rules = nez_CreateRules(rule_names, rule_entries, rule_size);
+  }
+  free(rule_names);
+  free(rule_entries);
+  return head;
+}
+
+NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
+                                      const char *fileName,
+                                      const char *nonTerminalName) {
+  NezVMInstruction *head;
+  uint64_t key;
+  size_t len;
+  char *buf = loadFile(fileName, &len);
+  if (buf == NULL) {
+    return NULL;
+  }
+  /* the rule table is decoded in place, so the key is taken first */
+  key = nez_CodeCacheKey(buf, len, inline_budget);
+  head = nez_MapCachedCode(context, key);
+  if (head == NULL) {
+    head = nez_DecodeMachineCode(context, buf, len);
+    nez_StoreCachedCode(context, head, key);
+    head = nez_VM_Prepare(context, head);
+  }
   free(buf);
-  return nez_VM_Prepare(context, head);
+  if (head[0].arg0.rules == NULL) {
+    context->startPoint = 1;
+  }
+  else if (nez_SetStartRule(context, head, nonTerminalName) != NEZ_OK) {
+    nez_DisposeInstruction(head, context->bytecode_length);
+    return NULL;
+  }
+  return head;
 }
 
 void nez_DisposeInstruction(NezVMInstruction *ir, long length) {
+  struct nezvm_image *image = nez_VM_Release(ir);
+  /* operands of a mapped image are not separate allocations */
+  if (image != NULL) {
+    nez_UnmapCachedCode(image);
+    return;
+  }
   for (long i = 0; i < length; i++) {
-    switch (ir[i].opcode) {
+    /* prepared instructions hold a handler address in place of the opcode */
+    switch (nez_VM_Opcode(&ir[i])) {
       case NEZVM_OP_CHARMAP:
       case NEZVM_OP_NOTCHARMAP:
       case NEZVM_OP_OPTIONALCHARMAP:
       case NEZVM_OP_ZEROMORECHARMAP: {
-        free(ir->arg0.set);
+        free(ir[i].arg0.set);
         break;
       }
       case NEZVM_OP_STRING:
       case NEZVM_OP_NOTSTRING:
       case NEZVM_OP_OPTIONALSTRING: {
-        free(ir->arg0.str);
+        free(ir[i].arg0.str);
+        break;
+      }
+      case NEZVM_OP_STRINGTRIE: {
+        free(ir[i].arg0.trie);
+        break;
+      }
+      case NEZVM_OP_SCANSTRING: {
+        free(ir[i].arg0.scan);
+        break;
+      }
+      case NEZVM_OP_EXIT: {
+        free(ir[i].arg0.rules);
         break;
       }
     }
@@ -2,39 +2,170 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
 #include "libnez.h"
 #include "nezvm.h"
+#include "serve.h"
+#include "ast.h"
+#include "sampler.h"
+#include "trace.h"
 
 static void nez_ShowUsage(const char *file) {
   // fprintf(stderr, "Usage: %s -f nez_bytecode target_file\n", file);
   fprintf(stderr, "\nnezvm <command> optional files\n");
   fprintf(stderr, "  -p <filename> Specify an PEGs grammar bytecode file\n");
   fprintf(stderr, "  -i <filename> Specify an input file\n");
+  fprintf(stderr, "  -s <rule>     Specify the start rule (default: the first rule)\n");
   fprintf(stderr, "  -o <filename> Specify an output file\n");
-  fprintf(stderr, "  -t <type>     Specify an output type\n");
+  fprintf(stderr, "  -t <type>     Specify an output type (pego, json, xml, ast, stat,\n                profile, folded)\n");
+  fprintf(stderr, "  -w            Write pego, json or xml output on a separate thread\n");
+  fprintf(stderr, "  -b <size>     Specify an inlining budget (0 disables inlining)\n");
+  fprintf(stderr, "  -M <KiB>      Memoize the rules that pay off in a table of this size\n");
+  fprintf(stderr, "  -m <MiB>      Specify the memory for files read ahead (default: 64)\n");
+  fprintf(stderr, "  -C <dir>      Cache prepared grammars in a directory such as /dev/shm\n");
+  fprintf(stderr, "  -j <threads>  Parse records of the input, or the files, on several threads\n");
+  fprintf(stderr, "  -r            Parse each record separately and report rejected ones\n");
+  fprintf(stderr, "  -d <char>     Specify the record delimiter for -j and -r (default: \\n)\n");
+  fprintf(stderr, "  --sample <filename> Sample the rules the parse spends its time in and\n");
+  fprintf(stderr, "                write their stacks for flamegraph.pl\n");
+  fprintf(stderr, "  --trace <filename> Keep a trace of the last instructions and write it\n");
+  fprintf(stderr, "                on SIGUSR1, past the budget or at the end (see neztrace)\n");
+  fprintf(stderr, "  --trace-budget <msec> Specify how long a parse may run before its\n");
+  fprintf(stderr, "                trace is written\n");
+  fprintf(stderr, "  --serve <socket> Serve parse requests on a Unix domain socket\n");
+  fprintf(stderr, "                with the grammars given by -p (in order of their ids)\n");
+  fprintf(stderr, "                and -j workers\n");
   fprintf(stderr, "  -h            Display this help and exit\n\n");
   exit(EXIT_FAILURE);
 }
 
+/* a text format, or -1 for the binary AST */
+static int nez_OutputFormat(const char *type) {
+  if (!strcmp(type, "pego")) {
+    return NEZVM_TEXT_PEGO;
+  }
+  if (!strcmp(type, "json")) {
+    return NEZVM_TEXT_JSON;
+  }
+  if (!strcmp(type, "xml")) {
+    return NEZVM_TEXT_XML;
+  }
+  if (strcmp(type, "ast") != 0) {
+    nez_PrintErrorInfo("unknown output type");
+  }
+  return -1;
+}
+
+static ParsingContext nez_traced_context;
+
+/* kill -USR1 dumps the trace of the running parse */
+static void nez_TraceSignal(int sig) {
+  (void)sig;
+  nez_RequestTraceDump(nez_traced_context);
+}
+
+typedef struct RecordCount {
+  long accepted;
+  long rejected;
+} RecordCount;
+
+static int nez_ReportRecord(ParsingContext context, const ParsingRecord *record,
+                            void *arg) {
+  RecordCount *count = (RecordCount *)arg;
+  if (record->status == NEZ_OK) {
+    count->accepted++;
+  }
+  else {
+    ParsingResult result;
+    char buf[1024];
+    nez_GetParsingResult(context, record->status, &result);
+    nez_FormatParsingError(&result, buf, sizeof(buf));
+    fprintf(stderr, "record %ld (offset %zu): %s\n", record->index + 1,
+            record->error_pos, buf);
+    count->rejected++;
+  }
+  return 0;
+}
+
+static int nez_ReportFile(ParsingContext context, const ParsingFile *file,
+                          void *arg) {
+  RecordCount *count = (RecordCount *)arg;
+  if (file->status == NEZ_OK) {
+    count->accepted++;
+  }
+  else {
+    ParsingResult result;
+    char buf[1024];
+    nez_GetParsingResult(context, file->status, &result);
+    nez_FormatParsingError(&result, buf, sizeof(buf));
+    fprintf(stderr, "%s: %s%s\n", file->path,
+            file->status == NEZ_PARSE_ERROR ? "parse error at " : "", buf);
+    count->rejected++;
+  }
+  return 0;
+}
+
 int main(int argc, char *const argv[]) {
   ParsingContext context = NULL;
   NezVMInstruction *inst = NULL;
   const char *syntax_file = NULL;
+  const char *grammars[NEZVM_SERVE_MAX_GRAMMARS];
+  int grammar_size = 0;
+  const char *serve_path = NULL;
+  const char *sample_file = NULL;
+  const char *trace_file = NULL;
+  long trace_budget = 0;
   const char *input_file = NULL;
   const char *output_type = NULL;
   const char *output_file = NULL;
   const char *file_type = NULL;
+  const char *start_rule = NULL;
   const char *orig_argv0 = argv[0];
+  int threads = 0;
+  int records = 0;
+  int write_thread = 0;
+  int inline_budget = -1;
+  size_t budget = NEZVM_INPUT_BUDGET;
+  size_t memo_budget = 0;
+  char delim = '\n';
+  int status = NEZ_OK;
   int opt;
-  while ((opt = getopt(argc, argv, "p:i:t:o:c:h:")) != -1) {
+  static const struct option long_options[] = {
+    {"serve", required_argument, NULL, 'S'},
+    {"sample", required_argument, NULL, 'P'},
+    {"trace", required_argument, NULL, 'T'},
+    {"trace-budget", required_argument, NULL, 'B'},
+    {NULL, 0, NULL, 0}
+  };
+  while ((opt = getopt_long(argc, argv, "p:i:s:t:o:c:b:C:j:m:M:d:rwh:",
+                            long_options, NULL)) != -1) {
     switch (opt) {
     case 'p':
       syntax_file = optarg;
+      if (grammar_size < NEZVM_SERVE_MAX_GRAMMARS) {
+        grammars[grammar_size++] = optarg;
+      }
+      break;
+    case 'S':
+      serve_path = optarg;
+      break;
+    case 'P':
+      sample_file = optarg;
+      break;
+    case 'T':
+      trace_file = optarg;
+      break;
+    case 'B':
+      trace_budget = atol(optarg);
       break;
     case 'i':
       input_file = optarg;
       break;
+    case 's':
+      start_rule = optarg;
+      break;
     case 't':
       output_type = optarg;
       break;
@@ -44,6 +175,30 @@ int main(int argc, char *const argv[]) {
     case 'c':
       file_type = optarg;
       break;
+    case 'b':
+      inline_budget = atoi(optarg);
+      break;
+    case 'C':
+      nez_SetCodeCache(optarg);
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'm':
+      budget = (size_t)atol(optarg) << 20;
+      break;
+    case 'M':
+      memo_budget = (size_t)atol(optarg) << 10;
+      break;
+    case 'r':
+      records = 1;
+      break;
+    case 'w':
+      write_thread = 1;
+      break;
+    case 'd':
+      delim = strcmp(optarg, "\\n") == 0 ? '\n' : optarg[0];
+      break;
     case 'h':
       nez_ShowUsage(orig_argv0);
     default: /* '?' */
@@ -53,14 +208,126 @@ int main(int argc, char *const argv[]) {
   if (syntax_file == NULL) {
     nez_PrintErrorInfo("not input syntaxfile");
   }
+  /* inlined rules would not show up as nodes of the tree */
+  if (inline_budget < 0 && output_type != NULL
+      && strcmp(output_type, "stat") != 0
+      && strcmp(output_type, "profile") != 0
+      && strcmp(output_type, "folded") != 0) {
+    inline_budget = 0;
+  }
+  if (inline_budget >= 0) {
+    nez_SetInlineBudget(inline_budget);
+  }
+  if (serve_path != NULL) {
+    if (threads <= 0) {
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    status = nez_Serve(serve_path, grammars, grammar_size, start_rule, threads);
+    return status == NEZ_OK ? 0 : EXIT_FAILURE;
+  }
   context = nez_CreateParsingContext(input_file);
-  inst = nez_LoadMachineCode(context, syntax_file, "File");
-  if (output_type == NULL || !strcmp(output_type, "pego")) {
-    nez_Parse(context, inst);
+  if (context == NULL) {
+    nez_PrintErrorInfo("fopen error: cannot open input file");
+  }
+  inst = nez_LoadMachineCode(context, syntax_file, start_rule);
+  if (inst == NULL) {
+    nez_PrintErrorInfo("cannot load syntax file or start rule");
+  }
+  if (memo_budget > 0) {
+    nez_SetMemoBudget(context, memo_budget, PARSING_MEMO_ADAPTIVE);
+  }
+  if (trace_file != NULL) {
+    int fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      nez_PrintErrorInfo("cannot open trace file");
+    }
+    if (nez_EnableTrace(context, PARSING_TRACE_SIZE, fd) != NEZ_OK) {
+      nez_PrintErrorInfo("cannot allocate the trace");
+    }
+    nez_SetTraceBudget(context, trace_budget);
+    nez_traced_context = context;
+    signal(SIGUSR1, nez_TraceSignal);
+  }
+  if (sample_file != NULL
+      && nez_StartSampler(context, inst, NEZVM_SAMPLE_HZ) != NEZ_OK) {
+    nez_PrintErrorInfo("cannot start the sampler");
+  }
+  if (optind < argc) {
+    RecordCount count = {0, 0};
+    if (threads <= 0) {
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    nez_ParseFiles(context, inst, (const char **)&argv[optind], argc - optind,
+                   threads, budget, 0, nez_ReportFile, &count);
+    fprintf(stderr, "files=%ld, accepted=%ld, rejected=%ld\n",
+            count.accepted + count.rejected, count.accepted, count.rejected);
+    status = count.rejected > 0 ? NEZ_PARSE_ERROR : NEZ_OK;
+  }else if (records) {
+    RecordCount count = {0, 0};
+    nez_ParseRecords(context, inst, delim, NEZVM_RECORD_RESYNC,
+                     nez_ReportRecord, &count);
+    fprintf(stderr, "records=%ld, accepted=%ld, rejected=%ld\n",
+            count.accepted + count.rejected, count.accepted, count.rejected);
+    status = count.rejected > 0 ? NEZ_PARSE_ERROR : NEZ_OK;
+  }else if (threads > 0) {
+    status = nez_ParseParallel(context, inst, threads, delim);
+  }else if (output_type == NULL) {
+    status = nez_Parse(context, inst);
   }else if (!strcmp(output_type, "stat")) {
-    nez_ParseStat(context, inst);
+    status = nez_ParseStat(context, inst);
+  }else if (!strcmp(output_type, "profile")) {
+    nez_EnableProfile(context);
+    status = nez_Parse(context, inst);
+    nez_PrintProfile(context, inst);
+  }else if (!strcmp(output_type, "folded")) {
+    FILE *out = output_file != NULL ? fopen(output_file, "w") : stdout;
+    if (out == NULL) {
+      nez_PrintErrorInfo("cannot open output file");
+    }
+    nez_EnableProfile(context);
+    status = nez_Parse(context, inst);
+    nez_PrintFoldedProfile(context, inst, out);
+    if (out != stdout) {
+      fclose(out);
+    }
+  }else if (!strcmp(output_type, "ast")) {
+    /* the tree is only written, and the file only touched, when accepted */
+    status = nez_ParseAst(context, inst, output_file);
+  }else {
+    int format = nez_OutputFormat(output_type);
+    int fd = output_file != NULL
+                 ? open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                 : STDOUT_FILENO;
+    if (fd < 0) {
+      nez_PrintErrorInfo("cannot open output file");
+    }
+    status = nez_ParseText(context, inst, format,
+                           write_thread ? NEZVM_TEXT_THREAD : 0, fd);
+    if (fd != STDOUT_FILENO) {
+      close(fd);
+    }
+  }
+  if (sample_file != NULL) {
+    FILE *out = fopen(sample_file, "w");
+    nez_StopSampler();
+    if (out == NULL) {
+      nez_PrintErrorInfo("cannot open sample file");
+    }
+    nez_PrintSamples(out);
+    fclose(out);
+  }
+  /* without an earlier dump the trace ends with the last parse */
+  if (trace_file != NULL) {
+    if (context->trace->dumps == 0) {
+      nez_DumpTrace(context, NEZVM_TRACE_EXIT);
+    }
+    close(context->trace->fd);
+  }
+  /* batches have reported their errors already */
+  if (status != NEZ_OK && !records && optind == argc) {
+    nez_PrintParsingError(context, status);
   }
   nez_DisposeInstruction(inst, context->bytecode_length);
   nez_DisposeParsingContext(context);
-  return 0;
+  return status == NEZ_OK ? 0 : EXIT_FAILURE;
 }
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <string.h>
+#include "libnez.h"
+
+/*
+** Memo table for rule results keyed by (rule, position). The table is a
+** fixed array of PARSING_MEMO_WAYS-way sets sized from a byte budget;
+** each set is kept in most recently used order and a store into a full
+** set evicts its last entry. Each entry also remembers how far the rule
+** looked ahead, so that an edit only invalidates the entries that saw it.
+*/
+static struct MemoEntry *nez_MemoSet(ParsingMemo memo, int rule, long pos) {
+  uint64_t h = (uint64_t)pos * 0x9E3779B97F4A7C15ULL ^ (uint64_t)rule;
+  h ^= h >> 29;
+  return &memo->entries[((size_t)h & (memo->size - 1)) * PARSING_MEMO_WAYS];
+}
+
+/* moves set[way] in front of the entries used before it */
+static struct MemoEntry *nez_MemoFront(struct MemoEntry *set, int way) {
+  struct MemoEntry e = set[way];
+  memmove(set + 1, set, sizeof(struct MemoEntry) * way);
+  set[0] = e;
+  return set;
+}
+
+void nez_ClearMemo(ParsingMemo memo) {
+  if (memo->used > 0) {
+    memset(memo->entries, 0,
+           sizeof(struct MemoEntry) * PARSING_MEMO_WAYS * memo->size);
+  }
+  memo->used = 0;
+}
+
+ParsingMemo nez_CreateMemo(size_t budget, int flags) {
+  ParsingMemo memo = (ParsingMemo)malloc(sizeof(struct ParsingMemo));
+  size_t set = sizeof(struct MemoEntry) * PARSING_MEMO_WAYS;
+  memo->size = 1;
+  while (memo->size * 2 * set <= budget) {
+    memo->size <<= 1;
+  }
+  memo->flags = flags;
+  /* pages of the table are only touched once entries land in them */
+  memo->entries = (struct MemoEntry *)calloc(memo->size, set);
+  memo->used = 0;
+  memo->evicted = 0;
+  memo->rules = NULL;
+  memo->rule_size = 0;
+  return memo;
+}
+
+void nez_DisposeMemo(ParsingMemo memo) {
+  free(memo->rules);
+  free(memo->entries);
+  free(memo);
+}
+
+/*
+** Statistics of a rule, indexed by its entry offset and grown as rules
+** are first seen. NULL when there is no memory for them, in which case
+** the rule is not memoized.
+*/
+static struct MemoRule *nez_MemoRule(ParsingMemo memo, int rule) {
+  if ((size_t)rule >= memo->rule_size) {
+    size_t size = memo->rule_size == 0 ? 256 : memo->rule_size;
+    struct MemoRule *rules;
+    while (size <= (size_t)rule) {
+      size *= 2;
+    }
+    rules = (struct MemoRule *)realloc(memo->rules,
+                                       sizeof(struct MemoRule) * size);
+    if (rules == NULL) {
+      return NULL;
+    }
+    memset(rules + memo->rule_size, 0,
+           sizeof(struct MemoRule) * (size - memo->rule_size));
+    memo->rules = rules;
+    memo->rule_size = size;
+  }
+  return &memo->rules[rule];
+}
+
+/*
+** With PARSING_MEMO_ADAPTIVE a rule is judged every PARSING_MEMO_PROBATION
+** lookups: if fewer than PARSING_MEMO_MIN_HIT_RATE percent of them hit, it
+** is neither looked up nor stored for the next PARSING_MEMO_RETRY calls,
+** after which it is given another chance.
+*/
+static int nez_MemoSkip(ParsingMemo memo, struct MemoRule *r, int hit) {
+  if (r->skipped > 0) {
+    r->skipped--;
+    return 1;
+  }
+  r->lookups++;
+  r->hits += hit;
+  if (r->lookups == PARSING_MEMO_PROBATION) {
+    if ((memo->flags & PARSING_MEMO_ADAPTIVE)
+        && r->hits * 100 < r->lookups * PARSING_MEMO_MIN_HIT_RATE) {
+      r->skipped = PARSING_MEMO_RETRY;
+    }
+    r->lookups = r->hits = 0;
+  }
+  return 0;
+}
+
+struct MemoEntry *nez_MemoLookup(ParsingMemo memo, int rule, long pos) {
+  struct MemoRule *r = nez_MemoRule(memo, rule);
+  struct MemoEntry *set;
+  if (r == NULL || r->skipped > 0) {
+    if (r != NULL) {
+      nez_MemoSkip(memo, r, 0);
+    }
+    return NULL;
+  }
+  set = nez_MemoSet(memo, rule, pos);
+  for (int i = 0; i < PARSING_MEMO_WAYS; i++) {
+    if (set[i].pos == pos && set[i].rule == rule) {
+      nez_MemoSkip(memo, r, 1);
+      return nez_MemoFront(set, i);
+    }
+  }
+  nez_MemoSkip(memo, r, 0);
+  return NULL;
+}
+
+static void nez_MemoInsert(ParsingMemo memo, const struct MemoEntry *e) {
+  struct MemoEntry *set = nez_MemoSet(memo, e->rule, e->pos);
+  int i;
+  for (i = 0; i < PARSING_MEMO_WAYS - 1; i++) {
+    if (set[i].rule == 0 || (set[i].pos == e->pos && set[i].rule == e->rule)) {
+      break;
+    }
+  }
+  if (set[i].rule == 0) {
+    memo->used++;
+  }
+  else if (set[i].pos != e->pos || set[i].rule != e->rule) {
+    memo->evicted++;
+  }
+  nez_MemoFront(set, i)[0] = *e;
+}
+
+void nez_MemoStore(ParsingMemo memo, int rule, long pos, long len, long reach,
+                   int fail) {
+  struct MemoEntry e;
+  if ((size_t)rule < memo->rule_size && memo->rules[rule].skipped > 0) {
+    return;
+  }
+  e.pos = pos;
+  e.rule = rule;
+  e.fail = fail;
+  e.len = len;
+  e.reach = reach;
+  nez_MemoInsert(memo, &e);
+}
+
+/*
+** The bytes [start, old_end) were replaced and everything after them moved
+** by delta. A rule that looked at bytes up to pos + reach + lookahead is
+** dropped if that range overlaps the edit. Entries before the edit stay
+** in their sets; those after it move and are inserted again.
+*/
+void nez_MemoEdit(ParsingMemo memo, size_t start, size_t old_end, long delta,
+                  int lookahead) {
+  struct MemoEntry *moved = NULL;
+  size_t moved_size = 0;
+  size_t moved_capacity = 0;
+  if (memo->used == 0) {
+    return;
+  }
+  for (size_t s = 0; s < memo->size * PARSING_MEMO_WAYS;
+       s += PARSING_MEMO_WAYS) {
+    struct MemoEntry *set = &memo->entries[s];
+    int kept = 0;
+    int i;
+    for (i = 0; i < PARSING_MEMO_WAYS && set[i].rule != 0; i++) {
+      struct MemoEntry e = set[i];
+      if ((size_t)e.pos >= old_end && delta != 0) {
+        if (moved_size == moved_capacity) {
+          size_t capacity = moved_capacity == 0 ? 256 : moved_capacity * 2;
+          struct MemoEntry *p = (struct MemoEntry *)realloc(
+              moved, sizeof(struct MemoEntry) * capacity);
+          if (p == NULL) {
+            free(moved);
+            nez_ClearMemo(memo);
+            return;
+          }
+          moved = p;
+          moved_capacity = capacity;
+        }
+        e.pos += delta;
+        moved[moved_size++] = e;
+      }
+      else if ((size_t)e.pos >= old_end
+               || (size_t)(e.pos + e.reach + lookahead) <= start) {
+        set[kept++] = e;
+        continue;
+      }
+      memo->used--;
+    }
+    memset(set + kept, 0, sizeof(struct MemoEntry) * (i - kept));
+  }
+  /* least recently used first, so that they end up in the same order */
+  while (moved_size > 0) {
+    nez_MemoInsert(memo, &moved[--moved_size]);
+  }
+  free(moved);
+}
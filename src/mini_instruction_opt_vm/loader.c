@@ -18,6 +18,8 @@ typedef struct ByteCodeLoader {
   char *input;
   byteCodeInfo *info;
   NezVMInstruction *head;
+  int extended;   /* the last instruction was EXTENDED */
+  int32_t wide;   /* and this is its operand */
 } ByteCodeLoader;
 
 char *loadFile(const char *filename, size_t *length) {
@@ -70,6 +72,10 @@ static uint16_t Loader_Read16(ByteCodeLoader *loader) {
   return read16(loader->input, loader->info);
 }
 
+static uint8_t Loader_Read8(ByteCodeLoader *loader) {
+  return (uint8_t)loader->input[loader->info->pos++];
+}
+
 static struct nezvm_string* Loader_ReadString(ByteCodeLoader *loader) {
   uint32_t len = Loader_Read16(loader);
   struct nezvm_string* str = (struct nezvm_string*)malloc(sizeof(*str) - 1 + len);
@@ -80,67 +86,126 @@ static struct nezvm_string* Loader_ReadString(ByteCodeLoader *loader) {
   return str;
 }
 
+static bitset_t *Loader_ReadSet(ByteCodeLoader *loader) {
+  int len = Loader_Read16(loader);
+  bitset_t *set = (bitset_t *)malloc(sizeof(bitset_t));
+  bitset_init(set);
+  for (int i = 0; i < len; i++) {
+    bitset_set(set, Loader_Read8(loader));
+  }
+  return set;
+}
+
+/*
+** In the file, EXTENDED carries the whole operand of the next instruction
+** as 32 bits, and the operand of that instruction is ignored (written as
+** 0). Offsets are relative to the instruction itself, not to the EXTENDED
+** before it. The operand is split between the two here.
+*/
+static long Loader_Operand(ByteCodeLoader *loader, NezVMInstruction *ir,
+                           long operand) {
+  long low;
+  if (loader->extended) {
+    operand = loader->wide;
+    loader->extended = 0;
+    if (operand < -NEZVM_WIDE_MAX || operand >= NEZVM_WIDE_MAX) {
+      nez_PrintErrorInfo("operand out of range");
+    }
+    low = operand & NEZVM_ARG_MASK;
+    ir[-1].arg = (operand - low) / (NEZVM_ARG_MASK + 1);
+  }
+  else if (operand < -(NEZVM_ARG_MASK + 1) / 2 || operand > NEZVM_ARG_MASK / 2) {
+    nez_PrintErrorInfo("operand out of range: EXTENDED needed");
+  }
+  low = operand & NEZVM_ARG_MASK;
+  ir->arg = low > NEZVM_ARG_MASK / 2 ? low - (NEZVM_ARG_MASK + 1) : low;
+  return operand;
+}
+
+static int Loader_Index(ByteCodeLoader *loader, NezVMInstruction *ir, int size) {
+  long index = Loader_Operand(loader, ir, Loader_Read8(loader));
+  if (index < 0 || index >= size) {
+    nez_PrintErrorInfo("table index out of range");
+  }
+  return index;
+}
+
 void nez_EmitInstruction(NezVMInstruction* ir, ByteCodeLoader *loader, ParsingContext context) {
+  int index;
+  if (loader->extended) {
+    switch (ir->op) {
+#define WIDE_CASE(NAME) case NEZVM_OP_##NAME:
+      NEZ_IR_EACH_WIDE(WIDE_CASE)
+#undef WIDE_CASE
+      break;
+    default:
+      nez_PrintErrorInfo("EXTENDED before an instruction without operand");
+    }
+  }
   switch(ir->op) {
     case NEZVM_OP_JUMP:
-    case NEZVM_OP_IFFAIL: {
-      ir->arg = Loader_Read16(loader);
+    case NEZVM_OP_IFFAIL:
+    case NEZVM_OP_IFSUCC: {
+      Loader_Operand(loader, ir, (int16_t)Loader_Read16(loader));
       break;
     }
     case NEZVM_OP_CALL: {
-      ir->arg = loader->input[loader->info->pos++];
-      context->call_table[ir->arg] = Loader_Read32(loader);
+      index = Loader_Index(loader, ir, context->call_table_size);
+      context->call_table[index] = Loader_Read32(loader);
       break;
     }
-    case NEZVM_OP_CHAR: {
+    case NEZVM_OP_CHAR:
+    case NEZVM_OP_OPTIONALCHAR: {
       ir->arg = loader->input[loader->info->pos++];
       break;
     }
-    case NEZVM_OP_NOTCHAR: {
-      ir->arg = loader->input[loader->info->pos++];
-      context->str_table[ir->arg].c = loader->input[loader->info->pos++];
-      context->str_table[ir->arg].jump = Loader_Read32(loader);
-      context->str_table[ir->arg].type = 0;
+    case NEZVM_OP_STOREFLAG: {
+      ir->arg = Loader_Read8(loader);
       break;
     }
-    case NEZVM_OP_CHARMAP: {
-      ir->arg = loader->input[loader->info->pos++];
-      int len = Loader_Read16(loader);
-      context->set_table[ir->arg].set = (bitset_t *)malloc(sizeof(bitset_t));
-      bitset_init(context->set_table[ir->arg].set);
-      for (int i = 0; i < len; i++) {
-        unsigned char c = loader->input[loader->info->pos++];
-        bitset_set(context->set_table[ir->arg].set, c);
-      }
-      context->set_table[ir->arg].jump = Loader_Read32(loader);
+    case NEZVM_OP_NOTCHAR:
+    case NEZVM_OP_NOTCHARANY: {
+      index = Loader_Index(loader, ir, context->str_table_size);
+      context->str_table[index].c = loader->input[loader->info->pos++];
+      context->str_table[index].jump = Loader_Read32(loader);
+      context->str_table[index].type = 0;
+      break;
+    }
+    case NEZVM_OP_CHARMAP:
+    case NEZVM_OP_NOTCHARMAP: {
+      index = Loader_Index(loader, ir, context->set_table_size);
+      context->set_table[index].set = Loader_ReadSet(loader);
+      context->set_table[index].jump = Loader_Read32(loader);
       break;
     }
     case NEZVM_OP_OPTIONALCHARMAP:
     case NEZVM_OP_ZEROMORECHARMAP: {
-      ir->arg = loader->input[loader->info->pos++];
-      int len = Loader_Read16(loader);
-      context->set_table[ir->arg].set = (bitset_t *)malloc(sizeof(bitset_t));
-      bitset_init(context->set_table[ir->arg].set);
-      for (int i = 0; i < len; i++) {
-        unsigned c = loader->input[loader->info->pos++];
-        bitset_set(context->set_table[ir->arg].set, c);
-      }
+      index = Loader_Index(loader, ir, context->set_table_size);
+      context->set_table[index].set = Loader_ReadSet(loader);
       break;
     }
     case NEZVM_OP_STRING:
-    case NEZVM_OP_NOTSTRING:
-     {
-      ir->arg = loader->input[loader->info->pos++];
-      context->str_table[ir->arg].str = Loader_ReadString(loader);
-      context->str_table[ir->arg].jump = Loader_Read32(loader);
-      context->str_table[ir->arg].type = 1;
+    case NEZVM_OP_NOTSTRING: {
+      index = Loader_Index(loader, ir, context->str_table_size);
+      context->str_table[index].str = Loader_ReadString(loader);
+      context->str_table[index].jump = Loader_Read32(loader);
+      context->str_table[index].type = 1;
+      break;
+    }
+    case NEZVM_OP_OPTIONALSTRING: {
+      index = Loader_Index(loader, ir, context->str_table_size);
+      context->str_table[index].str = Loader_ReadString(loader);
+      context->str_table[index].type = 1;
+      break;
+    }
+    case NEZVM_OP_EXTENDED: {
+      loader->extended = 1;
+      loader->wide = Loader_Read32(loader);
       break;
     }
   }
 }
 
-NezVMInstruction *nez_VM_Prepare(ParsingContext, NezVMInstruction *);
-
 NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
                                       const char *fileName,
                                       const char *nonTerminalName) {
@@ -167,7 +232,7 @@ NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
 
   /* set table size */
   context->set_table_size = read32(buf, &info);
-  context->set_table = (bitset_ptr_t *)malloc(sizeof(bitset_t) * context->set_table_size);
+  context->set_table = (bitset_ptr_t *)malloc(sizeof(bitset_ptr_t) * context->set_table_size);
 
   /* str table size */
   context->str_table_size = read32(buf, &info);
@@ -189,19 +254,28 @@ NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
   loader.input = buf;
   loader.info = &info;
   loader.head = head;
+  loader.extended = 0;
 
   /* f_convert[] is function pointer that emit instruction */
   for (uint64_t i = 0; i < info.bytecode_length; i++) {
-    inst->op = buf[info.pos++];
+    uint8_t opcode = buf[info.pos++];
+    if (opcode >= NEZ_IR_MAX) {
+      nez_PrintErrorInfo("unknown instruction");
+    }
+    inst->op = opcode;
     nez_EmitInstruction(inst, &loader, context);
     inst++;
   }
+  if (loader.extended) {
+    nez_PrintErrorInfo("EXTENDED at the end of the bytecode");
+  }
 
 #if PEGVM_DEBUG
   dump_NezVMInstructions(inst, info.bytecode_length);
 #endif
 
   context->bytecode_length = info.bytecode_length;
+  head = nez_VM_Prepare(context, head);
   free(buf);
   return head;
 }
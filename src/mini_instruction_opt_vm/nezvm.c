@@ -42,12 +42,23 @@ static inline StackEntry POP_SP(ParsingContext ctx) {
   return --ctx->stack_pointer;
 }
 
+#if NEZVM_THREADED
+/*
+** thread is biased so that the address of an instruction, scaled, indexes
+** its handler without subtracting inst first
+*/
+#define THREAD_SCALE (sizeof(void *) / sizeof(NezVMInstruction))
+#define GET_ADDR(PC) (*(const void **)(thread + (uintptr_t)(PC) * THREAD_SCALE))
+#else
 #define GET_ADDR(PC) (OPJUMP[(PC)->op])
+#endif
 #define DISPATCH_NEXT goto *GET_ADDR(++pc)
 #define JUMP(dst) goto *GET_ADDR(pc += dst)
 #define RET goto *GET_ADDR(pc = inst + (POP_SP(context))->jmp)
 
 #define OP(OP) NEZVM_OP_##OP: //fprintf(stderr, "[%d] %s\n", pc - inst, get_opname(pc->op));
+/* EXTENDED enters after the operand is read, with the wide one in arg */
+#define OPERAND(OP) arg = pc->arg; NEZVM_WIDE_##OP:
 
 long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst) {
   static const void *OPJUMP[] = {
@@ -55,14 +66,27 @@ long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst) {
     NEZ_IR_EACH(DEFINE_TABLE)
 #undef DEFINE_TABLE
   };
+  static const void *OPJUMP_WIDE[NEZ_IR_MAX] = {
+#define DEFINE_TABLE(NAME) [NEZVM_OP_##NAME] = &&NEZVM_WIDE_##NAME,
+    NEZ_IR_EACH_WIDE(DEFINE_TABLE)
+#undef DEFINE_TABLE
+  };
 
   register const char *cur = context->inputs + context->pos;
   register int failflag = 0;
   register const NezVMInstruction *pc;
+  register long arg = 0;
+#if NEZVM_THREADED
+  register uintptr_t thread =
+      (uintptr_t)context->thread - (uintptr_t)inst * THREAD_SCALE;
+#endif
   register const int* call_table = context->call_table;
   register const bitset_ptr_t* set_table = context->set_table;
   register const nezvm_string_ptr_t* str_table = context->str_table;
 
+  if (inst == NULL) {
+    return (long)OPJUMP;
+  }
   pc = inst + 1;
 
   PUSH_IP(context, 0);
@@ -83,18 +107,21 @@ long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst) {
     DISPATCH_NEXT;
   }
   OP(JUMP) {
-    JUMP(pc->arg);
+    OPERAND(JUMP);
+    JUMP(arg);
   }
   OP(CALL) {
+    OPERAND(CALL);
     PUSH_IP(context, pc - inst + 1);
-    JUMP(call_table[pc->arg]);
+    JUMP(call_table[arg]);
   }
   OP(RET) {
     RET;
   }
   OP(IFFAIL) {
+    OPERAND(IFFAIL);
     if (failflag) {
-      JUMP(pc->arg);
+      JUMP(arg);
     } else {
       DISPATCH_NEXT;
     }
@@ -108,21 +135,23 @@ long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst) {
     DISPATCH_NEXT;
   }
   OP(CHARMAP) {
-    if (!bitset_get(set_table[pc->arg].set, *cur++)) {
+    OPERAND(CHARMAP);
+    if (!bitset_get(set_table[arg].set, *cur++)) {
       // fprintf(stderr, "%u\n", (unsigned char)*cur);
       --cur;
       failflag = 1;
-      JUMP(set_table[pc->arg].jump);
+      JUMP(set_table[arg].jump);
     }
     DISPATCH_NEXT;
   }
   OP(STRING) {
     int next;
-    if ((next = nezvm_string_equal(context->str_table[pc->arg].str, cur)) > 0) {
+    OPERAND(STRING);
+    if ((next = nezvm_string_equal(str_table[arg].str, cur)) > 0) {
       cur += next;
     } else {
       failflag = 1;
-      JUMP(str_table[pc->arg].jump);
+      JUMP(str_table[arg].jump);
     }
     DISPATCH_NEXT;
   }
@@ -150,41 +179,102 @@ long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst) {
     DISPATCH_NEXT;
   }
   OP(NOTCHAR) {
-    if (*cur == str_table[pc->arg].c) {
+    OPERAND(NOTCHAR);
+    if (*cur == str_table[arg].c) {
       failflag = 1;
-      JUMP(str_table[pc->arg].jump);
+      JUMP(str_table[arg].jump);
     }
     DISPATCH_NEXT;
   }
   OP(NOTSTRING) {
-    if (nezvm_string_equal(str_table[pc->arg].str, cur) > 0) {
+    OPERAND(NOTSTRING);
+    if (nezvm_string_equal(str_table[arg].str, cur) > 0) {
       failflag = 1;
-      JUMP(str_table[pc->arg].jump);
+      JUMP(str_table[arg].jump);
     }
     DISPATCH_NEXT;
   }
   OP(OPTIONALCHARMAP) {
-    if (bitset_get(set_table[pc->arg].set, *cur)) {
+    OPERAND(OPTIONALCHARMAP);
+    if (bitset_get(set_table[arg].set, *cur)) {
       ++cur;
     }
     DISPATCH_NEXT;
   }
   OP(OPTIONALSTRING) {
-    cur += nezvm_string_equal(str_table[pc->arg].str, cur);
+    OPERAND(OPTIONALSTRING);
+    cur += nezvm_string_equal(str_table[arg].str, cur);
     DISPATCH_NEXT;
   }
   OP(ZEROMORECHARMAP) {
+    OPERAND(ZEROMORECHARMAP);
   L_head:
     ;
-    if (bitset_get(set_table[pc->arg].set, *cur)) {
+    if (bitset_get(set_table[arg].set, *cur)) {
       cur++;
       goto L_head;
     }
     DISPATCH_NEXT;
   }
+  OP(IFSUCC) {
+    OPERAND(IFSUCC);
+    if (!failflag) {
+      JUMP(arg);
+    } else {
+      DISPATCH_NEXT;
+    }
+  }
+  OP(STOREFLAG) {
+    failflag = pc->arg;
+    DISPATCH_NEXT;
+  }
+  OP(NOTCHARMAP) {
+    OPERAND(NOTCHARMAP);
+    if (bitset_get(set_table[arg].set, *cur)) {
+      failflag = 1;
+      JUMP(set_table[arg].jump);
+    }
+    DISPATCH_NEXT;
+  }
+  OP(NOTCHARANY) {
+    OPERAND(NOTCHARANY);
+    if (*cur == 0 || *cur == str_table[arg].c) {
+      failflag = 1;
+      JUMP(str_table[arg].jump);
+    }
+    cur++;
+    DISPATCH_NEXT;
+  }
+  OP(OPTIONALCHAR) {
+    if (*cur == pc->arg) {
+      ++cur;
+    }
+    DISPATCH_NEXT;
+  }
+  OP(EXTENDED) {
+    arg = (long)pc->arg * (NEZVM_ARG_MASK + 1) + (pc[1].arg & NEZVM_ARG_MASK);
+    ++pc;
+    goto *OPJUMP_WIDE[pc->op];
+  }
   return -1;
 }
 
+NezVMInstruction *nez_VM_Prepare(ParsingContext context,
+                                 NezVMInstruction *inst) {
+#if NEZVM_THREADED
+  const void **table = (const void **)nez_VM_Execute(context, NULL);
+  context->thread =
+      (const void **)malloc(sizeof(const void *) * context->bytecode_length);
+  if (context->thread == NULL) {
+    nez_PrintErrorInfo("malloc error: cannot allocate the threaded code");
+  }
+  for (long i = 0; i < context->bytecode_length; i++) {
+    context->thread[i] = table[inst[i].op];
+  }
+#endif
+  return inst;
+}
+
 #define NEZVM_STAT 5
 void nez_ParseStat(ParsingContext context, NezVMInstruction *inst) {
   for (int i = 0; i < NEZVM_STAT; i++) {
@@ -207,6 +297,7 @@ ParsingContext nez_CreateParsingContext(const char *filename) {
   ParsingContext ctx = (ParsingContext)malloc(sizeof(struct ParsingContext));
   ctx->pos = ctx->input_size = 0;
   ctx->inputs = loadFile(filename, &ctx->input_size);
+  ctx->thread = NULL;
   ctx->stack_pointer_base =
       (StackEntry)malloc(sizeof(union StackEntry) * PARSING_CONTEXT_MAX_STACK_LENGTH);
   ctx->stack_pointer = &ctx->stack_pointer_base[0];
@@ -216,6 +307,7 @@ ParsingContext nez_CreateParsingContext(const char *filename) {
 
 void nez_DisposeParsingContext(ParsingContext ctx) {
   free(ctx->inputs);
+  free(ctx->thread);
   free(ctx->stack_pointer_base);
   free(ctx);
 }
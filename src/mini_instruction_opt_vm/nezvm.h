@@ -6,7 +6,22 @@
 #define NEZVM_DEBUG 0
 #define NEZVM_PROFILE 0
 
-#define NEZ_IR_MAX 22
+/*
+** Threaded dispatch: nez_VM_Prepare() resolves the handler of every
+** instruction once at load time into a parallel array, so that dispatch
+** does not wait for the opcode to be loaded and looked up in OPJUMP. The
+** instructions themselves stay 16 bits. Build with -DNEZVM_THREADED=0 for
+** the table-indexed form.
+*/
+#ifndef NEZVM_THREADED
+#define NEZVM_THREADED 1
+#endif
+
+/*
+** Opcodes after ZEROMORECHARMAP were added later and are numbered after
+** it, so that older bytecode files keep their meaning.
+*/
+#define NEZ_IR_MAX 26
 #define NEZ_IR_EACH(OP)\
 	OP(EXIT)\
 	OP(SUCC)\
@@ -27,8 +42,39 @@
 	OP(NOTSTRING)\
 	OP(OPTIONALCHARMAP)\
 	OP(OPTIONALSTRING)\
+	OP(ZEROMORECHARMAP)\
+	OP(IFSUCC)\
+	OP(STOREFLAG)\
+	OP(NOTCHARMAP)\
+	OP(NOTCHARANY)\
+	OP(OPTIONALCHAR)\
+	OP(EXTENDED)
+
+/*
+** Instructions whose operand is a jump offset or a table index. When it
+** does not fit in arg, the instruction is preceded by EXTENDED, whose arg
+** holds the operand's upper bits; arg of the instruction keeps the lower
+** NEZVM_ARG_BITS, so operands reach +-2^21 and instructions stay 16 bits.
+*/
+#define NEZ_IR_EACH_WIDE(OP)\
+	OP(JUMP)\
+	OP(CALL)\
+	OP(IFFAIL)\
+	OP(IFSUCC)\
+	OP(CHARMAP)\
+	OP(STRING)\
+	OP(NOTCHAR)\
+	OP(NOTCHARMAP)\
+	OP(NOTSTRING)\
+	OP(NOTCHARANY)\
+	OP(OPTIONALCHARMAP)\
+	OP(OPTIONALSTRING)\
 	OP(ZEROMORECHARMAP)
 
+#define NEZVM_ARG_BITS 11
+#define NEZVM_ARG_MASK ((1 << NEZVM_ARG_BITS) - 1)
+#define NEZVM_WIDE_MAX (1L << (NEZVM_ARG_BITS * 2 - 1))
+
 typedef struct NezVMInstruction {
 	unsigned short op : 5;
 	short arg : 11;
@@ -74,13 +120,15 @@ struct ParsingContext {
   long bytecode_length;
   long startPoint;
 
-  uint8_t call_table_size;
-  uint8_t set_table_size;
-  uint8_t str_table_size;
+  int call_table_size;
+  int set_table_size;
+  int str_table_size;
   int* call_table;
   bitset_ptr_t* set_table;
   nezvm_string_ptr_t* str_table;
 
+  const void **thread;
+
   size_t stack_size;
   union StackEntry* stack_pointer;
   union StackEntry* stack_pointer_base;
@@ -101,6 +149,8 @@ NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
                                       const char *fileName,
                                       const char *nonTerminalName);
 void nez_DisposeInstruction(NezVMInstruction *inst, long length);
+NezVMInstruction *nez_VM_Prepare(ParsingContext context,
+                                 NezVMInstruction *inst);
 
 void nez_Parse(ParsingContext context, NezVMInstruction *inst);
 void nez_ParseStat(ParsingContext context, NezVMInstruction *inst);
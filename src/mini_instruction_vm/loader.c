@@ -143,8 +143,6 @@ void nez_EmitInstruction(NezVMInstruction* ir, ByteCodeLoader *loader, ParsingCo
   }
 }
 
-NezVMInstruction *nez_VM_Prepare(ParsingContext, NezVMInstruction *);
-
 NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
                                       const char *fileName,
                                       const char *nonTerminalName) {
@@ -200,6 +198,7 @@ NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
 #endif
 
   context->bytecode_length = info.bytecode_length;
+  head = nez_VM_Prepare(context, head);
 #if defined(NEZVM_COUNT_BYTECODE_MALLOCED_SIZE)
   fprintf(stderr, "instruction_size=%zd\n", sizeof(*inst));
   fprintf(stderr, "malloced_size=%zd[Byte], %zd[Byte]\n",
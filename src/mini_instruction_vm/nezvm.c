@@ -68,7 +68,16 @@ static inline StackEntry POP_SP(ParsingContext ctx) {
 
 #define NEXT_OP (OPJUMP[++pc->op])
 
+#if NEZVM_THREADED
+/*
+** thread is biased so that the address of an instruction, scaled, indexes
+** its handler without subtracting inst first
+*/
+#define THREAD_SCALE (sizeof(void *) / sizeof(NezVMInstruction))
+#define GET_ADDR(PC) (*(const void **)(thread + (uintptr_t)(PC) * THREAD_SCALE))
+#else
 #define GET_ADDR(PC) (OPJUMP[(PC)->op])
+#endif
 #define DISPATCH_NEXT goto *GET_ADDR(++pc)
 #define JUMP(dst) goto *GET_ADDR(pc += dst)
 #define RET goto *GET_ADDR(pc = inst + (POP_SP(context))->jmp)
@@ -85,6 +94,13 @@ long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst) {
   register const char *cur = context->inputs + context->pos;
   register int failflag = 0;
   register const NezVMInstruction *pc;
+#if NEZVM_THREADED
+  register uintptr_t thread =
+      (uintptr_t)context->thread - (uintptr_t)inst * THREAD_SCALE;
+#endif
+  if (inst == NULL) {
+    return (long)OPJUMP;
+  }
   pc = inst + 1;
 
   PUSH_IP(context, 0);
@@ -143,6 +159,22 @@ long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst) {
   return -1;
 }
 
+NezVMInstruction *nez_VM_Prepare(ParsingContext context,
+                                 NezVMInstruction *inst) {
+#if NEZVM_THREADED
+  const void **table = (const void **)nez_VM_Execute(context, NULL);
+  context->thread =
+      (const void **)malloc(sizeof(const void *) * context->bytecode_length);
+  if (context->thread == NULL) {
+    nez_PrintErrorInfo("malloc error: cannot allocate the threaded code");
+  }
+  for (long i = 0; i < context->bytecode_length; i++) {
+    context->thread[i] = table[inst[i].op];
+  }
+#endif
+  return inst;
+}
+
 void nez_Parse(ParsingContext context, NezVMInstruction *inst) {
   if (nez_VM_Execute(context, inst)) {
     nez_PrintErrorInfo("parse error");
@@ -171,6 +203,7 @@ ParsingContext nez_CreateParsingContext(const char *filename) {
   ParsingContext ctx = (ParsingContext)malloc(sizeof(struct ParsingContext));
   ctx->pos = ctx->input_size = 0;
   ctx->inputs = loadFile(filename, &ctx->input_size);
+  ctx->thread = NULL;
   ctx->stack_pointer_base =
       (StackEntry)malloc(sizeof(union StackEntry) * PARSING_CONTEXT_MAX_STACK_LENGTH);
   ctx->stack_pointer = &ctx->stack_pointer_base[0];
@@ -180,6 +213,7 @@ ParsingContext nez_CreateParsingContext(const char *filename) {
 
 void nez_DisposeParsingContext(ParsingContext ctx) {
   free(ctx->inputs);
+  free(ctx->thread);
   free(ctx->stack_pointer_base);
   free(ctx);
 }
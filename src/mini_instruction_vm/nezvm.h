@@ -4,6 +4,17 @@
 #define NEZVM_DEBUG 0
 #define NEZVM_PROFILE 0
 
+/*
+** Threaded dispatch: nez_VM_Prepare() resolves the handler of every
+** instruction once at load time into a parallel array, so that dispatch
+** does not wait for the opcode to be loaded and looked up in OPJUMP. The
+** instructions themselves stay 16 bits. Build with -DNEZVM_THREADED=0 for
+** the table-indexed form.
+*/
+#ifndef NEZVM_THREADED
+#define NEZVM_THREADED 1
+#endif
+
 typedef struct nezvm_string {
   unsigned len;
   char text[1];
@@ -50,6 +61,8 @@ struct ParsingContext {
 
   int* call_table;
 
+  const void **thread;
+
   size_t stack_size;
   union StackEntry* stack_pointer;
   union StackEntry* stack_pointer_base;
@@ -64,6 +77,8 @@ NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
                                       const char *fileName,
                                       const char *nonTerminalName);
 void nez_DisposeInstruction(NezVMInstruction *inst, long length);
+NezVMInstruction *nez_VM_Prepare(ParsingContext context,
+                                 NezVMInstruction *inst);
 
 void nez_Parse(ParsingContext context, NezVMInstruction *inst);
 void nez_ParseStat(ParsingContext context, NezVMInstruction *inst);
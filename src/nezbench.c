@@ -0,0 +1,184 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "libnez.h"
+#include "serve.h"
+
+char *loadFile(const char *filename, size_t *length);
+
+/*
+** Load generator for nezvm --serve: each connection runs on its own thread
+** and sends the same input back to back, timing every round trip.
+*/
+typedef struct BenchClient {
+  const char *socket_path;
+  int type;
+  int grammar;
+  const char *rule;
+  const char *data;
+  size_t length;
+  long requests;
+  uint64_t *latency;       /* round trips, in nanoseconds */
+  uint64_t parse_time;     /* sum of the times reported by the daemon */
+  long failed;
+  int error;
+  pthread_t thread;
+} BenchClient;
+
+static void nez_ShowUsage(void) {
+  fprintf(stderr, "\nnezbench <options>\n");
+  fprintf(stderr, "  -S <socket>   Specify the socket of a nezvm --serve daemon\n");
+  fprintf(stderr, "  -i <filename> Specify the input sent with every request\n");
+  fprintf(stderr, "  -g <id>       Specify the grammar (default: 0)\n");
+  fprintf(stderr, "  -s <rule>     Specify the start rule (default: the grammar's)\n");
+  fprintf(stderr, "  -c <conns>    Specify the number of connections (default: 1)\n");
+  fprintf(stderr, "  -n <count>    Specify the requests per connection (default: 1000)\n");
+  fprintf(stderr, "  -f            Send the file path for the daemon to read\n");
+  fprintf(stderr, "  -h            Display this help and exit\n\n");
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t nez_BenchClock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *nez_BenchRun(void *arg) {
+  BenchClient *c = (BenchClient *)arg;
+  NezServeResponse response;
+  char message[NEZVM_SERVE_MAX_MESSAGE];
+  int fd = nez_ServeConnect(c->socket_path);
+  if (fd < 0) {
+    c->error = 1;
+    return NULL;
+  }
+  for (long i = 0; i < c->requests; i++) {
+    uint64_t start = nez_BenchClock();
+    if (nez_ServeParse(fd, c->type, c->grammar, c->rule, c->data, c->length,
+                       &response, message, sizeof(message)) != 0) {
+      c->error = 1;
+      c->requests = i;
+      break;
+    }
+    c->latency[i] = nez_BenchClock() - start;
+    c->parse_time += response.elapsed;
+    if (response.status != NEZ_OK) {
+      c->failed++;
+    }
+  }
+  close(fd);
+  return NULL;
+}
+
+static int nez_CompareLatency(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *const argv[]) {
+  const char *socket_path = NULL;
+  const char *input_file = NULL;
+  const char *rule = NULL;
+  char path[PATH_MAX];
+  int grammar = 0;
+  int paths = 0;
+  int conns = 1;
+  long requests = 1000;
+  long total = 0, failed = 0;
+  uint64_t parse_time = 0, start, elapsed;
+  uint64_t *latency;
+  BenchClient *clients;
+  char *text;
+  size_t length;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:i:g:s:c:n:fh")) != -1) {
+    switch (opt) {
+    case 'S':
+      socket_path = optarg;
+      break;
+    case 'i':
+      input_file = optarg;
+      break;
+    case 'g':
+      grammar = atoi(optarg);
+      break;
+    case 's':
+      rule = optarg;
+      break;
+    case 'c':
+      conns = atoi(optarg);
+      break;
+    case 'n':
+      requests = atol(optarg);
+      break;
+    case 'f':
+      paths = 1;
+      break;
+    default:
+      nez_ShowUsage();
+    }
+  }
+  if (socket_path == NULL || input_file == NULL || conns <= 0
+      || requests <= 0) {
+    nez_ShowUsage();
+  }
+  if ((text = loadFile(input_file, &length)) == NULL
+      || (paths && realpath(input_file, path) == NULL)) {
+    fprintf(stderr, "%s: %s\n", input_file, nez_StatusMessage(NEZ_IO_ERROR));
+    return EXIT_FAILURE;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  clients = (BenchClient *)calloc(conns, sizeof(BenchClient));
+  latency = (uint64_t *)malloc(sizeof(uint64_t) * conns * requests);
+  start = nez_BenchClock();
+  for (int i = 0; i < conns; i++) {
+    BenchClient *c = &clients[i];
+    c->socket_path = socket_path;
+    c->type = paths ? NEZVM_SERVE_FILE : NEZVM_SERVE_BUFFER;
+    c->grammar = grammar;
+    c->rule = rule;
+    c->data = paths ? path : text;
+    c->length = paths ? strlen(path) : length;
+    c->requests = requests;
+    c->latency = &latency[i * requests];
+    pthread_create(&c->thread, NULL, nez_BenchRun, c);
+  }
+  for (int i = 0; i < conns; i++) {
+    BenchClient *c = &clients[i];
+    pthread_join(c->thread, NULL);
+    if (c->error) {
+      fprintf(stderr, "connection %d failed after %ld requests\n", i,
+              c->requests);
+    }
+    /* pack the latencies of all connections for the percentiles */
+    memmove(&latency[total], c->latency, sizeof(uint64_t) * c->requests);
+    total += c->requests;
+    failed += c->failed;
+    parse_time += c->parse_time;
+  }
+  elapsed = nez_BenchClock() - start;
+  if (total == 0) {
+    return EXIT_FAILURE;
+  }
+  qsort(latency, total, sizeof(uint64_t), nez_CompareLatency);
+  printf("requests=%ld rejected=%ld connections=%d input=%zu[Byte]\n", total,
+         failed, conns, length);
+  printf("elapsed=%.3fs throughput=%.0f[req/s] %.1f[MB/s]\n", elapsed / 1e9,
+         total / (elapsed / 1e9), (double)total * length / (elapsed / 1e3));
+  printf("latency[us] p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+         latency[total / 2] / 1e3, latency[total * 9 / 10] / 1e3,
+         latency[total * 99 / 100] / 1e3, latency[total - 1] / 1e3);
+  printf("parse[us] mean=%.1f\n", parse_time / 1e3 / total);
+  free(latency);
+  free(clients);
+  free(text);
+  return 0;
+}
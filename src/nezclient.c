@@ -0,0 +1,109 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include "libnez.h"
+#include "serve.h"
+
+char *loadFile(const char *filename, size_t *length);
+
+static void nez_ShowUsage(void) {
+  fprintf(stderr, "\nnezclient <options> files\n");
+  fprintf(stderr, "  -S <socket>   Specify the socket of a nezvm --serve daemon\n");
+  fprintf(stderr, "  -g <id>       Specify the grammar (default: 0)\n");
+  fprintf(stderr, "  -s <rule>     Specify the start rule (default: the grammar's)\n");
+  fprintf(stderr, "  -f            Send file paths for the daemon to read\n");
+  fprintf(stderr, "  -h            Display this help and exit\n\n");
+  exit(EXIT_FAILURE);
+}
+
+/*
+** Parses each file with the daemon and prints one line per file. Exits
+** with a failure status if any of them was not accepted.
+*/
+int main(int argc, char *const argv[]) {
+  const char *socket_path = NULL;
+  const char *rule = NULL;
+  int grammar = 0;
+  int paths = 0;
+  int failed = 0;
+  int opt;
+  int fd;
+  while ((opt = getopt(argc, argv, "S:g:s:fh")) != -1) {
+    switch (opt) {
+    case 'S':
+      socket_path = optarg;
+      break;
+    case 'g':
+      grammar = atoi(optarg);
+      break;
+    case 's':
+      rule = optarg;
+      break;
+    case 'f':
+      paths = 1;
+      break;
+    default:
+      nez_ShowUsage();
+    }
+  }
+  if (socket_path == NULL || optind == argc) {
+    nez_ShowUsage();
+  }
+  signal(SIGPIPE, SIG_IGN);
+  fd = nez_ServeConnect(socket_path);
+  if (fd < 0) {
+    fprintf(stderr, "cannot connect to %s\n", socket_path);
+    return EXIT_FAILURE;
+  }
+  for (int i = optind; i < argc; i++) {
+    NezServeResponse response;
+    char message[NEZVM_SERVE_MAX_MESSAGE];
+    char path[PATH_MAX];
+    const char *data;
+    char *text = NULL;
+    size_t length;
+    if (paths) {
+      /* the daemon may not share our working directory */
+      if (realpath(argv[i], path) == NULL) {
+        fprintf(stderr, "%s: cannot resolve path\n", argv[i]);
+        failed = 1;
+        continue;
+      }
+      data = path;
+      length = strlen(path);
+    }
+    else {
+      if ((text = loadFile(argv[i], &length)) == NULL) {
+        fprintf(stderr, "%s: %s\n", argv[i], nez_StatusMessage(NEZ_IO_ERROR));
+        failed = 1;
+        continue;
+      }
+      data = text;
+    }
+    if (nez_ServeParse(fd, paths ? NEZVM_SERVE_FILE : NEZVM_SERVE_BUFFER,
+                       grammar, rule, data, length, &response, message,
+                       sizeof(message)) != 0) {
+      fprintf(stderr, "connection to %s lost\n", socket_path);
+      free(text);
+      close(fd);
+      return EXIT_FAILURE;
+    }
+    free(text);
+    if (response.status == NEZ_OK) {
+      printf("%s: ok pos=%lld time=%.3fms\n", argv[i],
+             (long long)response.pos, response.elapsed / 1e6);
+    }
+    else {
+      printf("%s: %s%s\n", argv[i],
+             response.status == NEZ_PARSE_ERROR ? "parse error at " : "",
+             message);
+      failed = 1;
+    }
+  }
+  close(fd);
+  return failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,247 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libnez.h"
+#include "nezvm.h"
+#include "trace.h"
+
+char *loadFile(const char *filename, size_t *length);
+
+/*
+** Summarizes the trace dumps written by nezvm --trace: where the VM spent
+** the traced instructions, the backward jumps it kept taking (the loops)
+** and where it moved back in the input (the backtracking), with the rule
+** each offset belongs to.
+*/
+static const char *nezvm_opcode_name[] = {
+#define DEFINE_NAME(NAME) #NAME,
+  NEZ_IR_EACH(DEFINE_NAME)
+#undef DEFINE_NAME
+};
+
+static const char *nezvm_trace_reason[] = {"end of run", "budget overrun",
+                                           "request"};
+
+typedef struct TraceTally {
+  uint64_t key;
+  uint64_t count;
+  uint64_t sum;
+} TraceTally;
+
+static int nez_CompareTallyKey(const void *a, const void *b) {
+  uint64_t x = ((const TraceTally *)a)->key;
+  uint64_t y = ((const TraceTally *)b)->key;
+  return x < y ? -1 : x > y;
+}
+
+static int nez_CompareTallyCount(const void *a, const void *b) {
+  const TraceTally *x = (const TraceTally *)a;
+  const TraceTally *y = (const TraceTally *)b;
+  if (x->count != y->count) {
+    return x->count > y->count ? -1 : 1;
+  }
+  return x->sum > y->sum ? -1 : x->sum < y->sum;
+}
+
+/* merges the tallies of equal keys, most frequent first */
+static long nez_Tally(TraceTally *t, long size) {
+  long n = 0;
+  qsort(t, size, sizeof(TraceTally), nez_CompareTallyKey);
+  for (long i = 0; i < size; i++) {
+    if (n > 0 && t[n - 1].key == t[i].key) {
+      t[n - 1].count += t[i].count;
+      t[n - 1].sum += t[i].sum;
+    }
+    else {
+      t[n++] = t[i];
+    }
+  }
+  qsort(t, n, sizeof(TraceTally), nez_CompareTallyCount);
+  return n;
+}
+
+/* the rule whose entry is the nearest at or before pc */
+static const char *nez_TraceRule(nezvm_rules_ptr_t rules, long pc) {
+  const char *name = "?";
+  long best = -1;
+  if (rules == NULL) {
+    return name;
+  }
+  for (int i = 0; i < rules->rule_size; i++) {
+    if (rules->rules[i].entry <= pc && rules->rules[i].entry > best) {
+      best = rules->rules[i].entry;
+      name = NEZVM_RULE_NAME(rules, i);
+    }
+  }
+  return name;
+}
+
+static const char *nez_TraceOpcode(const struct ParsingTraceEntry *e,
+                                   long size, uint64_t pc) {
+  for (long i = 0; i < size; i++) {
+    if ((uint64_t)e[i].pc == pc && e[i].opcode < NEZVM_OP_SIZE) {
+      return nezvm_opcode_name[e[i].opcode];
+    }
+  }
+  return "?";
+}
+
+static void nez_Summarize(const struct nezvm_trace *header,
+                          const struct ParsingTraceEntry *e,
+                          nezvm_rules_ptr_t rules, int top) {
+  long size = (long)header->size;
+  TraceTally *t = (TraceTally *)malloc(sizeof(TraceTally) * (size + 1));
+  uint64_t ops[NEZVM_OP_SIZE] = {0};
+  uint64_t fails = 0;
+  long n, i;
+  if (t == NULL) {
+    nez_PrintErrorInfo("cannot allocate the summary");
+  }
+  printf("%s after %llu instructions, %.3f sec; the last %ld, at input "
+         "positions %lld..%lld of %llu\n",
+         header->reason < 3 ? nezvm_trace_reason[header->reason] : "?",
+         (unsigned long long)header->count, header->elapsed / 1e9, size,
+         size > 0 ? (long long)e[0].pos : 0LL,
+         size > 0 ? (long long)e[size - 1].pos : 0LL,
+         (unsigned long long)header->input_length);
+  for (i = 0; i < size; i++) {
+    if (e[i].opcode < NEZVM_OP_SIZE) {
+      ops[e[i].opcode]++;
+    }
+    fails += e[i].failflag;
+  }
+  printf("  opcodes (%.1f%% run with the fail flag set):\n",
+         size > 0 ? 100.0 * fails / size : 0.0);
+  for (i = 0; i < NEZVM_OP_SIZE; i++) {
+    if (ops[i] > 0) {
+      printf("    %-16s %10llu %5.1f%%\n", nezvm_opcode_name[i],
+             (unsigned long long)ops[i], 100.0 * ops[i] / size);
+    }
+  }
+
+  for (i = 0; i < size; i++) {
+    t[i].key = (uint64_t)e[i].pc;
+    t[i].count = 1;
+    t[i].sum = 0;
+  }
+  n = nez_Tally(t, size);
+  printf("  hot instructions:\n");
+  for (i = 0; i < n && i < top; i++) {
+    printf("    %10llu  @%-6llu %-16s %s\n", (unsigned long long)t[i].count,
+           (unsigned long long)t[i].key, nez_TraceOpcode(e, size, t[i].key),
+           nez_TraceRule(rules, (long)t[i].key));
+  }
+
+  /* jumps back within the code, calls and returns aside */
+  n = 0;
+  for (i = 0; i + 1 < size; i++) {
+    if (e[i + 1].pc <= e[i].pc && e[i].opcode != NEZVM_OP_RET
+        && e[i].opcode != NEZVM_OP_CALL) {
+      t[n].key = (uint64_t)e[i].pc << 32 | (uint32_t)e[i + 1].pc;
+      t[n].count = 1;
+      t[n].sum = 0;
+      n++;
+    }
+  }
+  n = nez_Tally(t, n);
+  printf("  hot loops (backward jumps):\n");
+  for (i = 0; i < n && i < top; i++) {
+    long from = (long)(t[i].key >> 32);
+    long to = (long)(uint32_t)t[i].key;
+    printf("    %10llu  @%ld -> @%ld in %s\n", (unsigned long long)t[i].count,
+           from, to, nez_TraceRule(rules, to));
+  }
+
+  n = 0;
+  for (i = 0; i + 1 < size; i++) {
+    if (e[i + 1].pos < e[i].pos) {
+      t[n].key = (uint64_t)e[i].pc;
+      t[n].count = 1;
+      t[n].sum = (uint64_t)(e[i].pos - e[i + 1].pos);
+      n++;
+    }
+  }
+  n = nez_Tally(t, n);
+  printf("  backtracking (moves back in the input):\n");
+  for (i = 0; i < n && i < top; i++) {
+    printf("    %10llu  @%-6llu %12llu bytes  %s\n",
+           (unsigned long long)t[i].count, (unsigned long long)t[i].key,
+           (unsigned long long)t[i].sum, nez_TraceRule(rules, (long)t[i].key));
+  }
+
+  for (i = 0; i < size; i++) {
+    t[i].key = (uint64_t)e[i].pos;
+    t[i].count = 1;
+    t[i].sum = 0;
+  }
+  n = nez_Tally(t, size);
+  printf("  positions examined most:\n");
+  for (i = 0; i < n && i < top; i++) {
+    printf("    %10llu  %llu\n", (unsigned long long)t[i].count,
+           (unsigned long long)t[i].key);
+  }
+  free(t);
+}
+
+static void nez_ShowUsage(void) {
+  fprintf(stderr, "\nneztrace <options> dump...\n");
+  fprintf(stderr, "  -n <count>    Specify the lines per table (default: 10)\n");
+  fprintf(stderr, "  -h            Display this help and exit\n\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *const argv[]) {
+  int top = 10;
+  int status = EXIT_SUCCESS;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      top = atoi(optarg);
+      break;
+    default:
+      nez_ShowUsage();
+    }
+  }
+  if (optind == argc) {
+    nez_ShowUsage();
+  }
+  for (int f = optind; f < argc; f++) {
+    size_t length;
+    char *buf = loadFile(argv[f], &length);
+    size_t offset = 0;
+    long dump = 0;
+    if (buf == NULL) {
+      fprintf(stderr, "%s: %s\n", argv[f], nez_StatusMessage(NEZ_IO_ERROR));
+      status = EXIT_FAILURE;
+      continue;
+    }
+    while (offset + sizeof(struct nezvm_trace) <= length) {
+      struct nezvm_trace header;
+      const struct ParsingTraceEntry *entries;
+      nezvm_rules_ptr_t rules = NULL;
+      size_t bytes;
+      memcpy(&header, buf + offset, sizeof(header));
+      if (memcmp(header.magic, NEZVM_TRACE_MAGIC, sizeof(header.magic)) != 0
+          || header.version != NEZVM_TRACE_VERSION) {
+        nez_PrintErrorInfo("not a trace dump");
+      }
+      bytes = sizeof(header) + sizeof(struct ParsingTraceEntry) * header.size
+              + NEZVM_TRACE_ALIGN(header.rules);
+      if (bytes > length - offset) {
+        nez_PrintErrorInfo("truncated trace dump");
+      }
+      entries = (const struct ParsingTraceEntry *)(buf + offset + sizeof(header));
+      if (header.rules > 0) {
+        rules = (nezvm_rules_ptr_t)(entries + header.size);
+      }
+      printf("%s, dump %ld: ", argv[f], ++dump);
+      nez_Summarize(&header, entries, rules, top);
+      offset += bytes;
+    }
+    free(buf);
+  }
+  return status;
+}
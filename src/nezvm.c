@@ -1,7 +1,10 @@
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include <sys/time.h> // gettimeofday
 #include "libnez.h"
 #include "nezvm.h"
+#include "trace.h"
 
 void nez_PrintErrorInfo(const char *errmsg) {
   fprintf(stderr, "%s\n", errmsg);
@@ -30,27 +33,62 @@ static int nezvm_string_equal(nezvm_string_ptr_t str, const char *t) {
 #endif
 }
 
-static inline void PUSH_IP(ParsingContext ctx, const NezVMInstruction *inst) {
-  (ctx->stack_pointer++)->func = inst;
-  if(ctx->stack_pointer >= &ctx->stack_pointer_base[ctx->stack_size]) {
-    nez_PrintErrorInfo("Error:stack over flow");
+/*
+** Returns the first alternative whose literal is a prefix of t, or -1.
+** The walk stops as soon as no deeper node can beat the best match.
+*/
+static inline int nezvm_trie_match(nezvm_trie_ptr_t trie, const char *t,
+                                   const char *end) {
+  const nezvm_trie_node_t *node = trie->nodes;
+  const int *child = NEZVM_TRIE_CHILD(trie);
+  const unsigned char *label = NEZVM_TRIE_LABEL(trie);
+  int best = trie->alt_size;
+  while (1) {
+    int e = node->edge;
+    int edge_end = e + node->edge_size;
+    if (node->accept >= 0 && node->accept < best) {
+      best = node->accept;
+    }
+    if (t == end) {
+      break;
+    }
+    unsigned char c = *t++;
+    while (e < edge_end && label[e] != c) {
+      e++;
+    }
+    if (e == edge_end) {
+      break;
+    }
+    node = &trie->nodes[child[e]];
+    if (best < node->min) {
+      break;
+    }
   }
+  return best < trie->alt_size ? best : -1;
 }
 
-static inline void PUSH_SP(ParsingContext ctx, const char* pos) {
-  (ctx->stack_pointer++)->pos = pos;
-  if(ctx->stack_pointer >= &ctx->stack_pointer_base[ctx->stack_size]) {
-    nez_PrintErrorInfo("Error:stack over flow");
-  }
-}
+/*
+** Stack operations leave the interpreter through L_stack_overflow or
+** L_stack_underflow instead of aborting the process, so they can only be
+** used inside the interpreters of nezvm_exec.h, which define how entries
+** are kept (STACK_TOP, STACK_IP and the like; see NEZVM_MODE_WIDE).
+*/
+#define PUSH_IP(ctx, INST) do { \
+    if (STACK_TOP(ctx) >= stack_end) goto L_stack_overflow; \
+    *STACK_TOP(ctx)++ = STACK_IP(INST); \
+  } while (0)
 
-static inline StackEntry POP_SP(ParsingContext ctx) {
-  --ctx->stack_pointer;
-  if(ctx->stack_pointer < ctx->stack_pointer_base) {
-    nez_PrintErrorInfo("Error:POP_SP");
-  }
-  return ctx->stack_pointer;
-}
+#define PUSH_SP(ctx, POS) do { \
+    if (STACK_TOP(ctx) >= stack_end) goto L_stack_overflow; \
+    *STACK_TOP(ctx)++ = STACK_POS(POS); \
+  } while (0)
+
+#define CHECK_POP(ctx) \
+  if (STACK_TOP(ctx) <= STACK_BASE(ctx)) goto L_stack_underflow
+
+#define POP_SP(ctx) (--STACK_TOP(ctx))
+#define TOP_POS(ctx) STACK_TO_POS(STACK_TOP(ctx)[-1])
+#define POP_POS(ctx) STACK_TO_POS(*POP_SP(ctx))
 
 // #if __GNUC__ >= 3
 // #define likely(x) __builtin_expect(!!(x), 1)
@@ -68,211 +106,668 @@ static inline StackEntry POP_SP(ParsingContext ctx) {
 #define GET_ADDR(PC) ((PC)->addr)
 #define DISPATCH_NEXT goto *GET_ADDR(++pc)
 #define JUMP(dst) goto *GET_ADDR(pc = dst)
-#define RET goto *GET_ADDR(pc = (POP_SP(context))->func)
+#define RET CHECK_POP(context); goto *GET_ADDR(pc = STACK_TO_IP(*POP_SP(context)))
 
-#define OP(OP) NEZVM_OP_##OP:
+/* far is the farthest position the parse has examined so far */
+#define REACH(P) if ((P) > far) far = (P)
 
-long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst) {
-  static const void *table[] = {
-#define DEFINE_TABLE(NAME) &&NEZVM_OP_##NAME,
-    NEZ_IR_EACH(DEFINE_TABLE)
-#undef DEFINE_TABLE
-  };
+/*
+** pc failed at cur; only failures at the farthest position are kept. Most
+** failures happen at the frontier of a successful parse, so this stays
+** inline and leaves duplicates to be removed when the error is reported.
+*/
+static inline void EXPECT_AT(ParsingContext ctx, const NezVMInstruction *pc,
+                             const char *cur) {
+  if (cur >= ctx->expected_at) {
+    if (cur > ctx->expected_at) {
+      ctx->expected_at = cur;
+      ctx->expected_size = 0;
+    }
+    if (ctx->expected_size < PARSING_CONTEXT_MAX_EXPECTED
+        && (ctx->expected_size == 0
+            || ctx->expected[ctx->expected_size - 1] != pc)) {
+      ctx->expected[ctx->expected_size++] = pc;
+    }
+  }
+}
 
-  register const char *cur = context->inputs + context->pos;
-  register int failflag = 0;
-  register const NezVMInstruction *pc;
-  pc = inst + 1;
-  fprintf(stderr, "%zd\n", sizeof(const char*));
-
-  if (inst == NULL) {
-    return (long)table;
+static inline void MEMO_PUSH(ParsingContext ctx, const NezVMInstruction *rule,
+                             const char *pos, const char *far) {
+  ctx->memo_frame->rule = rule;
+  ctx->memo_frame->pos = pos;
+  ctx->memo_frame->far = far;
+  ctx->memo_frame++;
+}
+
+/* hands the events before boundary to the sink */
+static void nez_FlushCapture(struct ParsingCapture *capture, size_t boundary) {
+  const ParsingSink *sink = &capture->sink;
+  size_t n = boundary - capture->base;
+  for (size_t i = 0; i < n; i++) {
+    const struct ParsingEvent *e = &capture->events[i];
+    if (e->type == PARSING_EVENT_BEGIN) {
+      sink->begin_node(sink->arg, e->tag, e->pos);
+    }
+    else {
+      sink->end_node(sink->arg, e->tag, e->start, e->pos);
+    }
   }
+  memmove(capture->events, capture->events + n,
+          sizeof(struct ParsingEvent) * (capture->size - boundary));
+  capture->base = boundary;
+}
 
-  PUSH_IP(context, inst);
-
-  goto *GET_ADDR(pc);
-
-  OP(EXIT) {
-    context->pos = cur - context->inputs;
-    return failflag;
+/*
+** Makes room for one more event when the buffer is full. Events below the
+** lowest position mark can only be dropped by the failure of the whole
+** parse, so they go to the sink if there is one. The buffer only grows
+** when less than half of it could be delivered.
+*/
+static int nez_ReserveEvent(struct ParsingCapture *capture) {
+  size_t capacity = capture->capacity * 2;
+  struct ParsingEvent *events;
+  if (capture->sink.end_node != NULL && capture->capacity > 0) {
+    size_t boundary = capture->position_marks > 0
+                          ? capture->marks[capture->lowest_position]
+                          : capture->size;
+    if (boundary - capture->base >= capture->capacity / 2) {
+      nez_FlushCapture(capture, boundary);
+      return NEZ_OK;
+    }
   }
-  OP(JUMP) {
-    NezVMInstruction *dst = pc->arg0.jump;
-    JUMP(dst);
-  }
-  OP(CALL) {
-    NezVMInstruction *dst = pc->arg0.jump;
-    PUSH_IP(context, pc + 1);
-    JUMP(dst);
+  if (capacity < PARSING_CAPTURE_BATCH) {
+    capacity = PARSING_CAPTURE_BATCH;
   }
-  OP(RET) {
-    RET;
-  }
-  OP(IFFAIL) {
-    NezVMInstruction *dst = pc->arg0.jump;
-    if (failflag) {
-      JUMP(dst);
-    } else {
-      DISPATCH_NEXT;
-    }
+  events = (struct ParsingEvent *)realloc(
+      capture->events, sizeof(struct ParsingEvent) * capacity);
+  if (events == NULL) {
+    return NEZ_MEMORY_ERROR;
   }
-  OP(IFSUCC) {
-    NezVMInstruction *dst = pc->arg0.jump;
-    if (failflag == 0) {
-      JUMP(dst);
-    } else {
-      DISPATCH_NEXT;
+  capture->events = events;
+  capture->capacity = capacity;
+  return NEZ_OK;
+}
+
+/* there is at most one mark per stack entry */
+static int nez_ReserveMarks(struct ParsingCapture *capture, size_t size) {
+  if (capture->mark_capacity < size) {
+    size_t *marks = (size_t *)realloc(capture->marks, sizeof(size_t) * size);
+    struct ParsingEvent *begins;
+    if (marks == NULL) {
+      return NEZ_MEMORY_ERROR;
+    }
+    capture->marks = marks;
+    begins = (struct ParsingEvent *)realloc(
+        capture->begins, sizeof(struct ParsingEvent) * size);
+    if (begins == NULL) {
+      return NEZ_MEMORY_ERROR;
     }
+    capture->begins = begins;
+    capture->mark_capacity = size;
   }
-  OP(CHAR) {
-    char ch = *cur++;
-    if (pc->arg0.c == ch) {
-      DISPATCH_NEXT;
-    } else {
-      --cur;
-      failflag = 1;
-      JUMP(pc->arg1.jump);
+  return NEZ_OK;
+}
+
+/* charges the instructions run since the last transition to the node */
+static inline void nez_ProfileCharge(struct ParsingProfile *profile) {
+  profile->nodes[profile->current].self += profile->steps - profile->mark;
+  profile->mark = profile->steps;
+}
+
+/* moves down the calling context tree to the callee, adding it if new */
+static int nez_ProfileEnter(struct ParsingProfile *profile, long entry) {
+  struct ProfileNode *nodes = profile->nodes;
+  long parent = profile->current;
+  long *link = &nodes[parent].child;
+  long n;
+  nez_ProfileCharge(profile);
+  for (n = *link; n >= 0; link = &nodes[n].sibling, n = *link) {
+    if (nodes[n].entry == entry) {
+      break;
     }
   }
-  OP(CHARMAP) {
-    if (bitset_get(pc->arg0.set, *cur++)) {
-      DISPATCH_NEXT;
-    } else {
-      --cur;
-      failflag = 1;
-      JUMP(pc->arg1.jump);
+  if (n < 0) {
+    if (profile->node_size == profile->node_capacity) {
+      long capacity = profile->node_capacity * 2;
+      nodes = (struct ProfileNode *)realloc(
+          nodes, sizeof(struct ProfileNode) * capacity);
+      if (nodes == NULL) {
+        return NEZ_MEMORY_ERROR;
+      }
+      profile->nodes = nodes;
+      profile->node_capacity = capacity;
     }
+    n = profile->node_size++;
+    memset(&nodes[n], 0, sizeof(struct ProfileNode));
+    nodes[n].entry = entry;
+    nodes[n].parent = parent;
+    nodes[n].child = -1;
+    nodes[n].sibling = nodes[parent].child;
+    nodes[parent].child = n;
+  }
+  else if (n != nodes[parent].child) {
+    *link = nodes[n].sibling;
+    nodes[n].sibling = nodes[parent].child;
+    nodes[parent].child = n;
+  }
+  nodes[n].calls++;
+  profile->current = n;
+  return NEZ_OK;
+}
+
+static inline void nez_ProfileLeave(struct ParsingProfile *profile,
+                                    int failflag) {
+  struct ProfileNode *node = &profile->nodes[profile->current];
+  nez_ProfileCharge(profile);
+  node->fails += failflag;
+  profile->current = node->parent;
+}
+
+#define NEZVM_EXEC_NAME nez_VM_ExecuteValidate
+#define NEZVM_EXEC_MODE NEZVM_MODE_VALIDATE
+#define NEZVM_EXEC_WIDE 0
+#include "nezvm_exec.h"
+#undef NEZVM_EXEC_NAME
+#undef NEZVM_EXEC_MODE
+#undef NEZVM_EXEC_WIDE
+
+#define NEZVM_EXEC_NAME nez_VM_ExecuteCapture
+#define NEZVM_EXEC_MODE NEZVM_MODE_CAPTURE
+#define NEZVM_EXEC_WIDE 0
+#include "nezvm_exec.h"
+#undef NEZVM_EXEC_NAME
+#undef NEZVM_EXEC_MODE
+#undef NEZVM_EXEC_WIDE
+
+#define NEZVM_EXEC_NAME nez_VM_ExecuteProfile
+#define NEZVM_EXEC_MODE NEZVM_MODE_PROFILE
+#define NEZVM_EXEC_WIDE 0
+#include "nezvm_exec.h"
+#undef NEZVM_EXEC_NAME
+#undef NEZVM_EXEC_MODE
+#undef NEZVM_EXEC_WIDE
+
+#define NEZVM_EXEC_NAME nez_VM_ExecuteTrace
+#define NEZVM_EXEC_MODE NEZVM_MODE_TRACE
+#define NEZVM_EXEC_WIDE 0
+#include "nezvm_exec.h"
+#undef NEZVM_EXEC_NAME
+#undef NEZVM_EXEC_MODE
+#undef NEZVM_EXEC_WIDE
+
+#define NEZVM_EXEC_NAME nez_VM_ExecuteValidateWide
+#define NEZVM_EXEC_MODE NEZVM_MODE_VALIDATE
+#define NEZVM_EXEC_WIDE 1
+#include "nezvm_exec.h"
+#undef NEZVM_EXEC_NAME
+#undef NEZVM_EXEC_MODE
+#undef NEZVM_EXEC_WIDE
+
+#define NEZVM_EXEC_NAME nez_VM_ExecuteCaptureWide
+#define NEZVM_EXEC_MODE NEZVM_MODE_CAPTURE
+#define NEZVM_EXEC_WIDE 1
+#include "nezvm_exec.h"
+#undef NEZVM_EXEC_NAME
+#undef NEZVM_EXEC_MODE
+#undef NEZVM_EXEC_WIDE
+
+#define NEZVM_EXEC_NAME nez_VM_ExecuteProfileWide
+#define NEZVM_EXEC_MODE NEZVM_MODE_PROFILE
+#define NEZVM_EXEC_WIDE 1
+#include "nezvm_exec.h"
+#undef NEZVM_EXEC_NAME
+#undef NEZVM_EXEC_MODE
+#undef NEZVM_EXEC_WIDE
+
+#define NEZVM_EXEC_NAME nez_VM_ExecuteTraceWide
+#define NEZVM_EXEC_MODE NEZVM_MODE_TRACE
+#define NEZVM_EXEC_WIDE 1
+#include "nezvm_exec.h"
+#undef NEZVM_EXEC_NAME
+#undef NEZVM_EXEC_MODE
+#undef NEZVM_EXEC_WIDE
+
+typedef long (*nezvm_execute_t)(ParsingContext, NezVMInstruction *);
+
+static const nezvm_execute_t nezvm_execute[NEZVM_MODE_SIZE] = {
+  nez_VM_ExecuteValidate, nez_VM_ExecuteCapture,
+  nez_VM_ExecuteProfile, nez_VM_ExecuteTrace,
+  nez_VM_ExecuteValidateWide, nez_VM_ExecuteCaptureWide,
+  nez_VM_ExecuteProfileWide, nez_VM_ExecuteTraceWide,
+};
+
+/* a validating parse with the stack layout the input needs */
+long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst) {
+  if (NEZVM_STACK_COMPACT(context)) {
+    return nez_VM_ExecuteValidate(context, inst);
+  }
+  return nez_VM_ExecuteValidateWide(
+      context, nez_VM_Mode(inst, NEZVM_MODE_VALIDATE + NEZVM_MODE_WIDE));
+}
+
+// void dump_pego(ParsingObject *pego, char *source, int level);
+
+void nez_PrintParsingError(ParsingContext context, long status) {
+  ParsingResult result;
+  char buf[1024];
+  nez_GetParsingResult(context, status, &result);
+  nez_FormatParsingError(&result, buf, sizeof(buf));
+  if (status == NEZ_PARSE_ERROR) {
+    fprintf(stderr, "parse error at %s\n", buf);
+  }
+  else {
+    fprintf(stderr, "%s\n", buf);
+  }
+}
+
+/* the mode follows from what the context collects and the input size */
+int nez_Parse(ParsingContext context, NezVMInstruction *inst) {
+  int mode = NEZVM_MODE_VALIDATE;
+  if (context->capture != NULL) {
+    mode = NEZVM_MODE_CAPTURE;
+  }
+  else if (context->profile != NULL) {
+    mode = NEZVM_MODE_PROFILE;
+  }
+  else if (context->trace != NULL) {
+    mode = NEZVM_MODE_TRACE;
+  }
+  if (!NEZVM_STACK_COMPACT(context)) {
+    mode += NEZVM_MODE_WIDE;
+  }
+  return (int)nezvm_execute[mode](context, nez_VM_Mode(inst, mode));
+}
+
+/* a capturing parse into sink that leaves the context as it was */
+int nez_ParseSink(ParsingContext context, NezVMInstruction *inst,
+                  const ParsingSink *sink) {
+  struct ParsingCapture *capture = context->capture;
+  ParsingSink saved;
+  int status;
+  if (capture != NULL) {
+    saved = capture->sink;
+  }
+  nez_SetParsingSink(context, sink);
+  status = nez_Parse(context, inst);
+  if (capture != NULL) {
+    nez_SetParsingSink(context, &saved);
   }
-  OP(STRING) {
-    int next;
-    if ((next = nezvm_string_equal(pc->arg0.str, cur)) > 0) {
-      cur += next;
-      DISPATCH_NEXT;
-    } else {
-      failflag = 1;
-      JUMP(pc->arg1.jump);
+  else {
+    nez_DisableCapture(context);
+  }
+  return status;
+}
+
+#define NEZVM_STAT 5
+int nez_ParseStat(ParsingContext context, NezVMInstruction *inst) {
+  for (int i = 0; i < NEZVM_STAT; i++) {
+    uint64_t start, end;
+    start = timer();
+    int status = (int)nez_VM_Execute(context, inst);
+    if (status != NEZ_OK) {
+      return status;
     }
+    end = timer();
+    fprintf(stderr, "ErapsedTime: %llu msec\n",
+            (unsigned long long)end - start);
+    context->pos = 0;
   }
-  OP(ANY) {
-    if (*cur++ != 0) {
-      DISPATCH_NEXT;
-    } else {
-      --cur;
-      failflag = 1;
-      JUMP(pc->arg0.jump);
+  fprintf(stderr, "stack_size=%zd[Byte], %zd entries\n",
+          sizeof(union StackEntry) * context->stack_size,
+          NEZVM_STACK_COMPACT(context)
+              ? NEZVM_STACK_LENGTH(context, uint32_t)
+              : NEZVM_STACK_LENGTH(context, union StackEntry));
+  return NEZ_OK;
+}
+
+static const char *nezvm_opcode_name[] = {
+#define DEFINE_NAME(NAME) #NAME,
+  NEZ_IR_EACH(DEFINE_NAME)
+#undef DEFINE_NAME
+};
+
+/* names of the rules by entry; NULL where no rule starts */
+const char **nez_RuleNames(const NezVMInstruction *inst, long length) {
+  nezvm_rules_ptr_t rules = inst[0].arg0.rules;
+  const char **names = (const char **)calloc(length, sizeof(const char *));
+  if (names != NULL && rules != NULL) {
+    for (int i = 0; i < rules->rule_size; i++) {
+      names[rules->rules[i].entry] = NEZVM_RULE_NAME(rules, i);
     }
   }
-  OP(PUSHpos) {
-    PUSH_SP(context, cur);
-    DISPATCH_NEXT;
+  return names;
+}
+
+/* the name, @entry for rules without one and (parse) for -1 */
+void nez_PrintRuleName(FILE *out, const char **names, long entry, int width) {
+  if (entry < 0) {
+    fprintf(out, "%-*s", width, "(parse)");
+  }
+  else if (names[entry] != NULL) {
+    fprintf(out, "%-*s", width, names[entry]);
   }
-  OP(POPpos) {
-    (void)POP_SP(context);
-    DISPATCH_NEXT;
+  else {
+    fprintf(out, "@%-*ld", width > 0 ? width - 1 : 0, entry);
   }
-  OP(GETpos) {
-    cur = (context->stack_pointer-1)->pos;
-    DISPATCH_NEXT;
+}
+
+typedef struct NezRuleProfile {
+  long entry;
+  uint64_t calls;
+  uint64_t fails;
+  uint64_t self;
+  uint64_t total;   /* inclusive, recursive calls counted once */
+} NezRuleProfile;
+
+typedef struct NezCallEdge {
+  long from;
+  long to;
+  long rank;        /* of the caller in the rule table printed */
+  uint64_t calls;
+  uint64_t fails;
+} NezCallEdge;
+
+static int nez_CompareRuleProfile(const void *a, const void *b) {
+  uint64_t x = ((const NezRuleProfile *)a)->total;
+  uint64_t y = ((const NezRuleProfile *)b)->total;
+  return x > y ? -1 : x < y;
+}
+
+static int nez_CompareCallEdge(const void *a, const void *b) {
+  const NezCallEdge *x = (const NezCallEdge *)a;
+  const NezCallEdge *y = (const NezCallEdge *)b;
+  if (x->from != y->from) {
+    return x->from < y->from ? -1 : 1;
   }
-  OP(STOREpos) {
-    cur = POP_SP(context)->pos;
-    DISPATCH_NEXT;
+  return x->to < y->to ? -1 : x->to > y->to;
+}
+
+static int nez_CompareCallRank(const void *a, const void *b) {
+  const NezCallEdge *x = (const NezCallEdge *)a;
+  const NezCallEdge *y = (const NezCallEdge *)b;
+  if (x->rank != y->rank) {
+    return x->rank < y->rank ? -1 : 1;
   }
-  OP(STOREflag) {
-    failflag = pc->arg0.val;
-    DISPATCH_NEXT;
+  return x->calls > y->calls ? -1 : x->calls < y->calls;
+}
+
+static double nez_Percent(uint64_t part, uint64_t whole) {
+  return whole > 0 ? 100.0 * part / whole : 0.0;
+}
+
+/*
+** Executions per opcode, then the rules by inclusive instructions with
+** their calls, share of failed calls and exclusive instructions, then the
+** rules each of them calls.
+*/
+void nez_PrintProfile(ParsingContext context, const NezVMInstruction *inst) {
+  struct ParsingProfile *profile = context->profile;
+  struct ProfileNode *nodes = profile->nodes;
+  long node_size = profile->node_size;
+  uint64_t ops[NEZVM_OP_SIZE] = {0};
+  uint64_t total = 0;
+  const char **names = nez_RuleNames(inst, profile->length);
+  uint64_t *inclusive = (uint64_t *)malloc(sizeof(uint64_t) * node_size);
+  NezRuleProfile *rules =
+      (NezRuleProfile *)calloc(profile->length, sizeof(NezRuleProfile));
+  NezCallEdge *edges = (NezCallEdge *)malloc(sizeof(NezCallEdge) * node_size);
+  long *rank = (long *)malloc(sizeof(long) * profile->length);
+  long rule_size = 0;
+  long edge_size = 0;
+  long i, n;
+  if (names == NULL || inclusive == NULL || rules == NULL || edges == NULL
+      || rank == NULL) {
+    nez_PrintErrorInfo("cannot allocate the profile");
   }
-  OP(NOTCHAR) {
-    if (*cur == pc->arg0.c) {
-      failflag = 1;
-      JUMP(pc->arg1.jump);
+  nez_ProfileCharge(profile);
+  for (i = 0; i < profile->length; i++) {
+    int opcode = nez_VM_Opcode(&inst[i]);
+    if (opcode != NEZVM_OP_ERROR) {
+      ops[opcode] += profile->hits[i];
+      total += profile->hits[i];
     }
-    DISPATCH_NEXT;
   }
-  OP(NOTCHARMAP) {
-    if (bitset_get(pc->arg0.set, *cur)) {
-      failflag = 1;
-      JUMP(pc->arg1.jump);
+  fprintf(stderr, "instructions=%llu\n", (unsigned long long)total);
+  for (i = 0; i < NEZVM_OP_SIZE; i++) {
+    if (ops[i] > 0) {
+      fprintf(stderr, "  %-16s %12llu %5.1f%%\n", nezvm_opcode_name[i],
+              (unsigned long long)ops[i], nez_Percent(ops[i], total));
     }
-    DISPATCH_NEXT;
   }
-  OP(NOTSTRING) {
-    if (nezvm_string_equal(pc->arg0.str, cur) > 0) {
-      failflag = 1;
-      JUMP(pc->arg1.jump);
+
+  /* children are always added after their parent */
+  for (n = 0; n < node_size; n++) {
+    inclusive[n] = nodes[n].self;
+  }
+  for (n = node_size - 1; n > 0; n--) {
+    inclusive[nodes[n].parent] += inclusive[n];
+  }
+  for (n = 1; n < node_size; n++) {
+    NezRuleProfile *r = &rules[nodes[n].entry];
+    long a = nodes[n].parent;
+    r->entry = nodes[n].entry;
+    r->calls += nodes[n].calls;
+    r->fails += nodes[n].fails;
+    r->self += nodes[n].self;
+    while (a > 0 && nodes[a].entry != nodes[n].entry) {
+      a = nodes[a].parent;
     }
-    DISPATCH_NEXT;
+    if (a == 0) {
+      r->total += inclusive[n];
+    }
+    edges[edge_size].from = nodes[nodes[n].parent].entry;
+    edges[edge_size].to = nodes[n].entry;
+    edges[edge_size].calls = nodes[n].calls;
+    edges[edge_size].fails = nodes[n].fails;
+    edge_size++;
   }
-  OP(NOTCHARANY) {
-    if (*cur++ == pc->arg0.c) {
-      --cur;
-      failflag = 1;
-      JUMP(pc->arg1.jump);
+  for (i = 0; i < profile->length; i++) {
+    if (rules[i].calls > 0) {
+      rules[rule_size++] = rules[i];
     }
-    DISPATCH_NEXT;
   }
-  OP(OPTIONALCHAR) {
-    if (*cur == pc->arg0.c) {
-      ++cur;
+  qsort(rules, rule_size, sizeof(NezRuleProfile), nez_CompareRuleProfile);
+  fprintf(stderr, "  %-24s %12s %6s %14s %6s %14s %6s\n", "rule", "calls",
+          "fail%", "self", "self%", "total", "total%");
+  for (i = 0; i < rule_size; i++) {
+    NezRuleProfile *r = &rules[i];
+    rank[r->entry] = i;
+    fprintf(stderr, "  ");
+    nez_PrintRuleName(stderr, names, r->entry, 24);
+    fprintf(stderr, " %12llu %6.1f %14llu %6.1f %14llu %6.1f\n",
+            (unsigned long long)r->calls, nez_Percent(r->fails, r->calls),
+            (unsigned long long)r->self, nez_Percent(r->self, inclusive[0]),
+            (unsigned long long)r->total,
+            nez_Percent(r->total, inclusive[0]));
+  }
+
+  /* the same caller and callee in different contexts make one edge */
+  qsort(edges, edge_size, sizeof(NezCallEdge), nez_CompareCallEdge);
+  for (i = 0, n = 0; i < edge_size; i++) {
+    if (n > 0 && edges[n - 1].from == edges[i].from
+        && edges[n - 1].to == edges[i].to) {
+      edges[n - 1].calls += edges[i].calls;
+      edges[n - 1].fails += edges[i].fails;
+    }
+    else {
+      edges[n++] = edges[i];
     }
-    DISPATCH_NEXT;
   }
-  OP(OPTIONALCHARMAP) {
-    if (bitset_get(pc->arg0.set, *cur)) {
-      ++cur;
+  edge_size = n;
+  for (i = 0; i < edge_size; i++) {
+    edges[i].rank = edges[i].from < 0 ? -1 : rank[edges[i].from];
+  }
+  qsort(edges, edge_size, sizeof(NezCallEdge), nez_CompareCallRank);
+  fprintf(stderr, "call graph:\n");
+  for (i = 0; i < edge_size; i++) {
+    if (i == 0 || edges[i].from != edges[i - 1].from) {
+      fprintf(stderr, "  ");
+      nez_PrintRuleName(stderr, names, edges[i].from, 0);
+      fprintf(stderr, "\n");
     }
-    DISPATCH_NEXT;
+    fprintf(stderr, "    -> ");
+    nez_PrintRuleName(stderr, names, edges[i].to, 21);
+    fprintf(stderr, " %12llu %6.1f\n", (unsigned long long)edges[i].calls,
+            nez_Percent(edges[i].fails, edges[i].calls));
+  }
+  free(names);
+  free(inclusive);
+  free(rules);
+  free(edges);
+  free(rank);
+}
+
+/*
+** One line per stack of rules that executed instructions itself, with the
+** rules from the start rule down separated by semicolons and followed by
+** the count: the folded format flamegraph.pl reads.
+*/
+void nez_PrintFoldedProfile(ParsingContext context, const NezVMInstruction *inst,
+                            FILE *out) {
+  struct ParsingProfile *profile = context->profile;
+  struct ProfileNode *nodes = profile->nodes;
+  const char **names = nez_RuleNames(inst, profile->length);
+  long *path = (long *)malloc(sizeof(long) * profile->node_size);
+  if (names == NULL || path == NULL) {
+    nez_PrintErrorInfo("cannot allocate the profile");
   }
-  OP(OPTIONALSTRING) {
-    cur += nezvm_string_equal(pc->arg0.str, cur);
-    DISPATCH_NEXT;
+  nez_ProfileCharge(profile);
+  for (long n = 1; n < profile->node_size; n++) {
+    long depth = 0;
+    if (nodes[n].self == 0) {
+      continue;
+    }
+    for (long a = n; a > 0; a = nodes[a].parent) {
+      path[depth++] = a;
+    }
+    while (depth-- > 0) {
+      nez_PrintRuleName(out, names, nodes[path[depth]].entry, 0);
+      fputc(depth > 0 ? ';' : ' ', out);
+    }
+    fprintf(out, "%llu\n", (unsigned long long)nodes[n].self);
   }
-  OP(ZEROMORECHARMAP) {
-  L_head:
-    ;
-    if (bitset_get(pc->arg0.set, *cur)) {
-      cur++;
-      goto L_head;
+  free(names);
+  free(path);
+}
+
+/* prepared instructions only keep the handler address */
+int nez_VM_Opcode(const NezVMInstruction *pc) {
+  const void **table = (const void **)nez_VM_ExecuteValidate(NULL, NULL);
+  for (int i = 0; i < NEZVM_OP_SIZE; i++) {
+    if (table[i] == pc->addr) {
+      return i;
     }
-    DISPATCH_NEXT;
   }
-  return -1;
+  return NEZVM_OP_ERROR;
 }
 
-// void dump_pego(ParsingObject *pego, char *source, int level);
+/*
+** The wide copies are made from the compact ones when the first input
+** that needs them comes, since few programs ever see one. Prepared
+** instructions only keep the handler address, so opcodes are found back
+** in the table of the compact interpreter.
+*/
+static pthread_mutex_t nezvm_wide_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void nez_Parse(ParsingContext context, NezVMInstruction *inst) {
-  if (nez_VM_Execute(context, inst)) {
-    nez_PrintErrorInfo("parse error");
+static void nez_VM_Widen(nezvm_program_ptr_t program) {
+  long length = program->length;
+  NezVMInstruction *copies = (NezVMInstruction *)malloc(
+      sizeof(NezVMInstruction) * length * NEZVM_MODE_WIDE);
+  if (copies == NULL) {
+    nez_PrintErrorInfo("cannot allocate instructions");
+  }
+  for (int mode = 0; mode < NEZVM_MODE_WIDE; mode++) {
+    const NezVMInstruction *base = program->modes[mode];
+    const void **from = (const void **)nezvm_execute[mode](NULL, NULL);
+    const void **to =
+        (const void **)nezvm_execute[mode + NEZVM_MODE_WIDE](NULL, NULL);
+    NezVMInstruction *code = copies + length * mode;
+    for (long i = 0; i < length; i++) {
+      NezVMInstruction **jump;
+      int op = 0;
+      while (op < NEZVM_OP_SIZE - 1 && from[op] != base[i].addr) {
+        op++;
+      }
+      code[i] = base[i];
+      code[i].opcode = op;
+      if ((jump = nez_JumpOperand(&code[i])) != NULL) {
+        *jump = code + (*jump - base);
+      }
+      code[i].addr = to[op];
+    }
+    program->modes[mode + NEZVM_MODE_WIDE] = code;
   }
 }
 
-#define NEZVM_STAT 5
-void nez_ParseStat(ParsingContext context, NezVMInstruction *inst) {
-  for (int i = 0; i < NEZVM_STAT; i++) {
-    uint64_t start, end;
-    start = timer();
-    if (nez_VM_Execute(context, inst)) {
-      nez_PrintErrorInfo("parse error");
+NezVMInstruction *nez_VM_Mode(const NezVMInstruction *inst, int mode) {
+  nezvm_program_ptr_t program = inst[0].arg1.program;
+  if (mode >= NEZVM_MODE_WIDE) {
+    pthread_mutex_lock(&nezvm_wide_lock);
+    if (program->modes[mode] == NULL) {
+      nez_VM_Widen(program);
     }
-    end = timer();
-    fprintf(stderr, "ErapsedTime: %llu msec\n",
-            (unsigned long long)end - start);
-    context->pos = 0;
+    pthread_mutex_unlock(&nezvm_wide_lock);
   }
-  fprintf(stderr, "stack_size=%zd[Byte]\n", sizeof(union StackEntry) * context->stack_size);
+  return program->modes[mode];
 }
 
+/*
+** Handler addresses belong to one interpreter, so every mode but the
+** validating one runs a copy of the program with its own addresses and
+** jumps. Operand blocks are shared by the copies.
+*/
 NezVMInstruction *nez_VM_Prepare(ParsingContext context,
                                         NezVMInstruction *inst) {
+  const void **tables[NEZVM_MODE_WIDE];
+  long length = context->bytecode_length;
+  nezvm_program_ptr_t program;
+  NezVMInstruction *copies;
   long i;
-  const void **table = (const void **)nez_VM_Execute(context, NULL);
-  NezVMInstruction *ip = inst;
-  for (i = 0; i < context->bytecode_length; i++) {
-    NezVMInstruction *pc = (NezVMInstruction *)ip;
-    pc->addr = (const void *)table[pc->opcode];
-    ++ip;
+  for (int mode = 0; mode < NEZVM_MODE_WIDE; mode++) {
+    tables[mode] = (const void **)nezvm_execute[mode](context, NULL);
   }
+  program = (nezvm_program_ptr_t)calloc(1, sizeof(*program));
+  copies = (NezVMInstruction *)malloc(sizeof(NezVMInstruction) * length
+                                      * (NEZVM_MODE_WIDE - 1));
+  if (program == NULL || copies == NULL) {
+    nez_PrintErrorInfo("cannot allocate instructions");
+  }
+  program->length = length;
+  program->modes[NEZVM_MODE_VALIDATE] = inst;
+  for (int mode = 1; mode < NEZVM_MODE_WIDE; mode++) {
+    NezVMInstruction *code = copies + length * (mode - 1);
+    program->modes[mode] = code;
+    for (i = 0; i < length; i++) {
+      NezVMInstruction **jump;
+      code[i] = inst[i];
+      if ((jump = nez_JumpOperand(&code[i])) != NULL) {
+        *jump = code + (*jump - inst);
+      }
+      if (mode == NEZVM_MODE_CAPTURE && inst[i].opcode == NEZVM_OP_CALL) {
+        /* the tag of the node a call creates */
+        code[i].arg1.val = nez_RuleIndex(inst, inst[i].arg0.jump - inst);
+      }
+      code[i].addr = (const void *)tables[mode][inst[i].opcode];
+    }
+    code[0].arg1.program = program;
+  }
+  for (i = 0; i < length; i++) {
+    inst[i].addr = (const void *)tables[NEZVM_MODE_VALIDATE][inst[i].opcode];
+  }
+  inst[0].arg1.program = program;
   return inst;
 }
+
+/* frees the mode copies; returns the image the program was mapped from */
+struct nezvm_image *nez_VM_Release(NezVMInstruction *inst) {
+  nezvm_program_ptr_t program = inst[0].arg1.program;
+  struct nezvm_image *image;
+  if (program == NULL) {
+    return NULL;
+  }
+  image = program->image;
+  free(program->modes[1]);
+  free(program->modes[NEZVM_MODE_WIDE]);
+  free(program);
+  return image;
+}
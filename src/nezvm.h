@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdio.h>
 #include "bitset.c"
 
 #ifndef NEZVM_H
@@ -14,6 +15,10 @@ typedef struct nezvm_string {
   char text[1];
 } *nezvm_string_ptr_t;
 
+/*
+** Opcodes after ZEROMORECHARMAP are never found in bytecode files; the
+** loader synthesizes them from sequences of the ones above.
+*/
 #define NEZ_IR_MAX 30
 #define NEZ_IR_EACH(OP)\
 	OP(EXIT)\
@@ -38,13 +43,96 @@ typedef struct nezvm_string {
 	OP(OPTIONALCHAR)\
 	OP(OPTIONALCHARMAP)\
 	OP(OPTIONALSTRING)\
-	OP(ZEROMORECHARMAP)
+	OP(ZEROMORECHARMAP)\
+	OP(STRINGTRIE)\
+	OP(SCANSTRING)
+
+/*
+** A trie built from the literals of an ordered choice. The block is
+** position independent: nodes, child indices, alternatives and edge labels
+** follow the header, and continuations are relative to the instruction.
+*/
+typedef struct nezvm_trie_node {
+  int edge;       /* first outgoing edge */
+  short edge_size;
+  short accept;   /* alternative ending at this node, or -1 */
+  int min;        /* smallest alternative in this subtree */
+} nezvm_trie_node_t;
+
+typedef struct nezvm_trie_alt {
+  int jump;       /* continuation of the alternative */
+  int len;        /* length of the literal */
+  int flag;       /* failflag on entry to the continuation, or -1 */
+} nezvm_trie_alt_t;
+
+typedef struct nezvm_trie {
+  unsigned size;
+  int node_size;
+  int edge_size;
+  int alt_size;
+  nezvm_trie_node_t nodes[1];
+} *nezvm_trie_ptr_t;
+
+#define NEZVM_TRIE_CHILD(T) ((int *)&(T)->nodes[(T)->node_size])
+#define NEZVM_TRIE_ALT(T) \
+  ((nezvm_trie_alt_t *)&NEZVM_TRIE_CHILD(T)[(T)->edge_size])
+#define NEZVM_TRIE_LABEL(T) \
+  ((unsigned char *)&NEZVM_TRIE_ALT(T)[(T)->alt_size])
+
+/* choices with fewer literal alternatives are left as STRING chains */
+#define NEZVM_TRIE_MIN_ALTERNATIVES 3
+
+/*
+** A set of literals searched for by SCANSTRING. Small sets are found with
+** a two-byte SIMD prefilter; larger ones with an Aho-Corasick automaton
+** whose tables follow the literal offsets when state_size is not zero.
+*/
+typedef struct nezvm_scan {
+  unsigned size;
+  int eof_jump;   /* where to go when no literal is found */
+  int literal_size;
+  int max_len;
+  int state_size;
+  bitset_t first;
+  int offset[1];  /* literal_size + 1 offsets into the text block */
+} *nezvm_scan_ptr_t;
+
+#define NEZVM_SCAN_SIMD_MAX 8
+#define NEZVM_SCAN_MAX_STATES 65535
+
+nezvm_scan_ptr_t nez_CreateScanner(const char **text, const int *len, int size);
+const char *nez_Scan(nezvm_scan_ptr_t scan, const char *cur, const char *end,
+                     const char *limit, int *found);
+int nez_ScanLiteral(nezvm_scan_ptr_t scan, int index, const char **text);
+
+/*
+** Rule symbol table kept in the operand of the EXIT instruction at index
+** 0. Names are NUL terminated and follow the rules; like the other operand
+** blocks it is position independent.
+*/
+typedef struct nezvm_rule {
+  int entry;  /* index of the first instruction */
+  int name;   /* offset in the name block */
+} nezvm_rule_t;
+
+typedef struct nezvm_rules {
+  unsigned size;
+  int rule_size;
+  nezvm_rule_t rules[1];
+} *nezvm_rules_ptr_t;
+
+#define NEZVM_RULE_NAME(R, I) \
+  ((const char *)&(R)->rules[(R)->rule_size] + (R)->rules[I].name)
 
 typedef union value_t {
 	char c;
 	int val;
 	nezvm_string_ptr_t str;
 	bitset_ptr_t set;
+	nezvm_trie_ptr_t trie;
+	nezvm_scan_ptr_t scan;
+	nezvm_rules_ptr_t rules;
+	struct nezvm_program *program;
 	struct NezVMInstruction *jump;
 } value_t;
 
@@ -61,17 +149,207 @@ enum nezvm_opcode {
 #define DEFINE_ENUM(NAME) NEZVM_OP_##NAME,
   NEZ_IR_EACH(DEFINE_ENUM)
 #undef DEFINE_ENUM
+  NEZVM_OP_SIZE,
   NEZVM_OP_ERROR = -1
 };
 
 void nez_PrintErrorInfo(const char *errmsg);
 
+/*
+** Interpreters specialized at compile time from the same handlers. The
+** validating one only recognizes the input; the capturing one records the
+** events of the context's ParsingCapture, the profiling one counts into
+** its ParsingProfile and the tracing one fills its ParsingTrace.
+** nez_Parse() picks the mode from what the context collects, in that
+** order. Rules inlined at load time are not calls any
+** more and do not form nodes; a budget of 0 keeps them all.
+*/
+#define NEZVM_MODE_VALIDATE 0
+#define NEZVM_MODE_CAPTURE 1
+#define NEZVM_MODE_PROFILE 2
+#define NEZVM_MODE_TRACE 3
+
+/*
+** Each mode is compiled twice more for the layout of the VM stack. While
+** the input and the program fit in 32 bits, entries are 32-bit offsets:
+** positions from the input, and return addresses as complemented byte
+** offsets from the program, so that the two never meet. Larger inputs
+** take the copy of the mode with NEZVM_MODE_WIDE added, which keeps
+** pointers. Both layouts share the stack of stack_size pointer-sized
+** entries, so the compact one holds twice as many and a grammar may nest
+** twice as deep on inputs below 4 GB. The wide copies of a program,
+** another NEZVM_MODE_WIDE times its size, are only made for the first
+** input that needs them.
+*/
+#define NEZVM_MODE_WIDE 4
+#define NEZVM_MODE_SIZE 8
+#define NEZVM_STACK_COMPACT(ctx) \
+  ((uint64_t)(ctx)->input_size \
+   + (uint64_t)(ctx)->bytecode_length * sizeof(NezVMInstruction) < UINT32_MAX)
+/* entries of TYPE the stack of ctx has room for */
+#define NEZVM_STACK_LENGTH(ctx, TYPE) \
+  ((ctx)->stack_size * (sizeof(union StackEntry) / sizeof(TYPE)))
+
+/*
+** Kept in the second operand of the EXIT instruction at index 0 by
+** nez_VM_Prepare(): the copy of the program each mode runs (the first is
+** the program itself; the wide ones are NULL until nez_VM_Mode() makes
+** them) and the image it was mapped from, if any.
+*/
+typedef struct nezvm_program {
+  struct nezvm_image *image;
+  long length;
+  NezVMInstruction *modes[NEZVM_MODE_SIZE];
+} *nezvm_program_ptr_t;
+
+NezVMInstruction *nez_VM_Mode(const NezVMInstruction *inst, int mode);
+struct nezvm_image *nez_VM_Release(NezVMInstruction *inst);
+
+/*
+** Rules whose body is at most NEZVM_INLINE_BUDGET instructions are copied
+** into their call sites at load time. The total number of instructions
+** added is capped at NEZVM_INLINE_MAX_GROWTH percent of the program.
+*/
+#define NEZVM_INLINE_BUDGET 8
+#define NEZVM_INLINE_MAX_GROWTH 50
+void nez_SetInlineBudget(int budget);
+
+/*
+** Loads a bytecode file and makes nonTerminalName (the first rule when
+** NULL) the start rule of context. Returns NULL when the file cannot be
+** read or the rule is not in its rule table; files without a rule table
+** always start at the first rule.
+*/
 NezVMInstruction *nez_LoadMachineCode(ParsingContext context,
                                       const char *fileName,
                                       const char *nonTerminalName);
 void nez_DisposeInstruction(NezVMInstruction *inst, long length);
+NezVMInstruction **nez_JumpOperand(NezVMInstruction *ir);
+
+/*
+** Cache of prepared programs shared between processes. An image of each
+** program is kept in dir (/dev/shm for instance) under a hash of its
+** bytecode and the loader settings; later loads of the same bytecode map
+** the image read-only instead of decoding and optimizing it again. The
+** image of a mapped program is recorded in its nezvm_program. NULL, the
+** default, disables the cache.
+*/
+void nez_SetCodeCache(const char *dir);
+uint64_t nez_CodeCacheKey(const char *buf, size_t len, int inline_budget);
+void nez_StoreCachedCode(ParsingContext context, NezVMInstruction *inst,
+                         uint64_t key);
+NezVMInstruction *nez_MapCachedCode(ParsingContext context, uint64_t key);
+void nez_UnmapCachedCode(struct nezvm_image *image);
+
+/*
+** The start rule is a property of the context, so one loaded program can
+** serve contexts (or successive parses) that start at different rules.
+*/
+long nez_FindRule(const NezVMInstruction *inst, const char *name);
+const char *nez_RuleName(const NezVMInstruction *inst, int index);
+int nez_RuleIndex(const NezVMInstruction *inst, long entry);
+const char **nez_RuleNames(const NezVMInstruction *inst, long length);
+void nez_PrintRuleName(FILE *out, const char **names, long entry, int width);
+int nez_SetStartRule(ParsingContext context, const NezVMInstruction *inst,
+                     const char *name);
+
+/*
+** Outcome of a parse; status is one of enum nez_status. When it is
+** NEZ_PARSE_ERROR, error_pos is the farthest position
+** where a terminal failed and expected holds the CHAR, CHARMAP, STRING,
+** ANY, STRINGTRIE and SCANSTRING instructions that failed there. Line and
+** column are 1-origin and only computed for parse errors.
+*/
+typedef struct ParsingExpected {
+  int opcode;
+  value_t operand;
+} ParsingExpected;
+
+typedef struct ParsingResult {
+  int status;
+  long pos;
+  long error_pos;
+  long line;
+  long column;
+  int expected_size;
+  ParsingExpected expected[PARSING_CONTEXT_MAX_EXPECTED];
+} ParsingResult;
+
+int nez_VM_Opcode(const NezVMInstruction *pc);
+void nez_GetParsingResult(ParsingContext context, long status,
+                          ParsingResult *result);
+size_t nez_FormatParsingError(const ParsingResult *result, char *buf,
+                              size_t size);
+void nez_PrintParsingError(ParsingContext context, long status);
+
+int nez_Parse(ParsingContext context, NezVMInstruction *inst);
+int nez_ParseSink(ParsingContext context, NezVMInstruction *inst,
+                  const ParsingSink *sink);
+int nez_ParseStat(ParsingContext context, NezVMInstruction *inst);
+void nez_PrintProfile(ParsingContext context, const NezVMInstruction *inst);
+void nez_PrintFoldedProfile(ParsingContext context, const NezVMInstruction *inst,
+                            FILE *out);
+
+/*
+** Parses a record-oriented input on several threads, cutting it at the
+** delimiter nearest to each cut point. Chunks are never smaller than
+** NEZVM_PARALLEL_MIN_CHUNK bytes.
+*/
+#define NEZVM_PARALLEL_MIN_CHUNK (1 << 16)
+int nez_ParseParallel(ParsingContext context, NezVMInstruction *inst,
+                      int threads, char delim);
+
+/*
+** Batch mode for inputs made of independent records such as NDJSON: the
+** start rule is applied to each delimited record in place, reusing one
+** context, and must consume the whole record. The callback sees every
+** record with the context still pointing at it, so nez_GetParsingResult()
+** reports positions within the record; returning non-zero stops the batch.
+** Without NEZVM_RECORD_RESYNC the batch also stops at the first rejected
+** record.
+*/
+typedef struct ParsingRecord {
+  long index;      /* 0-origin */
+  size_t start;    /* offset in the whole input */
+  size_t length;   /* without the delimiter */
+  int status;
+  size_t error_pos; /* farthest failure, offset in the whole input */
+} ParsingRecord;
+
+typedef int (*ParsingRecordFunc)(ParsingContext context,
+                                 const ParsingRecord *record, void *arg);
+
+#define NEZVM_RECORD_RESYNC 1
+int nez_ParseRecords(ParsingContext context, NezVMInstruction *inst,
+                     char delim, int flags, ParsingRecordFunc func, void *arg);
+
+/*
+** Batch mode over many files: while `threads` workers parse the files
+** already loaded, each with a copy of context, the next ones are read
+** ahead through io_uring, or reader threads where it is not available (or
+** NEZVM_INPUT_NO_URING is given). At most `budget` bytes of input are
+** loaded or being read at a time; a larger file is read on its own. When
+** the context memoizes, every worker gets a memo table of the same size.
+** The callback sees the files one at a time in the order they are parsed,
+** with the worker's context still pointing at the input; returning
+** non-zero stops the batch.
+*/
+typedef struct ParsingFile {
+  long index;
+  const char *path;
+  size_t length;
+  int status;      /* NEZ_IO_ERROR when the file could not be read */
+} ParsingFile;
+
+typedef int (*ParsingFileFunc)(ParsingContext context, const ParsingFile *file,
+                               void *arg);
 
-void nez_Parse(ParsingContext context, NezVMInstruction *inst);
-void nez_ParseStat(ParsingContext context, NezVMInstruction *inst);
+#define NEZVM_INPUT_BUDGET ((size_t)64 << 20)
+#define NEZVM_INPUT_QUEUE_DEPTH 32
+#define NEZVM_INPUT_READERS 4
+#define NEZVM_INPUT_NO_URING 1
+int nez_ParseFiles(ParsingContext context, NezVMInstruction *inst,
+                   const char **paths, long size, int threads, size_t budget,
+                   int flags, ParsingFileFunc func, void *arg);
 
 #endif
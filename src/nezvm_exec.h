@@ -0,0 +1,478 @@
+/*
+** Body of the interpreter. nezvm.c includes it once per mode and stack
+** layout with NEZVM_EXEC_NAME, NEZVM_EXEC_MODE and NEZVM_EXEC_WIDE
+** defined, so every mode is compiled from the same handlers. The hooks of
+** the other modes expand to nothing, and the validating instance pays
+** nothing for them.
+*/
+#if NEZVM_EXEC_WIDE
+#define STACK_ENTRY union StackEntry
+#define STACK_BASE(ctx) ((ctx)->stack_pointer_base)
+#define STACK_TOP(ctx) ((ctx)->stack_pointer)
+#define STACK_IP(INST) ((union StackEntry){.func = (INST)})
+#define STACK_POS(POS) ((union StackEntry){.pos = (POS)})
+#define STACK_TO_IP(E) ((E).func)
+#define STACK_TO_POS(E) ((E).pos)
+#else
+#define STACK_ENTRY uint32_t
+#define STACK_BASE(ctx) ((uint32_t *)(ctx)->stack_pointer_base)
+#define STACK_TOP(ctx) ((ctx)->stack_pointer32)
+#define STACK_IP(INST) (~(uint32_t)((const char *)(INST) - (const char *)inst))
+#define STACK_POS(POS) ((uint32_t)((POS) - context->inputs))
+#define STACK_TO_IP(E) \
+  ((const NezVMInstruction *)((const char *)inst + (uint32_t)~(E)))
+#define STACK_TO_POS(E) (context->inputs + (E))
+#endif
+
+/* copies of the program report failures by the offsets of the program */
+#define NEZVM_EXEC_COPY \
+  (NEZVM_EXEC_MODE != NEZVM_MODE_VALIDATE || NEZVM_EXEC_WIDE)
+#if NEZVM_EXEC_COPY
+#define EXPECT() EXPECT_AT(context, origin + (pc - inst), cur)
+#else
+#define EXPECT() EXPECT_AT(context, pc, cur)
+#endif
+
+#if NEZVM_EXEC_MODE == NEZVM_MODE_CAPTURE
+/* memoized results skip rule bodies and the events they would record */
+#define NEZVM_EXEC_MEMO 0
+#define HIT(OPCODE)
+#define COUNT_CALL(ENTRY)
+#define COUNT_RET()
+#define CAPTURE_EVENT(TYPE, TAG, POS, START) do { \
+    struct ParsingEvent *event; \
+    if (capture->size - capture->base == capture->capacity \
+        && nez_ReserveEvent(capture) != NEZ_OK) goto L_memory_error; \
+    event = &capture->events[capture->size++ - capture->base]; \
+    event->type = (TYPE); \
+    event->tag = (TAG); \
+    event->pos = (POS); \
+    event->start = (START); \
+  } while (0)
+/* marks mirror the VM stack: one per pushed position or call */
+#define CAPTURE_MARK() (capture->marks[capture->mark_size++] = capture->size)
+#define CAPTURE_MARK_POS() do { \
+    if (capture->position_marks++ == 0) { \
+      capture->lowest_position = capture->mark_size; \
+    } \
+    CAPTURE_MARK(); \
+  } while (0)
+#define CAPTURE_DROP() (--capture->position_marks, --capture->mark_size)
+#define CAPTURE_ROLLBACK() (--capture->position_marks, \
+    capture->size = capture->marks[--capture->mark_size])
+#define CAPTURE_PEEK() (capture->size = capture->marks[capture->mark_size - 1])
+#define CAPTURE_BEGIN(TAG) do { \
+    struct ParsingEvent *begin = &capture->begins[capture->mark_size]; \
+    begin->type = PARSING_EVENT_BEGIN; \
+    begin->tag = (TAG); \
+    begin->pos = begin->start = cur - context->inputs; \
+    CAPTURE_MARK(); \
+    CAPTURE_EVENT(PARSING_EVENT_BEGIN, begin->tag, begin->pos, begin->pos); \
+  } while (0)
+/* the BEGIN of an open call may have gone to the sink already */
+#define CAPTURE_END() do { \
+    size_t mark; \
+    CHECK_POP(context); \
+    mark = capture->marks[--capture->mark_size]; \
+    if (failflag) { \
+      capture->size = mark < capture->base ? capture->base : mark; \
+    } else { \
+      const struct ParsingEvent *begin = &capture->begins[capture->mark_size]; \
+      CAPTURE_EVENT(PARSING_EVENT_END, begin->tag, cur - context->inputs, \
+                    begin->pos); \
+    } \
+  } while (0)
+#define CAPTURE_EXIT() do { \
+    if (failflag) { \
+      capture->size = capture->base; \
+    } else if (capture->sink.end_node != NULL) { \
+      nez_FlushCapture(capture, capture->size); \
+    } \
+  } while (0)
+#elif NEZVM_EXEC_MODE == NEZVM_MODE_PROFILE
+#define NEZVM_EXEC_MEMO 1
+#define HIT(OPCODE) (profile->hits[pc - inst]++, profile->steps++)
+#define COUNT_CALL(ENTRY) do { \
+    profile->calls[ENTRY]++; \
+    if (nez_ProfileEnter(profile, ENTRY) != NEZ_OK) goto L_memory_error; \
+  } while (0)
+#define COUNT_RET() nez_ProfileLeave(profile, failflag)
+#elif NEZVM_EXEC_MODE == NEZVM_MODE_TRACE
+#define NEZVM_EXEC_MEMO 1
+#define HIT(OPCODE) do { \
+    struct ParsingTraceEntry *t = &trace->entries[trace->count & trace->mask]; \
+    t->pc = (int32_t)(pc - inst); \
+    t->opcode = (OPCODE); \
+    t->failflag = failflag; \
+    t->pos = cur - context->inputs; \
+    if ((++trace->count & (PARSING_TRACE_CHECK - 1)) == 0) { \
+      nez_CheckTrace(context); \
+    } \
+  } while (0)
+#define COUNT_CALL(ENTRY)
+#define COUNT_RET()
+#else
+#define NEZVM_EXEC_MEMO 1
+#define HIT(OPCODE)
+#define COUNT_CALL(ENTRY)
+#define COUNT_RET()
+#endif
+
+#if NEZVM_EXEC_MODE != NEZVM_MODE_CAPTURE
+#define CAPTURE_MARK()
+#define CAPTURE_MARK_POS()
+#define CAPTURE_DROP()
+#define CAPTURE_ROLLBACK()
+#define CAPTURE_PEEK()
+#define CAPTURE_BEGIN(TAG)
+#define CAPTURE_END()
+#define CAPTURE_EXIT()
+#endif
+
+#define OP(OP) NEZVM_OP_##OP: HIT(NEZVM_OP_##OP);
+
+long NEZVM_EXEC_NAME(ParsingContext context, NezVMInstruction *inst) {
+  static const void *table[] = {
+#define DEFINE_TABLE(NAME) &&NEZVM_OP_##NAME,
+    NEZ_IR_EACH(DEFINE_TABLE)
+#undef DEFINE_TABLE
+  };
+
+  register const char *cur;
+  register int failflag = 0;
+  register const NezVMInstruction *pc;
+  register const char *far;
+  register const char *end;
+  const STACK_ENTRY *stack_end;
+#if NEZVM_EXEC_COPY
+  /* expected instructions are reported from the validating copy */
+  const NezVMInstruction *origin;
+#endif
+#if NEZVM_EXEC_MODE == NEZVM_MODE_CAPTURE
+  struct ParsingCapture *capture;
+  int root_tag;
+#elif NEZVM_EXEC_MODE == NEZVM_MODE_PROFILE
+  struct ParsingProfile *profile;
+#elif NEZVM_EXEC_MODE == NEZVM_MODE_TRACE
+  struct ParsingTrace *trace;
+#endif
+
+  if (inst == NULL) {
+    return (long)table;
+  }
+  pc = inst + context->startPoint;
+  cur = far = context->inputs + context->pos;
+  end = context->inputs + context->input_size;
+#if NEZVM_EXEC_COPY
+  origin = inst[0].arg1.program->modes[NEZVM_MODE_VALIDATE];
+#endif
+#if NEZVM_EXEC_MODE == NEZVM_MODE_CAPTURE
+  capture = context->capture;
+  capture->base = capture->size = 0;
+  capture->mark_size = 0;
+  capture->position_marks = 0;
+  root_tag = nez_RuleIndex(origin, context->startPoint);
+  if (nez_ReserveMarks(capture, NEZVM_STACK_LENGTH(context, STACK_ENTRY))
+      != NEZ_OK) {
+    return NEZ_MEMORY_ERROR;
+  }
+#elif NEZVM_EXEC_MODE == NEZVM_MODE_PROFILE
+  profile = context->profile;
+  /* a parse that stopped on an error may have left a rule open */
+  nez_ProfileCharge(profile);
+  profile->current = 0;
+#elif NEZVM_EXEC_MODE == NEZVM_MODE_TRACE
+  trace = context->trace;
+  nez_StartTrace(context, inst);
+#endif
+
+  /* a parse that stopped on an error may have left entries behind */
+  STACK_TOP(context) = STACK_BASE(context);
+  context->memo_frame = context->memo_frame_base;
+  stack_end =
+      STACK_BASE(context) + NEZVM_STACK_LENGTH(context, STACK_ENTRY) - 1;
+  context->expected_at = cur;
+  context->expected_size = 0;
+  PUSH_IP(context, inst);
+  CAPTURE_BEGIN(root_tag);
+  COUNT_CALL(context->startPoint);
+  if (NEZVM_EXEC_MEMO && context->memo != NULL) {
+    struct MemoEntry *e =
+        nez_MemoLookup(context->memo, pc - inst, cur - context->inputs);
+    if (e != NULL) {
+      far = cur + e->reach;
+      cur += e->len;
+      failflag = e->fail;
+      COUNT_RET();
+      RET;
+    }
+    MEMO_PUSH(context, pc, cur, far);
+  }
+
+  goto *GET_ADDR(pc);
+
+  OP(EXIT) {
+    CAPTURE_EXIT();
+    context->pos = cur - context->inputs;
+    context->farthest = far - context->inputs;
+    context->error_pos = context->expected_at - context->inputs;
+    return failflag;
+  }
+  OP(JUMP) {
+    NezVMInstruction *dst = pc->arg0.jump;
+    JUMP(dst);
+  }
+  OP(CALL) {
+    NezVMInstruction *dst = pc->arg0.jump;
+    if (NEZVM_EXEC_MEMO && context->memo != NULL) {
+      struct MemoEntry *e =
+          nez_MemoLookup(context->memo, dst - inst, cur - context->inputs);
+      if (e != NULL) {
+        REACH(cur + e->reach);
+        cur += e->len;
+        failflag = e->fail;
+        DISPATCH_NEXT;
+      }
+      MEMO_PUSH(context, dst, cur, far);
+      far = cur;
+    }
+    PUSH_IP(context, pc + 1);
+    CAPTURE_BEGIN(pc->arg1.val);
+    COUNT_CALL(dst - inst);
+    JUMP(dst);
+  }
+  OP(RET) {
+    if (NEZVM_EXEC_MEMO && context->memo != NULL) {
+      struct MemoFrame *frame = --context->memo_frame;
+      REACH(cur);
+      nez_MemoStore(context->memo, frame->rule - inst,
+                    frame->pos - context->inputs, cur - frame->pos,
+                    far - frame->pos, failflag);
+      REACH(frame->far);
+    }
+    CAPTURE_END();
+    COUNT_RET();
+    RET;
+  }
+  OP(IFFAIL) {
+    NezVMInstruction *dst = pc->arg0.jump;
+    if (failflag) {
+      JUMP(dst);
+    } else {
+      DISPATCH_NEXT;
+    }
+  }
+  OP(IFSUCC) {
+    NezVMInstruction *dst = pc->arg0.jump;
+    if (failflag == 0) {
+      JUMP(dst);
+    } else {
+      DISPATCH_NEXT;
+    }
+  }
+  OP(CHAR) {
+    if (cur < end && *cur == pc->arg0.c) {
+      cur++;
+      DISPATCH_NEXT;
+    } else {
+      REACH(cur);
+      EXPECT();
+      failflag = 1;
+      JUMP(pc->arg1.jump);
+    }
+  }
+  OP(CHARMAP) {
+    if (cur < end && bitset_get(pc->arg0.set, (unsigned char)*cur)) {
+      cur++;
+      DISPATCH_NEXT;
+    } else {
+      REACH(cur);
+      EXPECT();
+      failflag = 1;
+      JUMP(pc->arg1.jump);
+    }
+  }
+  OP(STRING) {
+    int next;
+    if (end - cur >= (long)pc->arg0.str->len
+        && (next = nezvm_string_equal(pc->arg0.str, cur)) > 0) {
+      cur += next;
+      DISPATCH_NEXT;
+    } else {
+      REACH(cur);
+      EXPECT();
+      failflag = 1;
+      JUMP(pc->arg1.jump);
+    }
+  }
+  OP(ANY) {
+    if (cur < end) {
+      cur++;
+      DISPATCH_NEXT;
+    } else {
+      REACH(cur);
+      EXPECT();
+      failflag = 1;
+      JUMP(pc->arg0.jump);
+    }
+  }
+  OP(PUSHpos) {
+    PUSH_SP(context, cur);
+    CAPTURE_MARK_POS();
+    DISPATCH_NEXT;
+  }
+  OP(POPpos) {
+    CHECK_POP(context);
+    (void)POP_SP(context);
+    CAPTURE_DROP();
+    DISPATCH_NEXT;
+  }
+  OP(GETpos) {
+    REACH(cur);
+    cur = TOP_POS(context);
+    CAPTURE_PEEK();
+    DISPATCH_NEXT;
+  }
+  OP(STOREpos) {
+    REACH(cur);
+    CHECK_POP(context);
+    cur = POP_POS(context);
+    CAPTURE_ROLLBACK();
+    DISPATCH_NEXT;
+  }
+  OP(STOREflag) {
+    failflag = pc->arg0.val;
+    DISPATCH_NEXT;
+  }
+  OP(NOTCHAR) {
+    REACH(cur);
+    if (cur < end && *cur == pc->arg0.c) {
+      failflag = 1;
+      JUMP(pc->arg1.jump);
+    }
+    DISPATCH_NEXT;
+  }
+  OP(NOTCHARMAP) {
+    REACH(cur);
+    if (cur < end && bitset_get(pc->arg0.set, (unsigned char)*cur)) {
+      failflag = 1;
+      JUMP(pc->arg1.jump);
+    }
+    DISPATCH_NEXT;
+  }
+  OP(NOTSTRING) {
+    REACH(cur);
+    if (end - cur >= (long)pc->arg0.str->len
+        && nezvm_string_equal(pc->arg0.str, cur) > 0) {
+      failflag = 1;
+      JUMP(pc->arg1.jump);
+    }
+    DISPATCH_NEXT;
+  }
+  OP(NOTCHARANY) {
+    REACH(cur);
+    if (cur == end || *cur == pc->arg0.c) {
+      failflag = 1;
+      JUMP(pc->arg1.jump);
+    }
+    cur++;
+    DISPATCH_NEXT;
+  }
+  OP(OPTIONALCHAR) {
+    REACH(cur);
+    if (cur < end && *cur == pc->arg0.c) {
+      ++cur;
+    }
+    DISPATCH_NEXT;
+  }
+  OP(OPTIONALCHARMAP) {
+    REACH(cur);
+    if (cur < end && bitset_get(pc->arg0.set, (unsigned char)*cur)) {
+      ++cur;
+    }
+    DISPATCH_NEXT;
+  }
+  OP(OPTIONALSTRING) {
+    REACH(cur);
+    if (end - cur >= (long)pc->arg0.str->len) {
+      cur += nezvm_string_equal(pc->arg0.str, cur);
+    }
+    DISPATCH_NEXT;
+  }
+  OP(ZEROMORECHARMAP) {
+  L_head:
+    ;
+    if (cur < end && bitset_get(pc->arg0.set, (unsigned char)*cur)) {
+      cur++;
+      goto L_head;
+    }
+    REACH(cur);
+    DISPATCH_NEXT;
+  }
+  OP(STRINGTRIE) {
+    nezvm_trie_ptr_t trie = pc->arg0.trie;
+    int alt = nezvm_trie_match(trie, cur, end);
+    REACH(cur);
+    if (alt >= 0) {
+      const nezvm_trie_alt_t *a = &NEZVM_TRIE_ALT(trie)[alt];
+      cur += a->len;
+      if (a->flag >= 0) {
+        failflag = a->flag;
+      }
+      JUMP(pc + a->jump);
+    }
+    EXPECT();
+    failflag = 1;
+    JUMP(pc->arg1.jump);
+  }
+  OP(SCANSTRING) {
+    int found;
+    cur = nez_Scan(pc->arg0.scan, cur, end, end + context->input_padding,
+                   &found);
+    REACH(cur);
+    failflag = 1;
+    if (found) {
+      JUMP(pc->arg1.jump);
+    }
+    EXPECT();
+    JUMP(pc + pc->arg0.scan->eof_jump);
+  }
+L_stack_overflow:
+  context->pos = cur - context->inputs;
+  return NEZ_STACK_OVERFLOW;
+L_stack_underflow:
+  context->pos = cur - context->inputs;
+  return NEZ_BYTECODE_ERROR;
+#if NEZVM_EXEC_MODE == NEZVM_MODE_CAPTURE \
+    || NEZVM_EXEC_MODE == NEZVM_MODE_PROFILE
+L_memory_error:
+  context->pos = cur - context->inputs;
+  return NEZ_MEMORY_ERROR;
+#endif
+}
+
+#undef OP
+#undef NEZVM_EXEC_MEMO
+#undef NEZVM_EXEC_COPY
+#undef EXPECT
+#undef STACK_ENTRY
+#undef STACK_BASE
+#undef STACK_TOP
+#undef STACK_IP
+#undef STACK_POS
+#undef STACK_TO_IP
+#undef STACK_TO_POS
+#undef HIT
+#undef COUNT_CALL
+#undef COUNT_RET
+#undef CAPTURE_MARK
+#undef CAPTURE_MARK_POS
+#undef CAPTURE_DROP
+#undef CAPTURE_ROLLBACK
+#undef CAPTURE_PEEK
+#undef CAPTURE_BEGIN
+#undef CAPTURE_END
+#undef CAPTURE_EXIT
+#if NEZVM_EXEC_MODE == NEZVM_MODE_CAPTURE
+#undef CAPTURE_EVENT
+#endif
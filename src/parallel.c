@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "libnez.h"
+#include "nezvm.h"
+
+long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst);
+
+/*
+** Speculative parallel parsing. The start rule is assumed to be a
+** repetition of records, so the input is cut into one chunk per thread at
+** a record delimiter found near each cut point, and every chunk is parsed
+** on its own as if it were a whole input. A chunk is accepted when it is
+** consumed exactly; a chunk that is not was cut at a wrong boundary (or
+** holds a real error) and is re-parsed serially together with its
+** neighbours. Acceptance cannot tell a cut inside a record whose two
+** halves happen to parse as records, so grammars in which the delimiter
+** may appear inside a record (a quoted field, say) must be parsed with a
+** single thread.
+*/
+typedef struct ParsingChunk {
+  NezVMInstruction *inst;
+  ParsingContext parent;
+  size_t start;
+  size_t end;
+  long result;
+  pthread_t thread;
+  int started;   /* parsed on thread, to be joined */
+} ParsingChunk;
+
+/*
+** parses [start, end) of the parent's input with a private context; the
+** farthest failure is copied back to the parent when report is set, and
+** the length of the records parsed before it to consumed, if not NULL
+*/
+static long nez_ParseRange(ParsingContext parent, NezVMInstruction *inst,
+                           size_t start, size_t end, int report,
+                           size_t *consumed) {
+  struct ParsingContext ctx;
+  long result;
+  ctx = *parent;
+  ctx.pos = 0;
+  ctx.memo = NULL;
+  ctx.input_size = end - start;
+  /* the rest of the parent's input doubles as padding */
+  ctx.inputs = parent->inputs + start;
+  ctx.input_padding = parent->input_size - end + parent->input_padding;
+  ctx.stack_pointer_base =
+      (StackEntry)malloc(sizeof(union StackEntry) * ctx.stack_size);
+  if (ctx.stack_pointer_base == NULL) {
+    if (consumed != NULL) {
+      *consumed = 0;
+    }
+    return NEZ_MEMORY_ERROR;
+  }
+  ctx.stack_pointer = ctx.stack_pointer_base;
+  ctx.stack_pointer32 = (uint32_t *)ctx.stack_pointer_base;
+  result = nez_VM_Execute(&ctx, inst);
+  if (consumed != NULL) {
+    *consumed = result == NEZ_OK ? (size_t)ctx.pos : 0;
+  }
+  if (result == NEZ_OK && (size_t)ctx.pos != ctx.input_size) {
+    result = NEZ_PARSE_ERROR;
+  }
+  if (result != 0 && report) {
+    parent->error_pos = start + ctx.error_pos;
+    parent->expected_size = ctx.expected_size;
+    memcpy(parent->expected, ctx.expected,
+           sizeof(ctx.expected[0]) * ctx.expected_size);
+  }
+  free(ctx.stack_pointer_base);
+  return result;
+}
+
+static void *nez_ParseChunk(void *arg) {
+  ParsingChunk *chunk = (ParsingChunk *)arg;
+  chunk->result =
+      nez_ParseRange(chunk->parent, chunk->inst, chunk->start, chunk->end,
+                     0, NULL);
+  return NULL;
+}
+
+static size_t nez_FindBoundary(ParsingContext context, size_t pos, char delim) {
+  const char *p = memchr(context->inputs + pos, delim, context->input_size - pos);
+  return p != NULL ? (size_t)(p - context->inputs) + 1 : context->input_size;
+}
+
+int nez_ParseParallel(ParsingContext context, NezVMInstruction *inst,
+                      int threads, char delim) {
+  ParsingChunk *chunks;
+  int size = 0;
+  size_t start = 0;
+  size_t from = 0;   /* start of the range accepted last */
+  long result = 0;
+  if (threads > 1 && context->input_size / threads < NEZVM_PARALLEL_MIN_CHUNK) {
+    threads = context->input_size / NEZVM_PARALLEL_MIN_CHUNK;
+  }
+  if (threads <= 1) {
+    result = nez_VM_Execute(context, inst);
+    if (result == NEZ_OK && (size_t)context->pos != context->input_size) {
+      result = NEZ_PARSE_ERROR;
+    }
+    return result;
+  }
+  chunks = (ParsingChunk *)malloc(sizeof(*chunks) * threads);
+  for (int i = 0; i < threads && start < context->input_size; i++) {
+    size_t end = context->input_size;
+    if (i + 1 < threads) {
+      end = nez_FindBoundary(context, context->input_size / threads * (i + 1), delim);
+      if (end < start) {
+        end = start;
+      }
+    }
+    if (end == start) {
+      continue;
+    }
+    chunks[size].inst = inst;
+    chunks[size].parent = context;
+    chunks[size].start = start;
+    chunks[size].end = end;
+    chunks[size].started =
+        pthread_create(&chunks[size].thread, NULL, nez_ParseChunk,
+                       &chunks[size]) == 0;
+    if (!chunks[size].started) {
+      nez_ParseChunk(&chunks[size]);
+    }
+    start = end;
+    size++;
+  }
+  for (int i = 0; i < size; i++) {
+    if (chunks[i].started) {
+      pthread_join(chunks[i].thread, NULL);
+    }
+  }
+
+  /*
+  ** A failed chunk may have been cut inside a record, which makes every
+  ** boundary of the failed chunks next to it suspect, along with the one
+  ** before them. They are re-parsed together from the start of the range
+  ** accepted last, and extended to the right until the re-parse is
+  ** consumed exactly. Each extension resumes after the records the
+  ** previous attempt parsed, so no record is parsed twice; an attempt that
+  ** parsed none could only start over, so the rest of the input is then
+  ** decided by one parse from the start of the range, as is a scan that
+  ** still fails at the end of the input.
+  */
+  for (int i = 0; i < size; i++) {
+    size_t resume = from;
+    size_t consumed = 0;
+    int last = i;
+    if (chunks[i].result == 0) {
+      from = chunks[i].start;
+      continue;
+    }
+    while (last + 1 < size && chunks[last + 1].result != 0) {
+      last++;
+    }
+    for (;;) {
+      result = nez_ParseRange(context, inst, resume, chunks[last].end, 1,
+                              &consumed);
+      if (result == 0 || last + 1 == size || consumed == 0) {
+        break;
+      }
+      resume += consumed;
+      last++;
+    }
+    if (result != 0 && (resume != from || last + 1 < size)) {
+      result = nez_ParseRange(context, inst, from, context->input_size, 1,
+                              NULL);
+      break;
+    }
+    if (result != 0) {
+      break;
+    }
+    from = resume;
+    i = last;
+  }
+  context->pos = result == 0 ? (long)context->input_size : 0;
+  free(chunks);
+  return result;
+}
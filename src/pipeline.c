@@ -0,0 +1,561 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "libnez.h"
+#include "nezvm.h"
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_OFF_SQ_RING)
+#define NEZVM_HAVE_IO_URING 1
+#endif
+#endif
+
+/*
+** Batch parsing of many files. Files are loaded ahead of the parse
+** workers into buffers followed by the input padding, and handed over
+** through a ready queue in the order they finish loading. The bytes of
+** loaded and in-flight buffers are charged against a budget before a read
+** is issued and given back once the file is parsed, which bounds memory
+** however far I/O runs ahead.
+**
+** Reads go through an io_uring driven by the calling thread, set up with
+** raw system calls; where the kernel does not offer one, a few reader
+** threads do blocking reads instead.
+*/
+typedef struct InputFile {
+  struct InputFile *next;
+  long index;
+  int fd;
+  int status;
+  char *buffer;
+  size_t length;
+  size_t done;        /* bytes read so far */
+  size_t reserved;    /* charged against the budget */
+  struct iovec iov;   /* of the read in flight */
+} InputFile;
+
+typedef struct InputPipeline {
+  ParsingContext context;
+  NezVMInstruction *inst;
+  const char **paths;
+  long size;
+  long next;          /* next file for the reader threads */
+  size_t budget;
+  size_t used;        /* bytes of input loaded or being read */
+  InputFile *ready;
+  InputFile *ready_tail;
+  int loading;        /* loaders still running */
+  int stop;
+  int result;
+  ParsingFileFunc func;
+  void *arg;
+  pthread_mutex_t lock;
+  pthread_cond_t ready_cond;
+  pthread_cond_t space;
+} InputPipeline;
+
+#define NEZVM_INPUT_MAX_READ (1 << 30)
+
+static InputFile *nez_InputOpen(InputPipeline *p, long index) {
+  InputFile *f = (InputFile *)calloc(1, sizeof(*f));
+  struct stat st;
+  f->index = index;
+  f->status = NEZ_IO_ERROR;
+  f->fd = open(p->paths[index], O_RDONLY);
+  if (f->fd >= 0) {
+    if (fstat(f->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      f->length = st.st_size;
+      f->status = NEZ_OK;
+    }
+    else {
+      close(f->fd);
+      f->fd = -1;
+    }
+  }
+  return f;
+}
+
+/*
+** Charges size bytes against the budget. A file larger than the whole
+** budget is admitted once nothing else is loaded. Without wait, returns 0
+** instead of waiting for parsed files to give memory back; with it, only
+** when the batch is stopped.
+*/
+static int nez_InputReserve(InputPipeline *p, size_t size, int wait) {
+  pthread_mutex_lock(&p->lock);
+  while (!p->stop && p->used > 0 && p->used + size > p->budget) {
+    if (!wait) {
+      pthread_mutex_unlock(&p->lock);
+      return 0;
+    }
+    pthread_cond_wait(&p->space, &p->lock);
+  }
+  if (p->stop) {
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+  }
+  p->used += size;
+  pthread_mutex_unlock(&p->lock);
+  return 1;
+}
+
+static void nez_InputRelease(InputPipeline *p, size_t size) {
+  pthread_mutex_lock(&p->lock);
+  p->used -= size;
+  pthread_cond_broadcast(&p->space);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* reserves and allocates the buffer of f; returns 0 when stopped */
+static int nez_InputAlloc(InputPipeline *p, InputFile *f, int wait) {
+  size_t size = f->length + PARSING_CONTEXT_INPUT_PADDING;
+  if (!nez_InputReserve(p, size, wait)) {
+    return 0;
+  }
+  f->buffer = (char *)malloc(size);
+  if (f->buffer == NULL) {
+    nez_InputRelease(p, size);
+    f->status = NEZ_MEMORY_ERROR;
+  }
+  else {
+    f->reserved = size;
+  }
+  return 1;
+}
+
+static void nez_InputReady(InputPipeline *p, InputFile *f) {
+  if (f->fd >= 0) {
+    close(f->fd);
+    f->fd = -1;
+  }
+  if (f->buffer != NULL) {
+    memset(f->buffer + f->length, 0, PARSING_CONTEXT_INPUT_PADDING);
+  }
+  pthread_mutex_lock(&p->lock);
+  if (p->ready_tail != NULL) {
+    p->ready_tail->next = f;
+  }
+  else {
+    p->ready = f;
+  }
+  p->ready_tail = f;
+  pthread_cond_signal(&p->ready_cond);
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void nez_InputDone(InputPipeline *p) {
+  pthread_mutex_lock(&p->lock);
+  if (--p->loading == 0) {
+    pthread_cond_broadcast(&p->ready_cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* reads the rest of f with blocking reads */
+static void nez_InputRead(InputFile *f) {
+  while (f->status == NEZ_OK && f->done < f->length) {
+    ssize_t n = pread(f->fd, f->buffer + f->done, f->length - f->done,
+                      f->done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      f->status = NEZ_IO_ERROR;
+    }
+    else if (n == 0) {
+      /* the file shrank since it was opened */
+      f->length = f->done;
+    }
+    f->done += n > 0 ? n : 0;
+  }
+}
+
+static void *nez_InputReader(void *arg) {
+  InputPipeline *p = (InputPipeline *)arg;
+  for (;;) {
+    InputFile *f;
+    long index;
+    pthread_mutex_lock(&p->lock);
+    index = p->stop || p->next >= p->size ? -1 : p->next++;
+    pthread_mutex_unlock(&p->lock);
+    if (index < 0) {
+      break;
+    }
+    f = nez_InputOpen(p, index);
+    if (f->status == NEZ_OK && !nez_InputAlloc(p, f, 1)) {
+      close(f->fd);
+      free(f);
+      break;
+    }
+    nez_InputRead(f);
+    nez_InputReady(p, f);
+  }
+  nez_InputDone(p);
+  return NULL;
+}
+
+#if defined(NEZVM_HAVE_IO_URING)
+typedef struct InputRing {
+  int fd;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_sqe *sqes;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned unsubmitted;
+} InputRing;
+
+static int nez_RingSetup(InputRing *ring, unsigned depth) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+  if (ring->fd < 0) {
+    return -1;
+  }
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = ring->sq_ring;
+  if (ring->sq_ring != MAP_FAILED
+      && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size,
+                                           PROT_READ | PROT_WRITE, MAP_SHARED,
+                                           ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED
+      || ring->sqes == MAP_FAILED) {
+    if (ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    return -1;
+  }
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes =
+      (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+  return 0;
+}
+
+static void nez_RingDispose(InputRing *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+/* queues a read of the rest of f; there is always room for it */
+static void nez_RingRead(InputRing *ring, InputFile *f) {
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  size_t len = f->length - f->done;
+  f->iov.iov_base = f->buffer + f->done;
+  f->iov.iov_len = len < NEZVM_INPUT_MAX_READ ? len : NEZVM_INPUT_MAX_READ;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = f->fd;
+  sqe->off = f->done;
+  sqe->addr = (uint64_t)(uintptr_t)&f->iov;
+  sqe->len = 1;
+  sqe->user_data = (uint64_t)(uintptr_t)f;
+  ring->sq_array[index] = index;
+  /* the kernel must see the entry before the new tail */
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->unsubmitted++;
+}
+
+static void nez_InputUnlink(InputFile **list, InputFile *f) {
+  while (*list != f) {
+    list = &(*list)->next;
+  }
+  *list = f->next;
+  f->next = NULL;
+}
+
+static int nez_RingEnter(InputRing *ring, int wait) {
+  int n = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted,
+                  wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (n < 0) {
+    return errno == EINTR || errno == EAGAIN || errno == EBUSY ? 0 : -1;
+  }
+  ring->unsubmitted -= n;
+  return 0;
+}
+
+/*
+** Loads the files with up to NEZVM_INPUT_QUEUE_DEPTH reads in flight.
+** Files are opened and sized synchronously, which is cheap next to the
+** reads, and a file that does not fit in the budget waits, opened, until
+** parsed files give memory back.
+**
+** Should the ring fail, it is torn down, which cancels the reads in
+** flight, the files they were for are read again with blocking reads,
+** and NEZ_IO_ERROR is returned with p->next at the first file left for
+** reader threads. The ring is disposed of either way.
+*/
+static int nez_InputUring(InputPipeline *p, InputRing *ring) {
+  InputFile *pending = NULL;
+  InputFile *reads = NULL;   /* in flight, linked through next */
+  long next = 0;
+  int inflight = 0;
+  int error = 0;
+  for (;;) {
+    while (inflight < NEZVM_INPUT_QUEUE_DEPTH) {
+      InputFile *f;
+      if (pending == NULL) {
+        if (next >= p->size) {
+          break;
+        }
+        pending = nez_InputOpen(p, next++);
+        if (pending->status != NEZ_OK) {
+          nez_InputReady(p, pending);
+          pending = NULL;
+          continue;
+        }
+      }
+      if (!nez_InputAlloc(p, pending, inflight == 0)) {
+        break;
+      }
+      f = pending;
+      pending = NULL;
+      if (f->status != NEZ_OK || f->length == 0) {
+        nez_InputReady(p, f);
+        continue;
+      }
+      nez_RingRead(ring, f);
+      f->next = reads;
+      reads = f;
+      inflight++;
+    }
+    /* admission only stops with nothing in flight when all is done */
+    if (inflight == 0) {
+      break;
+    }
+    if (nez_RingEnter(ring, 1) != 0) {
+      error = 1;
+      break;
+    }
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      InputFile *f = (InputFile *)(uintptr_t)cqe->user_data;
+      if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+        nez_RingRead(ring, f);
+        continue;
+      }
+      if (cqe->res < 0) {
+        f->status = NEZ_IO_ERROR;
+      }
+      else if (cqe->res == 0) {
+        f->length = f->done;
+      }
+      else {
+        f->done += cqe->res;
+      }
+      if (f->status == NEZ_OK && f->done < f->length) {
+        nez_RingRead(ring, f);
+        continue;
+      }
+      nez_InputUnlink(&reads, f);
+      nez_InputReady(p, f);
+      inflight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  nez_RingDispose(ring);
+  while (reads != NULL) {
+    InputFile *f = reads;
+    nez_InputUnlink(&reads, f);
+    nez_InputRead(f);
+    nez_InputReady(p, f);
+  }
+  if (pending != NULL) {
+    next = pending->index;
+    close(pending->fd);
+    free(pending);
+  }
+  pthread_mutex_lock(&p->lock);
+  p->next = next;
+  pthread_mutex_unlock(&p->lock);
+  return error ? NEZ_IO_ERROR : NEZ_OK;
+}
+#endif
+
+static void *nez_InputWorker(void *arg) {
+  InputPipeline *p = (InputPipeline *)arg;
+  struct ParsingContext ctx = *p->context;
+  /*
+  ** what the caller's context collects is not shared between workers;
+  ** each memoizes in a table of its own, as large as the caller's
+  */
+  ctx.memo = NULL;
+  ctx.capture = NULL;
+  ctx.profile = NULL;
+  ctx.trace = NULL;
+  if (p->context->memo != NULL) {
+    nez_SetMemoBudget(&ctx, p->context->memo->size
+                      * sizeof(struct MemoEntry) * PARSING_MEMO_WAYS,
+                      p->context->memo->flags);
+  }
+  ctx.stack_pointer_base =
+      (StackEntry)malloc(sizeof(union StackEntry) * ctx.stack_size);
+  ctx.stack_pointer = ctx.stack_pointer_base;
+  ctx.stack_pointer32 = (uint32_t *)ctx.stack_pointer_base;
+  for (;;) {
+    ParsingFile file;
+    InputFile *f;
+    int stop;
+    pthread_mutex_lock(&p->lock);
+    while (p->ready == NULL && p->loading > 0) {
+      pthread_cond_wait(&p->ready_cond, &p->lock);
+    }
+    f = p->ready;
+    if (f != NULL && (p->ready = f->next) == NULL) {
+      p->ready_tail = NULL;
+    }
+    stop = p->stop;
+    pthread_mutex_unlock(&p->lock);
+    if (f == NULL) {
+      break;
+    }
+    file.index = f->index;
+    file.path = p->paths[f->index];
+    file.length = f->length;
+    file.status = f->status;
+    if (file.status == NEZ_OK && ctx.stack_pointer_base == NULL) {
+      file.status = NEZ_MEMORY_ERROR;
+    }
+    if (file.status == NEZ_OK && !stop) {
+      nez_SetPaddedInputBuffer(&ctx, f->buffer, f->length,
+                               PARSING_CONTEXT_INPUT_PADDING);
+      file.status = nez_Parse(&ctx, p->inst);
+    }
+    /* callbacks are serialized, in the order files are parsed */
+    pthread_mutex_lock(&p->lock);
+    if (!p->stop) {
+      if (file.status != NEZ_OK && p->result == NEZ_OK) {
+        p->result = file.status;
+      }
+      if (p->func != NULL && p->func(&ctx, &file, p->arg) != 0) {
+        p->stop = 1;
+        pthread_cond_broadcast(&p->space);
+      }
+    }
+    if (f->reserved > 0) {
+      p->used -= f->reserved;
+      pthread_cond_broadcast(&p->space);
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(f->buffer);
+    free(f);
+  }
+  if (ctx.memo != NULL) {
+    nez_DisposeMemo(ctx.memo);
+    free(ctx.memo_frame_base);
+  }
+  free(ctx.stack_pointer_base);
+  return NULL;
+}
+
+int nez_ParseFiles(ParsingContext context, NezVMInstruction *inst,
+                   const char **paths, long size, int threads, size_t budget,
+                   int flags, ParsingFileFunc func, void *arg) {
+  InputPipeline p;
+  pthread_t *workers;
+  pthread_t readers[NEZVM_INPUT_READERS];
+  int reader_size = 0;
+#if defined(NEZVM_HAVE_IO_URING)
+  InputRing ring;
+  int uring = !(flags & NEZVM_INPUT_NO_URING)
+      && nez_RingSetup(&ring, NEZVM_INPUT_QUEUE_DEPTH) == 0;
+#else
+  int uring = 0;
+#endif
+  memset(&p, 0, sizeof(p));
+  p.context = context;
+  p.inst = inst;
+  p.paths = paths;
+  p.size = size;
+  p.budget = budget;
+  p.func = func;
+  p.arg = arg;
+  p.loading = uring ? 1 : NEZVM_INPUT_READERS;
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.ready_cond, NULL);
+  pthread_cond_init(&p.space, NULL);
+  threads = threads > 0 ? threads : 1;
+  workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&workers[i], NULL, nez_InputWorker, &p);
+  }
+#if defined(NEZVM_HAVE_IO_URING)
+  if (uring) {
+    if (nez_InputUring(&p, &ring) != NEZ_OK) {
+      /* the rest of the files go to reader threads */
+      pthread_mutex_lock(&p.lock);
+      p.loading += NEZVM_INPUT_READERS;
+      pthread_mutex_unlock(&p.lock);
+      uring = 0;
+    }
+    nez_InputDone(&p);
+  }
+#endif
+  if (!uring) {
+    for (; reader_size < NEZVM_INPUT_READERS; reader_size++) {
+      pthread_create(&readers[reader_size], NULL, nez_InputReader, &p);
+    }
+  }
+  for (int i = 0; i < reader_size; i++) {
+    pthread_join(readers[i], NULL);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  pthread_mutex_destroy(&p.lock);
+  pthread_cond_destroy(&p.ready_cond);
+  pthread_cond_destroy(&p.space);
+  return p.result;
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <string.h>
+#include "libnez.h"
+#include "nezvm.h"
+
+long nez_VM_Execute(ParsingContext context, NezVMInstruction *inst);
+
+/*
+** Records are found with memchr(), which is vectorized in the C library,
+** and parsed where they are: the context is pointed at each record in
+** turn, with the rest of the input as padding, and restored at the end.
+** The memo table, keyed by whole-input positions, is set aside meanwhile.
+*/
+int nez_ParseRecords(ParsingContext context, NezVMInstruction *inst,
+                     char delim, int flags, ParsingRecordFunc func, void *arg) {
+  const char *inputs = context->inputs;
+  size_t input_size = context->input_size;
+  size_t input_padding = context->input_padding;
+  ParsingMemo memo = context->memo;
+  const char *p = inputs;
+  const char *end = inputs + input_size;
+  ParsingRecord record;
+  int result = NEZ_OK;
+
+  context->memo = NULL;
+  record.index = 0;
+  while (p < end) {
+    const char *q = memchr(p, delim, end - p);
+    if (q == NULL) {
+      q = end;
+    }
+    context->inputs = p;
+    context->input_size = q - p;
+    context->input_padding = end - q + input_padding;
+    context->pos = 0;
+    record.start = p - inputs;
+    record.length = q - p;
+    record.status = nez_VM_Execute(context, inst);
+    if (record.status == NEZ_OK && (size_t)context->pos != record.length) {
+      record.status = NEZ_PARSE_ERROR;
+    }
+    record.error_pos = record.start + context->error_pos;
+    if (record.status != NEZ_OK && result == NEZ_OK) {
+      result = record.status;
+    }
+    if (func != NULL && func(context, &record, arg) != 0) {
+      break;
+    }
+    if (record.status != NEZ_OK && !(flags & NEZVM_RECORD_RESYNC)) {
+      break;
+    }
+    record.index++;
+    p = q + 1;
+  }
+
+  context->inputs = inputs;
+  context->input_size = input_size;
+  context->input_padding = input_padding;
+  context->memo = memo;
+  context->pos = result == NEZ_OK ? (long)input_size : 0;
+  return result;
+}
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "libnez.h"
+#include "nezvm.h"
+#include "sampler.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* stacks that collide this often in the table are dropped */
+#define NEZVM_SAMPLE_PROBES 32
+
+typedef struct SampleStack {
+  uint64_t hash;
+  uint64_t count;   /* 0 for a free slot */
+  int frame;        /* first frame in the pool, innermost first */
+  short depth;
+  short truncated;
+} SampleStack;
+
+/* everything the handler touches is allocated up front */
+static struct Sampler {
+  ParsingContext context;
+  const NezVMInstruction *code[NEZVM_MODE_SIZE];
+  long length;
+  timer_t timer;
+  struct sigaction saved;
+  volatile sig_atomic_t active;
+  uint64_t samples;
+  uint64_t idle;      /* taken outside of a parse */
+  uint64_t dropped;
+  SampleStack stacks[NEZVM_SAMPLE_STACKS];
+  const NezVMInstruction *frames[NEZVM_SAMPLE_FRAMES];
+  int frame_size;
+} nezvm_sampler;
+
+/* the mode copy f points into, or -1 for the input pushed by PUSH_SP */
+static int nez_SampleMode(const struct Sampler *s, const NezVMInstruction *f) {
+  for (int m = 0; m < NEZVM_MODE_SIZE; m++) {
+    if (s->code[m] != NULL && f >= s->code[m] && f < s->code[m] + s->length) {
+      return m;
+    }
+  }
+  return -1;
+}
+
+static void nez_SampleCount(struct Sampler *s, const NezVMInstruction **frames,
+                            int depth, int truncated) {
+  uint64_t h = 14695981039346656037ULL ^ (uint64_t)truncated;
+  size_t i;
+  int probe, k;
+  for (k = 0; k < depth; k++) {
+    h = (h ^ (uint64_t)(uintptr_t)frames[k]) * 1099511628211ULL;
+  }
+  i = (size_t)(h ^ h >> 32) & (NEZVM_SAMPLE_STACKS - 1);
+  for (probe = 0; probe < NEZVM_SAMPLE_PROBES; probe++) {
+    SampleStack *e = &s->stacks[i];
+    if (e->count == 0) {
+      if (s->frame_size + depth > NEZVM_SAMPLE_FRAMES) {
+        break;
+      }
+      for (k = 0; k < depth; k++) {
+        s->frames[s->frame_size + k] = frames[k];
+      }
+      e->hash = h;
+      e->frame = s->frame_size;
+      e->depth = depth;
+      e->truncated = truncated;
+      e->count = 1;
+      s->frame_size += depth;
+      return;
+    }
+    if (e->hash == h && e->depth == depth && e->truncated == truncated) {
+      for (k = 0; k < depth && s->frames[e->frame + k] == frames[k]; k++) {
+      }
+      if (k == depth) {
+        e->count++;
+        return;
+      }
+    }
+    i = (i + 1) & (NEZVM_SAMPLE_STACKS - 1);
+  }
+  s->dropped++;
+}
+
+/*
+** Runs on the parsing thread, between two instructions of the VM or
+** outside of it. The stack pointer is checked before use; entries that
+** are not return addresses are input positions and are skipped. Compact
+** stacks keep return addresses as complemented byte offsets (see
+** NEZVM_MODE_WIDE), above any position.
+*/
+static void nez_SampleSignal(int sig) {
+  struct Sampler *s = &nezvm_sampler;
+  ParsingContext ctx = s->context;
+  const NezVMInstruction *frames[NEZVM_SAMPLE_DEPTH];
+  int depth = 0;
+  int truncated = 0;
+  (void)sig;
+  if (!s->active) {
+    return;
+  }
+  s->samples++;
+  if (NEZVM_STACK_COMPACT(ctx)) {
+    const uint32_t *base = (const uint32_t *)ctx->stack_pointer_base;
+    const uint32_t *sp = ctx->stack_pointer32;
+    if (sp < base || sp > base + NEZVM_STACK_LENGTH(ctx, uint32_t)) {
+      sp = base;
+    }
+    while (sp > base) {
+      uint32_t v = *--sp;
+      if (v > UINT32_MAX - s->length * sizeof(NezVMInstruction)) {
+        if (depth == NEZVM_SAMPLE_DEPTH) {
+          truncated = 1;
+          break;
+        }
+        frames[depth++] = s->code[0] + (uint32_t)~v / sizeof(NezVMInstruction);
+      }
+    }
+  }
+  else {
+    const union StackEntry *base = ctx->stack_pointer_base;
+    const union StackEntry *sp = ctx->stack_pointer;
+    if (sp < base || sp > base + ctx->stack_size) {
+      sp = base;
+    }
+    while (sp > base) {
+      const NezVMInstruction *f = (--sp)->func;
+      if (nez_SampleMode(s, f) >= 0) {
+        if (depth == NEZVM_SAMPLE_DEPTH) {
+          truncated = 1;
+          break;
+        }
+        frames[depth++] = f;
+      }
+    }
+  }
+  if (depth == 0) {
+    s->idle++;
+    return;
+  }
+  nez_SampleCount(s, frames, depth, truncated);
+}
+
+int nez_StartSampler(ParsingContext context, NezVMInstruction *inst, int hz) {
+  struct Sampler *s = &nezvm_sampler;
+  struct sigaction sa;
+  struct sigevent sev;
+  struct itimerspec its;
+  if (s->active || hz <= 0) {
+    return NEZ_IO_ERROR;
+  }
+  memset(s, 0, sizeof(*s));
+  s->context = context;
+  s->length = context->bytecode_length;
+  /* the wide copies are only there for inputs that need them */
+  for (int m = 0; m < NEZVM_MODE_SIZE; m++) {
+    if (m < NEZVM_MODE_WIDE || !NEZVM_STACK_COMPACT(context)) {
+      s->code[m] = nez_VM_Mode(inst, m);
+    }
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = nez_SampleSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, &s->saved) != 0) {
+    return NEZ_IO_ERROR;
+  }
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+  sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &s->timer) != 0) {
+    sigaction(SIGPROF, &s->saved, NULL);
+    return NEZ_IO_ERROR;
+  }
+  its.it_interval.tv_sec = 0;
+  its.it_interval.tv_nsec = 1000000000L / hz;
+  if (hz == 1) {
+    its.it_interval.tv_sec = 1;
+    its.it_interval.tv_nsec = 0;
+  }
+  its.it_value = its.it_interval;
+  s->active = 1;
+  if (timer_settime(s->timer, 0, &its, NULL) != 0) {
+    s->active = 0;
+    timer_delete(s->timer);
+    sigaction(SIGPROF, &s->saved, NULL);
+    return NEZ_IO_ERROR;
+  }
+  return NEZ_OK;
+}
+
+void nez_StopSampler(void) {
+  struct Sampler *s = &nezvm_sampler;
+  if (s->active) {
+    timer_delete(s->timer);
+    s->active = 0;
+    sigaction(SIGPROF, &s->saved, NULL);
+  }
+}
+
+/*
+** The rule called by the CALL that pushed frame f, and the offset of that
+** CALL; the bottom frame is the return to EXIT pushed for the start rule.
+*/
+static long nez_SampleSite(const struct Sampler *s, const NezVMInstruction *f,
+                           long *entry) {
+  const NezVMInstruction *code = s->code[nez_SampleMode(s, f)];
+  long offset = f - code;
+  if (offset == 0) {
+    *entry = s->context->startPoint;
+    return -1;
+  }
+  *entry = code[offset - 1].arg0.jump - code;
+  return offset - 1;
+}
+
+typedef struct SampleCount {
+  long index;       /* rule entry or call site offset */
+  long caller;      /* of a call site, -1 when not seen */
+  long callee;
+  uint64_t self;
+  uint64_t total;
+  long seen;        /* last stack counted in total */
+} SampleCount;
+
+static int nez_CompareSampleCount(const void *a, const void *b) {
+  const SampleCount *x = (const SampleCount *)a;
+  const SampleCount *y = (const SampleCount *)b;
+  if (x->total != y->total) {
+    return x->total > y->total ? -1 : 1;
+  }
+  return x->self > y->self ? -1 : x->self < y->self;
+}
+
+static double nez_SamplePercent(uint64_t part, uint64_t whole) {
+  return whole > 0 ? 100.0 * part / whole : 0.0;
+}
+
+static void nez_CountSample(SampleCount *c, long stack, uint64_t count,
+                            int innermost) {
+  if (innermost) {
+    c->self += count;
+  }
+  /* a rule or site on a stack several times is counted once in total */
+  if (c->seen != stack) {
+    c->seen = stack;
+    c->total += count;
+  }
+}
+
+/* keeps the counts seen, sorted by total */
+static long nez_SortSamples(SampleCount *counts, long length) {
+  long size = 0;
+  for (long i = 0; i < length; i++) {
+    if (counts[i].total > 0) {
+      counts[i].index = i;
+      counts[size++] = counts[i];
+    }
+  }
+  qsort(counts, size, sizeof(SampleCount), nez_CompareSampleCount);
+  return size;
+}
+
+static void nez_PrintSampleCount(const SampleCount *c, uint64_t samples) {
+  fprintf(stderr, " %10llu %6.1f %10llu %6.1f\n",
+          (unsigned long long)c->self, nez_SamplePercent(c->self, samples),
+          (unsigned long long)c->total, nez_SamplePercent(c->total, samples));
+}
+
+void nez_PrintSamples(FILE *folded) {
+  struct Sampler *s = &nezvm_sampler;
+  const char **names = nez_RuleNames(s->code[0], s->length);
+  SampleCount *rules = (SampleCount *)calloc(s->length, sizeof(SampleCount));
+  SampleCount *sites = (SampleCount *)calloc(s->length, sizeof(SampleCount));
+  long rule_size, site_size;
+  long i;
+  if (names == NULL || rules == NULL || sites == NULL) {
+    nez_PrintErrorInfo("cannot allocate the samples");
+  }
+  for (i = 0; i < s->length; i++) {
+    rules[i].seen = sites[i].seen = -1;
+    sites[i].caller = -1;
+  }
+  for (i = 0; i < NEZVM_SAMPLE_STACKS; i++) {
+    const SampleStack *e = &s->stacks[i];
+    long caller = -1;
+    if (e->count == 0) {
+      continue;
+    }
+    if (folded != NULL && e->truncated) {
+      fprintf(folded, "(truncated);");
+    }
+    for (int k = e->depth - 1; k >= 0; k--) {
+      long entry;
+      long site = nez_SampleSite(s, s->frames[e->frame + k], &entry);
+      nez_CountSample(&rules[entry], i, e->count, k == 0);
+      if (site >= 0) {
+        if (caller >= 0 || !e->truncated) {
+          sites[site].caller = caller;
+        }
+        sites[site].callee = entry;
+        nez_CountSample(&sites[site], i, e->count, k == 0);
+      }
+      caller = entry;
+      if (folded != NULL) {
+        nez_PrintRuleName(folded, names, entry, 0);
+        fputc(k > 0 ? ';' : ' ', folded);
+      }
+    }
+    if (folded != NULL) {
+      fprintf(folded, "%llu\n", (unsigned long long)e->count);
+    }
+  }
+  rule_size = nez_SortSamples(rules, s->length);
+  site_size = nez_SortSamples(sites, s->length);
+  fprintf(stderr, "samples=%llu, outside=%llu, dropped=%llu\n",
+          (unsigned long long)s->samples, (unsigned long long)s->idle,
+          (unsigned long long)s->dropped);
+  fprintf(stderr, "  %-24s %10s %6s %10s %6s\n", "rule", "self", "self%",
+          "total", "total%");
+  for (i = 0; i < rule_size; i++) {
+    fprintf(stderr, "  ");
+    nez_PrintRuleName(stderr, names, rules[i].index, 24);
+    nez_PrintSampleCount(&rules[i], s->samples);
+  }
+  fprintf(stderr, "  %-24s %10s %6s %10s %6s\n", "call site", "self", "self%",
+          "total", "total%");
+  for (i = 0; i < site_size; i++) {
+    fprintf(stderr, "  @%-23ld", sites[i].index);
+    nez_PrintSampleCount(&sites[i], s->samples);
+    fprintf(stderr, "    ");
+    if (sites[i].caller >= 0) {
+      nez_PrintRuleName(stderr, names, sites[i].caller, 0);
+    }
+    else {
+      fprintf(stderr, "(truncated)");
+    }
+    fprintf(stderr, " -> ");
+    nez_PrintRuleName(stderr, names, sites[i].callee, 0);
+    fprintf(stderr, "\n");
+  }
+  free(names);
+  free(rules);
+  free(sites);
+}
@@ -0,0 +1,38 @@
+#include <stdio.h>
+
+#ifndef NEZVM_SAMPLER_H
+#define NEZVM_SAMPLER_H
+
+/*
+** Sampling profiler. A CPU time timer of the calling thread raises
+** SIGPROF hz times a second (kernels may deliver at most one per tick of
+** their own), and the handler reads the VM stack of the context: the
+** return addresses on it are the call sites of the rules being run, and
+** the CALL before the topmost one names the rule the VM is in. Stacks
+** are counted in fixed tables (NEZVM_SAMPLE_STACKS distinct ones,
+** NEZVM_SAMPLE_FRAMES frames in all, the innermost NEZVM_SAMPLE_DEPTH of
+** each), so the sampler can stay on indefinitely; samples that do not fit
+** are only counted. The interpreters are not touched, so a sampled parse
+** runs the code an unsampled one does.
+**
+** There is one sampler per process. It must be started and stopped on
+** the thread that parses with the context, and the program must outlive
+** the samples.
+*/
+#define NEZVM_SAMPLE_HZ 997
+#define NEZVM_SAMPLE_DEPTH 64
+#define NEZVM_SAMPLE_STACKS 4096
+#define NEZVM_SAMPLE_FRAMES (1 << 16)
+
+int nez_StartSampler(ParsingContext context, NezVMInstruction *inst, int hz);
+void nez_StopSampler(void);
+
+/*
+** Prints the samples per rule (where the VM was, and anywhere on the
+** stack) and per call site to stderr, and writes the stacks to folded, if
+** not NULL, in the format of flamegraph.pl. Call sites are bytecode
+** offsets of CALL instructions.
+*/
+void nez_PrintSamples(FILE *folded);
+
+#endif
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <string.h>
+#include "libnez.h"
+#include "nezvm.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+** Layout of a scanner block, all position independent:
+**   header | offset[literal_size + 1] | out[state_size]
+**          | next[state_size * 256] | literal text
+*/
+static int *scan_out(nezvm_scan_ptr_t scan) {
+  return &scan->offset[scan->literal_size + 1];
+}
+
+static unsigned short *scan_next(nezvm_scan_ptr_t scan) {
+  return (unsigned short *)&scan_out(scan)[scan->state_size];
+}
+
+static const char *scan_text(nezvm_scan_ptr_t scan) {
+  return (const char *)&scan_next(scan)[scan->state_size * 256];
+}
+
+/*
+** Builds the Aho-Corasick automaton as a full transition table. out[s] is
+** the length of the longest literal ending in state s, so that the start
+** of the earliest match can be recovered while scanning.
+*/
+static int nez_BuildAutomaton(const char **text, const int *len, int size,
+                              int **out, int **next) {
+  int cap = 1;
+  int state_size = 1;
+  int *fail, *queue;
+  for (int i = 0; i < size; i++) {
+    cap += len[i];
+  }
+  if (cap > NEZVM_SCAN_MAX_STATES) {
+    return 0;
+  }
+  *out = (int *)calloc(cap, sizeof(int));
+  *next = (int *)malloc(sizeof(int) * cap * 256);
+  memset(*next, -1, sizeof(int) * cap * 256);
+  for (int i = 0; i < size; i++) {
+    int s = 0;
+    for (int j = 0; j < len[i]; j++) {
+      int *t = &(*next)[s * 256 + (unsigned char)text[i][j]];
+      if (*t == -1) {
+        *t = state_size++;
+      }
+      s = *t;
+    }
+    if ((*out)[s] < len[i]) {
+      (*out)[s] = len[i];
+    }
+  }
+
+  fail = (int *)calloc(state_size, sizeof(int));
+  queue = (int *)malloc(sizeof(int) * state_size);
+  int head = 0, tail = 0;
+  for (int c = 0; c < 256; c++) {
+    int *t = &(*next)[c];
+    if (*t == -1) {
+      *t = 0;
+    }
+    else {
+      queue[tail++] = *t;
+    }
+  }
+  while (head < tail) {
+    int r = queue[head++];
+    for (int c = 0; c < 256; c++) {
+      int *t = &(*next)[r * 256 + c];
+      if (*t == -1) {
+        *t = (*next)[fail[r] * 256 + c];
+      }
+      else {
+        fail[*t] = (*next)[fail[r] * 256 + c];
+        if ((*out)[*t] < (*out)[fail[*t]]) {
+          (*out)[*t] = (*out)[fail[*t]];
+        }
+        queue[tail++] = *t;
+      }
+    }
+  }
+  free(fail);
+  free(queue);
+  return state_size;
+}
+
+nezvm_scan_ptr_t nez_CreateScanner(const char **text, const int *len, int size) {
+  nezvm_scan_ptr_t scan;
+  int *out = NULL;
+  int *next = NULL;
+  int state_size = 0;
+  size_t text_size = 0;
+  for (int i = 0; i < size; i++) {
+    text_size += len[i];
+  }
+  if (size > NEZVM_SCAN_SIMD_MAX) {
+    state_size = nez_BuildAutomaton(text, len, size, &out, &next);
+  }
+  size_t bytes = sizeof(*scan) - sizeof(int) + sizeof(int) * (size + 1)
+      + sizeof(int) * state_size + sizeof(unsigned short) * state_size * 256
+      + text_size;
+  scan = (nezvm_scan_ptr_t)malloc(bytes);
+  scan->size = bytes;
+  scan->eof_jump = 0;
+  scan->literal_size = size;
+  scan->state_size = state_size;
+  scan->max_len = 0;
+  bitset_init(&scan->first);
+  scan->offset[0] = 0;
+  for (int i = 0; i < size; i++) {
+    scan->offset[i + 1] = scan->offset[i] + len[i];
+    if (scan->max_len < len[i]) {
+      scan->max_len = len[i];
+    }
+    bitset_set(&scan->first, (unsigned char)text[i][0]);
+  }
+  for (int s = 0; s < state_size; s++) {
+    scan_out(scan)[s] = out[s];
+    for (int c = 0; c < 256; c++) {
+      scan_next(scan)[s * 256 + c] = next[s * 256 + c];
+    }
+  }
+  char *dst = (char *)scan_text(scan);
+  for (int i = 0; i < size; i++) {
+    memcpy(dst + scan->offset[i], text[i], len[i]);
+  }
+  free(out);
+  free(next);
+  return scan;
+}
+
+/* returns the length of the index-th literal and sets *text to it */
+int nez_ScanLiteral(nezvm_scan_ptr_t scan, int index, const char **text) {
+  *text = scan_text(scan) + scan->offset[index];
+  return scan->offset[index + 1] - scan->offset[index];
+}
+
+static int nez_ScanVerify(nezvm_scan_ptr_t scan, const char *p, const char *end) {
+  const char *text = scan_text(scan);
+  for (int i = 0; i < scan->literal_size; i++) {
+    int len = scan->offset[i + 1] - scan->offset[i];
+    if (len <= end - p && memcmp(p, text + scan->offset[i], len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static const char *nez_ScanAutomaton(nezvm_scan_ptr_t scan, const char *cur,
+                                     const char *end, int *found) {
+  const int *out = scan_out(scan);
+  const unsigned short *next = scan_next(scan);
+  const char *best = NULL;
+  const char *p = cur;
+  int s = 0;
+  for (; p < end; p++) {
+    s = next[s * 256 + (unsigned char)*p];
+    if (out[s] > 0 && (best == NULL || p - out[s] + 1 < best)) {
+      best = p - out[s] + 1;
+    }
+    /* no later match can start before best */
+    if (best != NULL && (p - best) + 2 >= scan->max_len) {
+      break;
+    }
+  }
+  if (best != NULL) {
+    *found = 1;
+    return best;
+  }
+  return p;
+}
+
+/*
+** Returns the earliest position at or after cur where one of the literals
+** starts (setting *found), or end. Bytes up to limit may be read, so the
+** vector loop runs up to the end of the input when it is padded.
+*/
+const char *nez_Scan(nezvm_scan_ptr_t scan, const char *cur, const char *end,
+                     const char *limit, int *found) {
+  const char *p = cur;
+  *found = 0;
+  if (scan->state_size > 0) {
+    return nez_ScanAutomaton(scan, cur, end, found);
+  }
+#if defined(__SSE2__)
+  if (scan->literal_size <= NEZVM_SCAN_SIMD_MAX) {
+    /* Teddy-style prefilter on the first two bytes of each literal */
+    const char *text = scan_text(scan);
+    __m128i c0[NEZVM_SCAN_SIMD_MAX];
+    __m128i c1[NEZVM_SCAN_SIMD_MAX];
+    int wide[NEZVM_SCAN_SIMD_MAX];
+    for (int i = 0; i < scan->literal_size; i++) {
+      const char *t = text + scan->offset[i];
+      wide[i] = scan->offset[i + 1] - scan->offset[i] > 1;
+      c0[i] = _mm_set1_epi8(t[0]);
+      c1[i] = _mm_set1_epi8(wide[i] ? t[1] : 0);
+    }
+    while (p < end && limit - p >= 17) {
+      __m128i b0 = _mm_loadu_si128((const __m128i *)p);
+      __m128i b1 = _mm_loadu_si128((const __m128i *)(p + 1));
+      __m128i hit = _mm_setzero_si128();
+      for (int i = 0; i < scan->literal_size; i++) {
+        __m128i m = _mm_cmpeq_epi8(b0, c0[i]);
+        if (wide[i]) {
+          m = _mm_and_si128(m, _mm_cmpeq_epi8(b1, c1[i]));
+        }
+        hit = _mm_or_si128(hit, m);
+      }
+      unsigned mask = _mm_movemask_epi8(hit);
+      while (mask != 0) {
+        const char *q = p + __builtin_ctz(mask);
+        if (q >= end) {
+          return end;
+        }
+        if (nez_ScanVerify(scan, q, end)) {
+          *found = 1;
+          return q;
+        }
+        mask &= mask - 1;
+      }
+      p += 16;
+    }
+    if (p >= end) {
+      return end;
+    }
+  }
+#endif
+  for (; p < end; p++) {
+    if (bitset_get(&scan->first, (unsigned char)*p)
+        && nez_ScanVerify(scan, p, end)) {
+      *found = 1;
+      return p;
+    }
+  }
+  return p;
+}
@@ -0,0 +1,424 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "libnez.h"
+#include "nezvm.h"
+#include "serve.h"
+
+/*
+** Parse daemon. The main thread accepts connections and queues them; each
+** worker takes one connection at a time and answers its requests with a
+** context per grammar that lives as long as the worker. Inputs are read
+** straight into a per-worker buffer followed by the input padding and
+** parsed in place, so a worker stops allocating once its buffer is as
+** large as the largest input it has seen.
+*/
+#define NEZVM_SERVE_MAX_PATH 4096
+
+typedef struct ServeGrammar {
+  NezVMInstruction *inst;
+  ParsingContext context;  /* the one it was loaded with */
+} ServeGrammar;
+
+typedef struct ServeWorker {
+  struct Server *server;
+  pthread_t thread;
+  ParsingContext contexts[NEZVM_SERVE_MAX_GRAMMARS];
+  char *buffer;
+  size_t capacity;
+  int fd;                  /* connection being served, or -1 */
+} ServeWorker;
+
+typedef struct Server {
+  ServeGrammar grammars[NEZVM_SERVE_MAX_GRAMMARS];
+  int grammar_size;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  int *queue;              /* accepted connections, a ring */
+  int queue_head;
+  int queue_size;
+  int queue_capacity;
+  int stopping;
+  ServeWorker *workers;
+  int worker_size;
+} Server;
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void nez_ServeSignal(int sig) {
+  serve_stop = 1;
+}
+
+static uint64_t nez_ServeClock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* makes room for size bytes and the input padding after them */
+static int nez_ServeReserve(ServeWorker *w, size_t size) {
+  if (size > SIZE_MAX - PARSING_CONTEXT_INPUT_PADDING) {
+    return NEZ_MEMORY_ERROR;
+  }
+  if (size + PARSING_CONTEXT_INPUT_PADDING > w->capacity) {
+    size_t capacity = w->capacity * 2;
+    char *buffer;
+    if (capacity < size + PARSING_CONTEXT_INPUT_PADDING) {
+      capacity = size + PARSING_CONTEXT_INPUT_PADDING;
+    }
+    buffer = (char *)realloc(w->buffer, capacity);
+    if (buffer == NULL) {
+      return NEZ_MEMORY_ERROR;
+    }
+    w->buffer = buffer;
+    w->capacity = capacity;
+  }
+  memset(w->buffer + size, 0, PARSING_CONTEXT_INPUT_PADDING);
+  return NEZ_OK;
+}
+
+static int nez_ServeReadFile(ServeWorker *w, const char *path, size_t *length) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  int status = NEZ_IO_ERROR;
+  if (fd < 0) {
+    return NEZ_IO_ERROR;
+  }
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+      && (uint64_t)st.st_size <= NEZVM_SERVE_MAX_INPUT) {
+    status = nez_ServeReserve(w, st.st_size);
+    if (status == NEZ_OK && nez_ServeRead(fd, w->buffer, st.st_size) != 0) {
+      status = NEZ_IO_ERROR;
+    }
+    *length = st.st_size;
+  }
+  close(fd);
+  return status;
+}
+
+/*
+** Answers one request. Returns -1 when the connection is to be dropped:
+** on EOF, I/O errors and malformed requests, after which the stream
+** cannot be resynchronized.
+*/
+static int nez_ServeRequest(ServeWorker *w, int fd) {
+  Server *server = w->server;
+  NezServeRequest request;
+  NezServeResponse response;
+  ParsingResult result;
+  char rule[NEZVM_SERVE_MAX_RULE + 1];
+  char path[NEZVM_SERVE_MAX_PATH + 1];
+  char message[NEZVM_SERVE_MAX_MESSAGE];
+  size_t length = 0;
+  struct iovec iov[2];
+  int status = NEZ_OK;
+  if (nez_ServeRead(fd, &request, sizeof(request)) != 0
+      || request.magic != NEZVM_SERVE_MAGIC
+      || request.rule_length > NEZVM_SERVE_MAX_RULE
+      || (request.type == NEZVM_SERVE_FILE
+          && request.length > NEZVM_SERVE_MAX_PATH)
+      || (request.type == NEZVM_SERVE_BUFFER
+          && request.length > NEZVM_SERVE_MAX_INPUT)
+      || (request.type != NEZVM_SERVE_FILE
+          && request.type != NEZVM_SERVE_BUFFER)
+      || nez_ServeRead(fd, rule, request.rule_length) != 0) {
+    return -1;
+  }
+  rule[request.rule_length] = 0;
+  if (request.type == NEZVM_SERVE_FILE) {
+    if (nez_ServeRead(fd, path, request.length) != 0) {
+      return -1;
+    }
+    path[request.length] = 0;
+  }
+  else {
+    if (nez_ServeReserve(w, request.length) != NEZ_OK
+        || nez_ServeRead(fd, w->buffer, request.length) != 0) {
+      return -1;
+    }
+    length = request.length;
+  }
+
+  memset(&response, 0, sizeof(response));
+  message[0] = 0;
+  if (request.grammar >= (uint32_t)server->grammar_size) {
+    status = NEZ_RULE_ERROR;
+    snprintf(message, sizeof(message), "unknown grammar %u", request.grammar);
+  }
+  else {
+    ServeGrammar *g = &server->grammars[request.grammar];
+    ParsingContext ctx = w->contexts[request.grammar];
+    ctx->startPoint = g->context->startPoint;
+    if (request.rule_length > 0) {
+      status = nez_SetStartRule(ctx, g->inst, rule);
+    }
+    if (status == NEZ_OK && request.type == NEZVM_SERVE_FILE) {
+      status = nez_ServeReadFile(w, path, &length);
+    }
+    if (status == NEZ_OK) {
+      uint64_t start = nez_ServeClock();
+      nez_SetPaddedInputBuffer(ctx, w->buffer, length,
+                               PARSING_CONTEXT_INPUT_PADDING);
+      status = nez_Parse(ctx, g->inst);
+      response.elapsed = nez_ServeClock() - start;
+      nez_GetParsingResult(ctx, status, &result);
+      response.pos = result.pos;
+      response.error_pos = result.error_pos;
+      response.line = result.line;
+      response.column = result.column;
+    }
+    if (status != NEZ_OK) {
+      if (status == NEZ_PARSE_ERROR) {
+        nez_FormatParsingError(&result, message, sizeof(message));
+      }
+      else {
+        snprintf(message, sizeof(message), "%s", nez_StatusMessage(status));
+      }
+    }
+  }
+  response.status = status;
+  response.message_length = strlen(message);
+  iov[0].iov_base = &response;
+  iov[0].iov_len = sizeof(response);
+  iov[1].iov_base = message;
+  iov[1].iov_len = response.message_length;
+  return nez_ServeWrite(fd, iov, 2);
+}
+
+static void *nez_ServeWorker(void *arg) {
+  ServeWorker *w = (ServeWorker *)arg;
+  Server *server = w->server;
+  for (;;) {
+    int fd;
+    pthread_mutex_lock(&server->lock);
+    while (server->queue_size == 0 && !server->stopping) {
+      pthread_cond_wait(&server->ready, &server->lock);
+    }
+    if (server->stopping) {
+      pthread_mutex_unlock(&server->lock);
+      break;
+    }
+    fd = server->queue[server->queue_head];
+    server->queue_head = (server->queue_head + 1) % server->queue_capacity;
+    server->queue_size--;
+    w->fd = fd;
+    pthread_mutex_unlock(&server->lock);
+
+    while (nez_ServeRequest(w, fd) == 0) {
+      /* requests on a connection are answered in order */
+    }
+
+    pthread_mutex_lock(&server->lock);
+    w->fd = -1;
+    pthread_mutex_unlock(&server->lock);
+    close(fd);
+  }
+  return NULL;
+}
+
+static void nez_ServeEnqueue(Server *server, int fd) {
+  pthread_mutex_lock(&server->lock);
+  if (server->queue_size == server->queue_capacity) {
+    int capacity = server->queue_capacity * 2;
+    int *queue = (int *)malloc(sizeof(int) * capacity);
+    for (int i = 0; i < server->queue_size; i++) {
+      queue[i] =
+          server->queue[(server->queue_head + i) % server->queue_capacity];
+    }
+    free(server->queue);
+    server->queue = queue;
+    server->queue_head = 0;
+    server->queue_capacity = capacity;
+  }
+  server->queue[(server->queue_head + server->queue_size)
+                % server->queue_capacity] = fd;
+  server->queue_size++;
+  pthread_cond_signal(&server->ready);
+  pthread_mutex_unlock(&server->lock);
+}
+
+/*
+** The socket is made accessible to the daemon's user only: a client may
+** have any file the daemon can read parsed, and read the error positions.
+*/
+static int nez_ServeListen(const char *socket_path) {
+  struct sockaddr_un addr;
+  mode_t mask;
+  int fd;
+  size_t length = strlen(socket_path);
+  if (length >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, socket_path, length + 1);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(socket_path);
+  mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    umask(mask);
+    close(fd);
+    return -1;
+  }
+  umask(mask);
+  if (listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* gives the worker a context per grammar, set up as the loaded one */
+static int nez_ServeWorkerInit(Server *server, ServeWorker *w) {
+  w->server = server;
+  w->fd = -1;
+  for (int j = 0; j < server->grammar_size; j++) {
+    ParsingContext loaded = server->grammars[j].context;
+    w->contexts[j] = nez_CreateParsingContext(NULL);
+    if (w->contexts[j] == NULL) {
+      return NEZ_MEMORY_ERROR;
+    }
+    w->contexts[j]->bytecode_length = loaded->bytecode_length;
+    w->contexts[j]->lookahead = loaded->lookahead;
+    w->contexts[j]->startPoint = loaded->startPoint;
+  }
+  return NEZ_OK;
+}
+
+static void nez_ServeDispose(Server *server) {
+  for (int i = 0; server->workers != NULL && i < server->worker_size; i++) {
+    ServeWorker *w = &server->workers[i];
+    for (int j = 0; j < server->grammar_size; j++) {
+      if (w->contexts[j] != NULL) {
+        nez_DisposeParsingContext(w->contexts[j]);
+      }
+    }
+    free(w->buffer);
+  }
+  for (int i = 0; i < server->grammar_size; i++) {
+    ServeGrammar *g = &server->grammars[i];
+    nez_DisposeInstruction(g->inst, g->context->bytecode_length);
+    nez_DisposeParsingContext(g->context);
+  }
+  free(server->queue);
+  free(server->workers);
+  pthread_mutex_destroy(&server->lock);
+  pthread_cond_destroy(&server->ready);
+}
+
+int nez_Serve(const char *socket_path, const char **grammars,
+              int grammar_size, const char *start_rule, int workers) {
+  Server server;
+  struct sigaction sa;
+  sigset_t mask, old_mask;
+  int listen_fd;
+  int status;
+  memset(&server, 0, sizeof(server));
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.ready, NULL);
+  server.queue_capacity = 16;
+  server.queue = (int *)malloc(sizeof(int) * server.queue_capacity);
+  if (grammar_size > NEZVM_SERVE_MAX_GRAMMARS) {
+    grammar_size = NEZVM_SERVE_MAX_GRAMMARS;
+  }
+  for (int i = 0; i < grammar_size; i++) {
+    ServeGrammar *g = &server.grammars[i];
+    g->context = nez_CreateParsingContext(NULL);
+    if (g->context == NULL) {
+      fprintf(stderr, "%s\n", nez_StatusMessage(NEZ_MEMORY_ERROR));
+      nez_ServeDispose(&server);
+      return NEZ_MEMORY_ERROR;
+    }
+    g->inst = nez_LoadMachineCode(g->context, grammars[i], start_rule);
+    if (g->inst == NULL) {
+      fprintf(stderr, "cannot load %s\n", grammars[i]);
+      nez_DisposeParsingContext(g->context);
+      nez_ServeDispose(&server);
+      return NEZ_IO_ERROR;
+    }
+    server.grammar_size++;
+  }
+  server.worker_size = workers > 0 ? workers : 1;
+  server.workers = (ServeWorker *)calloc(server.worker_size, sizeof(ServeWorker));
+  status = server.workers == NULL ? NEZ_MEMORY_ERROR : NEZ_OK;
+  for (int i = 0; status == NEZ_OK && i < server.worker_size; i++) {
+    status = nez_ServeWorkerInit(&server, &server.workers[i]);
+  }
+  if (status != NEZ_OK) {
+    fprintf(stderr, "%s\n", nez_StatusMessage(status));
+    nez_ServeDispose(&server);
+    return status;
+  }
+  listen_fd = nez_ServeListen(socket_path);
+  if (listen_fd < 0) {
+    fprintf(stderr, "cannot listen on %s: %s\n", socket_path, strerror(errno));
+    nez_ServeDispose(&server);
+    return NEZ_IO_ERROR;
+  }
+
+  /* workers never see the signals, so that they interrupt accept() */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = nez_ServeSignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  for (int i = 0; i < server.worker_size; i++) {
+    pthread_create(&server.workers[i].thread, NULL, nez_ServeWorker,
+                   &server.workers[i]);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  fprintf(stderr, "serving %d grammars on %s with %d workers\n",
+          server.grammar_size, socket_path, server.worker_size);
+
+  while (!serve_stop) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "accept: %s\n", strerror(errno));
+      break;
+    }
+    nez_ServeEnqueue(&server, fd);
+  }
+
+  /* connections held by workers are shut down to wake them up */
+  close(listen_fd);
+  unlink(socket_path);
+  pthread_mutex_lock(&server.lock);
+  server.stopping = 1;
+  for (int i = 0; i < server.worker_size; i++) {
+    if (server.workers[i].fd >= 0) {
+      shutdown(server.workers[i].fd, SHUT_RDWR);
+    }
+  }
+  pthread_cond_broadcast(&server.ready);
+  pthread_mutex_unlock(&server.lock);
+  for (int i = 0; i < server.worker_size; i++) {
+    pthread_join(server.workers[i].thread, NULL);
+  }
+  for (int i = 0; i < server.queue_size; i++) {
+    close(server.queue[(server.queue_head + i) % server.queue_capacity]);
+  }
+  nez_ServeDispose(&server);
+  return NEZ_OK;
+}
@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef NEZVM_SERVE_H
+#define NEZVM_SERVE_H
+
+/*
+** Protocol of the parse daemon (nezvm --serve) over a Unix domain socket.
+** A connection carries any number of requests, answered in order. Each
+** request is a header followed by rule_length bytes naming the start rule
+** (the grammar's default when 0) and length bytes of payload: the text to
+** parse, or the path of a file the daemon reads itself. Each response is
+** a header followed by message_length bytes of error message. Integers are
+** in host byte order since both ends are on the same machine. Only the
+** user running the daemon may connect to its socket.
+*/
+#define NEZVM_SERVE_MAGIC 0x5a454e /* "NEZ" */
+#define NEZVM_SERVE_BUFFER 0
+#define NEZVM_SERVE_FILE 1
+
+/* grammars are numbered in the order they were given to the daemon */
+#define NEZVM_SERVE_MAX_GRAMMARS 16
+#define NEZVM_SERVE_MAX_RULE 256
+#define NEZVM_SERVE_MAX_MESSAGE 1024
+/*
+** Longest input the daemon parses: it drops the connection on a longer
+** buffer, and answers NEZ_IO_ERROR for a longer file without reading it.
+*/
+#define NEZVM_SERVE_MAX_INPUT ((uint64_t)1 << 30)
+
+typedef struct NezServeRequest {
+  uint32_t magic;
+  uint32_t type;
+  uint32_t grammar;
+  uint32_t rule_length;
+  uint64_t length;
+} NezServeRequest;
+
+/*
+** status is one of enum nez_status; for a well-formed request that could
+** not be served (an unknown grammar, an unreadable file) it is
+** NEZ_RULE_ERROR or NEZ_IO_ERROR. elapsed covers the parse only, in
+** nanoseconds.
+*/
+typedef struct NezServeResponse {
+  int32_t status;
+  uint32_t message_length;
+  int64_t pos;
+  int64_t error_pos;
+  int64_t line;
+  int64_t column;
+  uint64_t elapsed;
+} NezServeResponse;
+
+/*
+** Runs the daemon until SIGINT or SIGTERM. Each of the workers keeps a
+** context per grammar and serves one connection at a time, so idle
+** connections held open by clients tie up a worker each.
+*/
+int nez_Serve(const char *socket_path, const char **grammars,
+              int grammar_size, const char *start_rule, int workers);
+
+/*
+** Client side, also used by nezclient and nezbench. Writes to a closed
+** connection raise SIGPIPE, which callers are expected to ignore.
+*/
+struct iovec;
+int nez_ServeRead(int fd, void *buf, size_t size);
+int nez_ServeWrite(int fd, struct iovec *iov, int iov_size);
+int nez_ServeConnect(const char *socket_path);
+int nez_ServeParse(int fd, int type, int grammar, const char *rule,
+                   const char *data, size_t length, NezServeResponse *response,
+                   char *message, size_t message_size);
+
+#endif
@@ -0,0 +1,79 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "libnez.h"
+#include "nezvm.h"
+#include "trace.h"
+
+static uint64_t nez_TraceClock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void nez_StartTrace(ParsingContext context, const NezVMInstruction *inst) {
+  struct ParsingTrace *trace = context->trace;
+  /* a request that came between parses is for the last one */
+  if (trace->requested && trace->start != 0) {
+    trace->requested = 0;
+    nez_DumpTrace(context, NEZVM_TRACE_REQUEST);
+  }
+  trace->count = 0;
+  trace->overrun = 0;
+  trace->rules = inst[0].arg0.rules;
+  trace->start = nez_TraceClock();
+}
+
+void nez_CheckTrace(ParsingContext context) {
+  struct ParsingTrace *trace = context->trace;
+  if (trace->requested) {
+    trace->requested = 0;
+    nez_DumpTrace(context, NEZVM_TRACE_REQUEST);
+  }
+  if (trace->budget > 0 && !trace->overrun
+      && nez_TraceClock() - trace->start > trace->budget) {
+    trace->overrun = 1;
+    nez_DumpTrace(context, NEZVM_TRACE_BUDGET);
+  }
+}
+
+int nez_DumpTrace(ParsingContext context, int reason) {
+  struct ParsingTrace *trace = context->trace;
+  nezvm_rules_ptr_t rules = (nezvm_rules_ptr_t)trace->rules;
+  uint64_t capacity = trace->mask + 1;
+  uint64_t size = trace->count < capacity ? trace->count : capacity;
+  uint64_t first = (trace->count - size) & trace->mask;
+  uint64_t head = capacity - first < size ? capacity - first : size;
+  static const char padding[8];
+  struct nezvm_trace header;
+  struct iovec iov[5];
+  int iov_size = 0;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, NEZVM_TRACE_MAGIC, sizeof(header.magic));
+  header.version = NEZVM_TRACE_VERSION;
+  header.reason = reason;
+  header.count = trace->count;
+  header.size = size;
+  header.rules = rules != NULL ? rules->size : 0;
+  header.input_length = context->input_size;
+  header.elapsed = nez_TraceClock() - trace->start;
+  iov[iov_size].iov_base = &header;
+  iov[iov_size++].iov_len = sizeof(header);
+  /* the ring wraps around once it is full */
+  iov[iov_size].iov_base = &trace->entries[first];
+  iov[iov_size++].iov_len = sizeof(struct ParsingTraceEntry) * head;
+  if (head < size) {
+    iov[iov_size].iov_base = trace->entries;
+    iov[iov_size++].iov_len = sizeof(struct ParsingTraceEntry) * (size - head);
+  }
+  if (rules != NULL) {
+    iov[iov_size].iov_base = rules;
+    iov[iov_size++].iov_len = rules->size;
+    iov[iov_size].iov_base = (void *)padding;
+    iov[iov_size++].iov_len = NEZVM_TRACE_ALIGN(rules->size) - rules->size;
+  }
+  trace->dumps++;
+  return nez_WriteAll(trace->fd, iov, iov_size) == 0 ? NEZ_OK : NEZ_IO_ERROR;
+}
@@ -0,0 +1,43 @@
+#include <stdint.h>
+
+#ifndef NEZVM_TRACE_H
+#define NEZVM_TRACE_H
+
+/*
+** Dump of a trace ring, as written by tracing parses (nezvm --trace) and
+** read by neztrace:
+**   header | struct ParsingTraceEntry[size], oldest first | rule table
+** The rule table is the nezvm_rules block of the program, rules bytes
+** long (0 for grammars without one) and padded to 8 bytes, so that
+** offsets can be named without the grammar. A file may hold several dumps
+** one after the other. Integers are in host byte order.
+*/
+#define NEZVM_TRACE_MAGIC "NEZVMTRC"
+#define NEZVM_TRACE_VERSION 1
+#define NEZVM_TRACE_ALIGN(N) (((N) + 7) & ~(uint64_t)7)
+
+/* why the ring was dumped */
+#define NEZVM_TRACE_EXIT 0
+#define NEZVM_TRACE_BUDGET 1
+#define NEZVM_TRACE_REQUEST 2
+
+struct nezvm_trace {
+  char magic[8];
+  uint32_t version;
+  uint32_t reason;
+  uint64_t count;         /* instructions traced in the parse so far */
+  uint64_t size;          /* entries in the dump */
+  uint64_t rules;
+  uint64_t input_length;
+  uint64_t elapsed;       /* nanoseconds since the parse started */
+};
+
+/*
+** Called by tracing parses on entry and every PARSING_TRACE_CHECK
+** instructions; nez_DumpTrace() may also be called between parses.
+*/
+void nez_StartTrace(ParsingContext context, const NezVMInstruction *inst);
+void nez_CheckTrace(ParsingContext context);
+int nez_DumpTrace(ParsingContext context, int reason);
+
+#endif
@@ -0,0 +1,418 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "libnez.h"
+#include "nezvm.h"
+#include "ast.h"
+
+/*
+** Text renderings of the capture events. A node is only known to be a
+** leaf when its END follows its BEGIN, so the last BEGIN is held back
+** until the next event. Text goes through one buffer; with
+** NEZVM_TEXT_THREAD a second one lets a thread write a full buffer while
+** the parse fills the other.
+*/
+typedef struct TextWriter {
+  int fd;
+  int format;
+  int error;
+  const char *inputs;
+  int tag_size;
+  const char **names;
+  size_t *name_length;
+  char *buf;
+  size_t used;
+  size_t capacity;
+  /* BEGIN not yet known to be a leaf */
+  int pending;
+  int pending_tag;
+  long pending_pos;
+  long depth;
+  int comma;
+  const char *escape[256];  /* NULL for bytes copied as they are */
+  char control[32][8];
+  /* threaded output */
+  int threaded;
+  int done;
+  char *spare;
+  char *out;                /* buffer handed to the thread, or NULL */
+  size_t out_size;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} TextWriter;
+
+static void *nez_WriterThread(void *arg) {
+  TextWriter *w = (TextWriter *)arg;
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    struct iovec iov;
+    int error;
+    while (w->out == NULL && !w->done) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (w->out == NULL) {
+      break;
+    }
+    iov.iov_base = w->out;
+    iov.iov_len = w->out_size;
+    pthread_mutex_unlock(&w->lock);
+    error = nez_WriteAll(w->fd, &iov, 1) != 0;
+    pthread_mutex_lock(&w->lock);
+    if (error) {
+      w->error = NEZ_IO_ERROR;
+    }
+    w->out = NULL;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/*
+** Empties the buffer. Without a thread, run (a long stretch of the input
+** that needs no escaping) is written from where it is in the same call.
+*/
+static void nez_WriterFlush(TextWriter *w, const char *run, size_t len) {
+  if (w->threaded) {
+    char *buf;
+    pthread_mutex_lock(&w->lock);
+    while (w->out != NULL) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    w->out = w->buf;
+    w->out_size = w->used;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    buf = w->buf;
+    w->buf = w->spare;
+    w->spare = buf;
+  }
+  else {
+    struct iovec iov[2];
+    iov[0].iov_base = w->buf;
+    iov[0].iov_len = w->used;
+    iov[1].iov_base = (void *)run;
+    iov[1].iov_len = len;
+    if (w->error == NEZ_OK && nez_WriteAll(w->fd, iov, 2) != 0) {
+      w->error = NEZ_IO_ERROR;
+    }
+  }
+  w->used = 0;
+}
+
+static inline void nez_WriteBytes(TextWriter *w, const char *p, size_t len) {
+  if (len <= w->capacity - w->used) {
+    memcpy(w->buf + w->used, p, len);
+    w->used += len;
+    return;
+  }
+  if (len >= NEZVM_TEXT_DIRECT && !w->threaded) {
+    nez_WriterFlush(w, p, len);
+    return;
+  }
+  while (len > 0) {
+    size_t n = w->capacity - w->used;
+    if (n == 0) {
+      nez_WriterFlush(w, NULL, 0);
+      n = w->capacity;
+    }
+    if (n > len) {
+      n = len;
+    }
+    memcpy(w->buf + w->used, p, n);
+    w->used += n;
+    p += n;
+    len -= n;
+  }
+}
+
+#define WRITE_LITERAL(W, S) nez_WriteBytes(W, S, sizeof(S) - 1)
+
+static void nez_WriteString(TextWriter *w, const char *s) {
+  nez_WriteBytes(w, s, strlen(s));
+}
+
+static void nez_WriteLong(TextWriter *w, long v) {
+  char digits[24];
+  char *p = digits + sizeof(digits);
+  unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u > 0);
+  if (v < 0) {
+    *--p = '-';
+  }
+  nez_WriteBytes(w, p, digits + sizeof(digits) - p);
+}
+
+static void nez_WriteEscaped(TextWriter *w, const char *p, const char *end) {
+  while (p < end) {
+    const char *run = p;
+    while (p < end && w->escape[(unsigned char)*p] == NULL) {
+      p++;
+    }
+    nez_WriteBytes(w, run, p - run);
+    if (p < end) {
+      nez_WriteString(w, w->escape[(unsigned char)*p++]);
+    }
+  }
+}
+
+static void nez_WriteName(TextWriter *w, int tag) {
+  if (tag >= 0 && tag < w->tag_size) {
+    nez_WriteBytes(w, w->names[tag], w->name_length[tag]);
+  }
+  else {
+    WRITE_LITERAL(w, "node");
+  }
+}
+
+static void nez_WriteIndent(TextWriter *w) {
+  for (long i = 0; i < w->depth; i++) {
+    WRITE_LITERAL(w, "  ");
+  }
+}
+
+static void nez_InitEscape(TextWriter *w) {
+  memset(w->escape, 0, sizeof(w->escape));
+  for (int c = 0; c < 32; c++) {
+    if (w->format == NEZVM_TEXT_JSON) {
+      snprintf(w->control[c], sizeof(w->control[c]), "\\u%04x", c);
+    }
+    else if (w->format == NEZVM_TEXT_XML) {
+      snprintf(w->control[c], sizeof(w->control[c]), "&#x%x;", c);
+    }
+    else {
+      snprintf(w->control[c], sizeof(w->control[c]), "\\x%02x", c);
+    }
+    w->escape[c] = w->control[c];
+  }
+  switch (w->format) {
+    case NEZVM_TEXT_JSON: {
+      w->escape['"'] = "\\\"";
+      w->escape['\\'] = "\\\\";
+      w->escape['\n'] = "\\n";
+      w->escape['\r'] = "\\r";
+      w->escape['\t'] = "\\t";
+      break;
+    }
+    case NEZVM_TEXT_XML: {
+      w->escape['<'] = "&lt;";
+      w->escape['>'] = "&gt;";
+      w->escape['&'] = "&amp;";
+      w->escape['\n'] = NULL;
+      w->escape['\t'] = NULL;
+      w->escape['\r'] = "&#xd;";
+      break;
+    }
+    default: {
+      w->escape['\''] = "\\'";
+      w->escape['\\'] = "\\\\";
+      w->escape['\n'] = "\\n";
+      w->escape['\r'] = "\\r";
+      w->escape['\t'] = "\\t";
+      break;
+    }
+  }
+}
+
+/* the held back BEGIN turned out to have children */
+static void nez_WriteOpen(TextWriter *w, int tag, long pos) {
+  switch (w->format) {
+    case NEZVM_TEXT_JSON: {
+      if (w->comma) {
+        WRITE_LITERAL(w, ",");
+      }
+      WRITE_LITERAL(w, "{\"tag\":\"");
+      nez_WriteName(w, tag);
+      WRITE_LITERAL(w, "\",\"pos\":");
+      nez_WriteLong(w, pos);
+      WRITE_LITERAL(w, ",\"children\":[");
+      w->comma = 0;
+      break;
+    }
+    case NEZVM_TEXT_XML: {
+      WRITE_LITERAL(w, "<");
+      nez_WriteName(w, tag);
+      WRITE_LITERAL(w, " pos=\"");
+      nez_WriteLong(w, pos);
+      WRITE_LITERAL(w, "\">");
+      break;
+    }
+    default: {
+      nez_WriteIndent(w);
+      WRITE_LITERAL(w, "{");
+      nez_WriteName(w, tag);
+      WRITE_LITERAL(w, "\n");
+      break;
+    }
+  }
+  w->depth++;
+}
+
+static void nez_WriteLeaf(TextWriter *w, int tag, long start, long end) {
+  const char *text = w->inputs + start;
+  switch (w->format) {
+    case NEZVM_TEXT_JSON: {
+      if (w->comma) {
+        WRITE_LITERAL(w, ",");
+      }
+      WRITE_LITERAL(w, "{\"tag\":\"");
+      nez_WriteName(w, tag);
+      WRITE_LITERAL(w, "\",\"pos\":");
+      nez_WriteLong(w, start);
+      WRITE_LITERAL(w, ",\"end\":");
+      nez_WriteLong(w, end);
+      WRITE_LITERAL(w, ",\"text\":\"");
+      nez_WriteEscaped(w, text, text + (end - start));
+      WRITE_LITERAL(w, "\"}");
+      w->comma = 1;
+      break;
+    }
+    case NEZVM_TEXT_XML: {
+      WRITE_LITERAL(w, "<");
+      nez_WriteName(w, tag);
+      WRITE_LITERAL(w, " pos=\"");
+      nez_WriteLong(w, start);
+      WRITE_LITERAL(w, "\">");
+      nez_WriteEscaped(w, text, text + (end - start));
+      WRITE_LITERAL(w, "</");
+      nez_WriteName(w, tag);
+      WRITE_LITERAL(w, ">");
+      break;
+    }
+    default: {
+      nez_WriteIndent(w);
+      WRITE_LITERAL(w, "{");
+      nez_WriteName(w, tag);
+      WRITE_LITERAL(w, " '");
+      nez_WriteEscaped(w, text, text + (end - start));
+      WRITE_LITERAL(w, "'}\n");
+      break;
+    }
+  }
+}
+
+static void nez_WriteClose(TextWriter *w, int tag, long end) {
+  w->depth--;
+  switch (w->format) {
+    case NEZVM_TEXT_JSON: {
+      WRITE_LITERAL(w, "],\"end\":");
+      nez_WriteLong(w, end);
+      WRITE_LITERAL(w, "}");
+      w->comma = 1;
+      break;
+    }
+    case NEZVM_TEXT_XML: {
+      WRITE_LITERAL(w, "</");
+      nez_WriteName(w, tag);
+      WRITE_LITERAL(w, ">");
+      break;
+    }
+    default: {
+      nez_WriteIndent(w);
+      WRITE_LITERAL(w, "}\n");
+      break;
+    }
+  }
+}
+
+static void nez_TextBegin(void *arg, int tag, long pos) {
+  TextWriter *w = (TextWriter *)arg;
+  if (w->pending) {
+    nez_WriteOpen(w, w->pending_tag, w->pending_pos);
+  }
+  w->pending = 1;
+  w->pending_tag = tag;
+  w->pending_pos = pos;
+}
+
+static void nez_TextEnd(void *arg, int tag, long start, long end) {
+  TextWriter *w = (TextWriter *)arg;
+  if (w->pending) {
+    w->pending = 0;
+    nez_WriteLeaf(w, tag, start, end);
+  }
+  else {
+    nez_WriteClose(w, tag, end);
+  }
+}
+
+int nez_ParseText(ParsingContext context, NezVMInstruction *inst, int format,
+                  int flags, int fd) {
+  ParsingSink sink = {nez_TextBegin, nez_TextEnd, NULL};
+  TextWriter *w = (TextWriter *)calloc(1, sizeof(TextWriter));
+  int status;
+  if (w == NULL) {
+    return NEZ_MEMORY_ERROR;
+  }
+  w->fd = fd;
+  w->format = format;
+  w->inputs = context->inputs;
+  if (inst[0].arg0.rules != NULL) {
+    nezvm_rules_ptr_t rules = inst[0].arg0.rules;
+    w->names = (const char **)malloc(sizeof(char *) * rules->rule_size);
+    w->name_length = (size_t *)malloc(sizeof(size_t) * rules->rule_size);
+    if (w->names != NULL && w->name_length != NULL) {
+      w->tag_size = rules->rule_size;
+      for (int i = 0; i < w->tag_size; i++) {
+        w->names[i] = NEZVM_RULE_NAME(rules, i);
+        w->name_length[i] = strlen(w->names[i]);
+      }
+    }
+  }
+  w->capacity = NEZVM_TEXT_BUFFER;
+  w->buf = (char *)malloc(w->capacity);
+  w->threaded = (flags & NEZVM_TEXT_THREAD) != 0;
+  if (w->threaded) {
+    w->spare = (char *)malloc(w->capacity);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (w->spare == NULL
+        || pthread_create(&w->thread, NULL, nez_WriterThread, w) != 0) {
+      w->threaded = 0;
+    }
+  }
+  if (w->buf == NULL) {
+    free(w->names);
+    free(w->name_length);
+    free(w->spare);
+    free(w);
+    return NEZ_MEMORY_ERROR;
+  }
+  nez_InitEscape(w);
+  sink.arg = w;
+  if (format == NEZVM_TEXT_XML) {
+    WRITE_LITERAL(w, "<?xml version=\"1.0\"?>\n");
+  }
+  status = nez_ParseSink(context, inst, &sink);
+  if (format != NEZVM_TEXT_PEGO) {
+    WRITE_LITERAL(w, "\n");
+  }
+  nez_WriterFlush(w, NULL, 0);
+  if (w->threaded) {
+    pthread_mutex_lock(&w->lock);
+    w->done = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+  }
+  if (status == NEZ_OK) {
+    status = w->error;
+  }
+  if (flags & NEZVM_TEXT_THREAD) {
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+  }
+  free(w->names);
+  free(w->name_length);
+  free(w->buf);
+  free(w->spare);
+  free(w);
+  return status;
+}